@@ -21,17 +21,33 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include "pcd_core.h"
 #undef pr_fmt
 #define pr_fmt(fmt) "%s :" fmt,__func__
 
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
+
+/*
+ * per call logs of the file methods, built in with PCD_VERBOSE=1 only
+ * production builds rely on the pcd tracepoints instead
+ */
+#ifdef PCD_VERBOSE
+#define pcd_dbg(fmt, ...) pr_info(fmt, ##__VA_ARGS__)
+#else
+#define pcd_dbg(fmt, ...) no_printk(fmt, ##__VA_ARGS__)
+#endif
+
 #define DEV_MEM_SIZE (512u)
 #define BASE_NUMBER (0u)
 #define DEVICE_COUNT (1u)
+#define DEVICE_NAME "pcd"
 
 /* File Methods */
 loff_t pcd_lseek (struct file *filp, loff_t offset, int whence);
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos);
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from);
 int pcd_open (struct inode *inode, struct file *filp);
 int pcd_release (struct inode *inode, struct file *filp);
 
@@ -49,8 +65,9 @@ struct file_operations pcd_fOps = {
     .llseek = pcd_lseek,
     .open = pcd_open,
     .release = pcd_release,
-    .read = pcd_read,
-    .write = pcd_write
+    /* read()/write() and readv()/writev() all go through the iter methods */
+    .read_iter = pcd_read_iter,
+    .write_iter = pcd_write_iter
     };
 
 /* sysfs class */
@@ -90,7 +107,7 @@ static int __init pcd_driver_init(void)
         goto err_class_create;
     }
     /*5. Create device under /sys/class/my_class */
-    device_pcd = device_create(class_pcd, NULL, device_number, NULL, "pcd");
+    device_pcd = device_create(class_pcd, NULL, device_number, NULL, DEVICE_NAME);
     if (IS_ERR(device_pcd))
     {
         pr_err("error Creating device \n");
@@ -128,106 +145,56 @@ static void __exit pcd_driver_cleanup(void)
 
 }
 
-/* File Methods */
+/* File Methods, the bounds and the copy are done by pcd_core */
 loff_t pcd_lseek (struct file *filp, loff_t offset, int whence)
 {
-    loff_t temp;
+    loff_t pos;
 
-    pr_info("lseek requested with offset %lld\n", offset);
-    pr_info("Initial value of the file pointer %lld\n", filp->f_pos);
+    trace_pcd_lseek(DEVICE_NAME, offset, whence, filp->f_pos);
+    pcd_dbg("lseek requested with offset %lld\n", offset);
+    pcd_dbg("Initial value of the file pointer %lld\n", filp->f_pos);
 
-    switch (whence)
-    {
-        case SEEK_SET:
-            if ((offset > DEV_MEM_SIZE) || (offset < 0))
-                return -EINVAL;
-            pr_info("SET value of the file pointer %lld\n", offset);
-            filp->f_pos = offset;
-            break;
-        case SEEK_CUR:
-            temp = filp->f_pos + offset;
-            if ((temp > DEV_MEM_SIZE) || (temp < 0))
-                return -EINVAL;
-
-            pr_info("CUR value of the file pointer %lld\n", offset);
-            filp->f_pos = temp;
-            break;
-        case SEEK_END:
-            temp = DEV_MEM_SIZE + offset;
-            if ((temp > DEV_MEM_SIZE) || (temp < 0))
-                return -EINVAL;
-            pr_info("END value of the file pointer %lld\n", offset);
-
-            filp->f_pos = temp;
-            break;
-
-        default:
-            return -EINVAL;
-
-    }
-    pr_info("Final value of the file pointer %lld\n", filp->f_pos);
-    return filp->f_pos;
+    pos = pcd_core_llseek(filp, offset, whence, DEV_MEM_SIZE);
+    pcd_dbg("Final value of the file pointer %lld\n", filp->f_pos);
+    return pos;
 }
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos)
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to)
 {
-    pr_info("Read requested for %zu bytes \n", count);
-    pr_info("Position before read %lld \n", *f_pos);
-    
-    /* Adjust the count */
-    if ((count + *f_pos) > DEV_MEM_SIZE)
-    {
-        pr_info("Requested count is out of boundary \n");
-        count = DEV_MEM_SIZE - *f_pos;
-    }
+    ssize_t ret;
 
-    /* Copy to user */
-    if (copy_to_user(buff, &(device_buffer[*f_pos]), count))
-    {
-        pr_err("Error copying to user \n");
-        return -EFAULT;
-    }
+    trace_pcd_read(DEVICE_NAME, iov_iter_count(to), iocb->ki_pos);
+    pcd_dbg("Read requested for %zu bytes \n", iov_iter_count(to));
+    pcd_dbg("Position before read %lld \n", iocb->ki_pos);
 
-    /* Update f_pos */
-    *f_pos += count;
-    pr_info("Position after read %lld \n", *f_pos);
+    ret = pcd_core_read_iter(iocb, to, device_buffer, DEV_MEM_SIZE);
+    pcd_dbg("Position after read %lld \n", iocb->ki_pos);
 
     /* return the number of character successfully read*/
-    return count;
+    return ret;
 }
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos)
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from)
 {
-    pr_info("Wrire requested for %zu bytes \n", count);
-    pr_info("Position before writing %lld \n", *f_pos);
-    
-    /* Adjust the count */
-    if ((count + *f_pos) > DEV_MEM_SIZE)
-    {
-        pr_info("Requested count is out of boundary \n");
-        count = DEV_MEM_SIZE - *f_pos;
-    }
+    ssize_t ret;
 
-    /* Copy from user */
-    if (copy_from_user(&(device_buffer[*f_pos]),buff, count))
-    {
-        pr_err("Error copying from user \n");
-        return -EFAULT;
-    }
+    trace_pcd_write(DEVICE_NAME, iov_iter_count(from), iocb->ki_pos);
+    pcd_dbg("Wrire requested for %zu bytes \n", iov_iter_count(from));
+    pcd_dbg("Position before writing %lld \n", iocb->ki_pos);
 
-    /* Update f_pos */
-    *f_pos += count;
-    pr_info("Position after writing %lld \n", *f_pos);
+    ret = pcd_core_write_iter(iocb, from, device_buffer, DEV_MEM_SIZE);
+    pcd_dbg("Position after writing %lld \n", iocb->ki_pos);
 
-    /* return the number of character successfully read*/
-    return count;
+    /* return the number of character successfully written*/
+    return ret;
 }
 int pcd_open (struct inode *inode, struct file *filp)
 {
-    pr_info("PCD file oped successfully!\n");
+    trace_pcd_open(DEVICE_NAME, MINOR(inode->i_rdev), filp->f_mode);
+    pcd_dbg("PCD file oped successfully!\n");
     return 0;
 }
 int pcd_release (struct inode *inode, struct file *filp)
 {
-    pr_info("Close requested\n");
+    pcd_dbg("Close requested\n");
     return 0;
 }
 
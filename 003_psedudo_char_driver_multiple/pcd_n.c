@@ -21,12 +21,31 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/moduleparam.h>
+#include <linux/log2.h>
+#include <linux/bitops.h>
+#include <linux/cache.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include "pcd_core.h"
 #undef pr_fmt
 #define pr_fmt(fmt) "%s :" fmt,__func__
 
-#define RDONLY 0x01u
-#define WRONLY 0x10u
-#define RDWR 0x11u
+#define CREATE_TRACE_POINTS
+#include "pcd_n_trace.h"
+
+/*
+ * per call logs of the file methods, built in with PCD_VERBOSE=1 only
+ * production builds rely on the pcd_n tracepoints instead
+ */
+#ifdef PCD_VERBOSE
+#define pcd_dbg(fmt, ...) pr_info(fmt, ##__VA_ARGS__)
+#else
+#define pcd_dbg(fmt, ...) no_printk(fmt, ##__VA_ARGS__)
+#endif
+
 
 #define DEV0_MEM_SIZE (1024u)
 #define DEV1_MEM_SIZE (512u)
@@ -36,14 +55,35 @@
 #define BASE_NUMBER (0u)
 #define DEVICE_COUNT (4u)
 
+/* FIFO mode: bits of pcdev_private_data::fifo_users */
+#define FIFO_READER (0)
+#define FIFO_WRITER (1)
+
 /* File Methods */
 loff_t pcd_lseek (struct file *filp, loff_t offset, int whence);
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos);
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from);
 int pcd_open (struct inode *inode, struct file *filp);
 int pcd_release (struct inode *inode, struct file *filp);
+__poll_t pcd_poll (struct file *filp, poll_table *wait);
 /* helper functions */
-int check_permission(int dev_perm, int access_mode);
+struct pcdev_private_data;
+static ssize_t pcd_fifo_read(struct pcdev_private_data *pcdev_data, struct kiocb *iocb, struct iov_iter *to);
+static ssize_t pcd_fifo_write(struct pcdev_private_data *pcdev_data, struct kiocb *iocb, struct iov_iter *from);
+static unsigned int pcd_fifo_used(struct pcdev_private_data *pcdev_data);
+static bool pcd_fifo_eof(struct pcdev_private_data *pcdev_data);
+static void pcd_fifo_wake(wait_queue_head_t *queue);
+static int pcd_fifo_lock(struct mutex *lock, struct kiocb *iocb);
+
+/*
+ * devices working as a single-producer/single-consumer FIFO, one bit per device
+ * only RDWR devices with a power of two size can be used, e.g. fifo_devices=0xc for RGBPCD2/RGBPCD3
+ * a FIFO is opened either O_RDONLY by its consumer or O_WRONLY by its producer
+ */
+static unsigned int fifo_devices;
+module_param(fifo_devices, uint, 0444);
+MODULE_PARM_DESC(fifo_devices, "bitmask of devices working in FIFO mode");
+
 /* Module data r/w buffer*/
 char device0_buffer[DEV0_MEM_SIZE];
 char device1_buffer[DEV1_MEM_SIZE];
@@ -65,6 +105,24 @@ struct pcdev_private_data
     struct cdev cdev;
     /* sysfs device */
     struct device* device_pcd;
+    /* FIFO mode, pcd_read consumes and pcd_write produces */
+    bool fifo;
+    /* FIFO_READER/FIFO_WRITER taken by the open files, one of each at most */
+    unsigned long fifo_users;
+    /* producer opens so far, and their count when the consumer opened: end of file needs one more */
+    unsigned int writer_opens;
+    unsigned int reader_writer_opens;
+    /* threads sharing the file of one side take turns, the ring only has one index per side */
+    struct mutex read_lock;
+    struct mutex write_lock;
+    /* free running producer index, written by pcd_write only */
+    unsigned int head ____cacheline_aligned_in_smp;
+    /* free running consumer index, written by pcd_read only */
+    unsigned int tail ____cacheline_aligned_in_smp;
+    /* a blocking reader sleeps here until data comes or the producer leaves */
+    wait_queue_head_t read_queue;
+    /* a blocking writer sleeps here until the consumer frees slots */
+    wait_queue_head_t write_queue;
 };
 
 /* Driver private data */
@@ -117,8 +175,10 @@ struct file_operations pcd_fOps = {
     .llseek = pcd_lseek,
     .open = pcd_open,
     .release = pcd_release,
-    .read = pcd_read,
-    .write = pcd_write
+    /* read()/write() and readv()/writev() all go through the iter methods */
+    .read_iter = pcd_read_iter,
+    .write_iter = pcd_write_iter,
+    .poll = pcd_poll
     };
 
 
@@ -126,6 +186,23 @@ static int __init pcd_driver_init(void)
 {
     int ret;
     int i;
+    /*0. select the FIFO devices, the ring indices are masked with size - 1 */
+    for (i = 0; i < DEVICE_COUNT; i++)
+    {
+        init_waitqueue_head(&pcdrv_data.pcdev_data[i].read_queue);
+        init_waitqueue_head(&pcdrv_data.pcdev_data[i].write_queue);
+        mutex_init(&pcdrv_data.pcdev_data[i].read_lock);
+        mutex_init(&pcdrv_data.pcdev_data[i].write_lock);
+        if (!(fifo_devices & BIT(i)))
+            continue;
+        if ((pcdrv_data.pcdev_data[i].perm != RDWR) || !is_power_of_2(pcdrv_data.pcdev_data[i].size))
+        {
+            pr_err("%s can't work in FIFO mode\n", pcdrv_data.pcdev_data[i].serial_number);
+            return -EINVAL;
+        }
+        pcdrv_data.pcdev_data[i].fifo = true;
+        pr_info("%s works in FIFO mode\n", pcdrv_data.pcdev_data[i].serial_number);
+    }
     /*1. Dynamically allocate a device numer*/
     ret = alloc_chrdev_region(&pcdrv_data.device_number, BASE_NUMBER, DEVICE_COUNT, "pcd_devices");
     if (ret < 0)
@@ -207,131 +284,228 @@ loff_t pcd_lseek (struct file *filp, loff_t offset, int whence)
 {
     struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
 
-    int max_size = pcdev_data->size;
+    loff_t pos;
 
-    loff_t temp;
+    trace_pcd_lseek(pcdev_data->serial_number, offset, whence, filp->f_pos);
+    pcd_dbg("%s: lseek requested with offset %lld\n", pcdev_data->serial_number, offset);
+    pcd_dbg("Initial value of the file pointer %lld\n", filp->f_pos);
 
-    pr_info("%s: lseek requested with offset %lld\n", pcdev_data->serial_number, offset);
-    pr_info("Initial value of the file pointer %lld\n", filp->f_pos);
+    pos = pcd_core_llseek(filp, offset, whence, pcdev_data->size);
+    pcd_dbg("Final value of the file pointer %lld\n", filp->f_pos);
+    return pos;
+}
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to)
+{
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
 
-    switch (whence)
-    {
-        case SEEK_SET:
-            if ((offset > max_size) || (offset < 0))
-                return -EINVAL;
-            pr_info("SET value of the file pointer %lld\n", offset);
-            filp->f_pos = offset;
-            break;
-        case SEEK_CUR:
-            temp = filp->f_pos + offset;
-            if ((temp > max_size) || (temp < 0))
-                return -EINVAL;
-
-            pr_info("CUR value of the file pointer %lld\n", offset);
-            filp->f_pos = temp;
-            break;
-        case SEEK_END:
-            temp = max_size + offset;
-            if ((temp > max_size) || (temp < 0))
-                return -EINVAL;
-            pr_info("END value of the file pointer %lld\n", offset);
-
-            filp->f_pos = temp;
-            break;
-
-        default:
-            return -EINVAL;
+    ssize_t ret;
 
-    }
-    pr_info("Final value of the file pointer %lld\n", filp->f_pos);
-    return filp->f_pos;
+    trace_pcd_read(pcdev_data->serial_number, iov_iter_count(to), iocb->ki_pos);
+    pcd_dbg("%s: Read requested for  %zu bytes \n", pcdev_data->serial_number, iov_iter_count(to));
+
+    if (pcdev_data->fifo)
+        return pcd_fifo_read(pcdev_data, iocb, to);
+
+    pcd_dbg("Position before read %lld \n", iocb->ki_pos);
+
+    /* flat device, the bounds and the copy are done by pcd_core */
+    ret = pcd_core_read_iter(iocb, to, pcdev_data->buffer, pcdev_data->size);
+    pcd_dbg("Position after read %lld \n", iocb->ki_pos);
+
+    /* return the number of character successfully read*/
+    return ret;
 }
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos)
+
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from)
 {
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
 
-    int max_size = pcdev_data->size;
+    ssize_t ret;
 
-    pr_info("%s: Read requested for  %zu bytes \n", pcdev_data->serial_number, count);
-    pr_info("Position before read %lld \n", *f_pos);
-    
-    /* Adjust the count */
-    if ((count + *f_pos) > max_size)
+    trace_pcd_write(pcdev_data->serial_number, iov_iter_count(from), iocb->ki_pos);
+    pcd_dbg("%s: Wrire requested for %zu bytes \n", pcdev_data->serial_number, iov_iter_count(from));
+
+    if (pcdev_data->fifo)
+        return pcd_fifo_write(pcdev_data, iocb, from);
+
+    pcd_dbg("Position before writing %lld \n", iocb->ki_pos);
+
+    /* flat device, the bounds and the copy are done by pcd_core */
+    ret = pcd_core_write_iter(iocb, from, pcdev_data->buffer, pcdev_data->size);
+    pcd_dbg("Position after writing %lld \n", iocb->ki_pos);
+
+    /* return the number of character successfully written*/
+    return ret;
+}
+
+/*
+ * FIFO mode
+ * lock free between the reader and the writer: each side owns one index and only reads the other,
+ * the acquire/release pairs order the buffer accesses against the index updates
+ * empty/full block like a pipe, -EAGAIN only with O_NONBLOCK, each side wakes the other one up
+ */
+static unsigned int pcd_fifo_used(struct pcdev_private_data *pcdev_data)
+{
+    /* pairs with smp_store_release() in pcd_fifo_write, the data is visible once head is */
+    return smp_load_acquire(&pcdev_data->head) - pcdev_data->tail;
+}
+
+/* like a pipe, end of file once a producer came after the consumer opened and left again */
+static bool pcd_fifo_eof(struct pcdev_private_data *pcdev_data)
+{
+    return !test_bit(FIFO_WRITER, &pcdev_data->fifo_users) &&
+        (READ_ONCE(pcdev_data->writer_opens) != pcdev_data->reader_writer_opens);
+}
+
+/*
+ * most transfers find nobody asleep, skip the queue lock then
+ * the smp_mb() of wq_has_sleeper() orders the index update before the queue check, it pairs with
+ * the one of set_current_state() in wait_event and with the smp_mb() after poll_wait in pcd_poll
+ */
+static void pcd_fifo_wake(wait_queue_head_t *queue)
+{
+    if (wq_has_sleeper(queue))
+        wake_up_interruptible(queue);
+}
+
+/* the side of the FIFO iocb is on, one thread at a time */
+static int pcd_fifo_lock(struct mutex *lock, struct kiocb *iocb)
+{
+    if (iocb->ki_filp->f_flags & O_NONBLOCK)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    return mutex_lock_interruptible(lock);
+}
+
+static ssize_t pcd_fifo_read(struct pcdev_private_data *pcdev_data, struct kiocb *iocb, struct iov_iter *to)
+{
+    unsigned int mask = pcdev_data->size - 1;
+    unsigned int tail;
+    unsigned int used;
+    unsigned int offset;
+    size_t count, first, copied;
+    ssize_t ret;
+
+    ret = pcd_fifo_lock(&pcdev_data->read_lock, iocb);
+    if (ret)
+        return ret;
+    tail = pcdev_data->tail;
+    offset = tail & mask;
+
+    while (!(used = pcd_fifo_used(pcdev_data)))
     {
-        pr_info("Requested count is out of boundary \n");
-        count = max_size - *f_pos;
+        /* no data and no producer means end of file, before the first producer it means waiting */
+        if (pcd_fifo_eof(pcdev_data))
+            goto out;
+        if (iocb->ki_filp->f_flags & O_NONBLOCK)
+        {
+            ret = -EAGAIN;
+            goto out;
+        }
+        ret = wait_event_interruptible(pcdev_data->read_queue,
+                pcd_fifo_used(pcdev_data) || pcd_fifo_eof(pcdev_data));
+        if (ret)
+            goto out;
     }
 
-    /* Copy to user */
-    if (copy_to_user(buff, &(pcdev_data->buffer[*f_pos]), count))
+    /* Adjust the count, the copy wraps at most once */
+    count = min_t(size_t, iov_iter_count(to), used);
+    first = min_t(size_t, count, pcdev_data->size - offset);
+
+    /* Copy to user, the wrapped part only if the first one went through */
+    copied = copy_to_iter(&(pcdev_data->buffer[offset]), first, to);
+    if (copied == first)
+        copied += copy_to_iter(pcdev_data->buffer, count - first, to);
+    if (!copied)
     {
         pr_err("Error copying to user \n");
-        return -EFAULT;
+        ret = -EFAULT;
+        goto out;
     }
 
-    /* Update f_pos */
-    *f_pos += count;
-    pr_info("Position after read %lld \n", *f_pos);
-
-    /* return the number of character successfully read*/
-    return count;
+    /* hand the slots back to the producer */
+    smp_store_release(&pcdev_data->tail, tail + copied);
+    pcd_fifo_wake(&pcdev_data->write_queue);
+    ret = copied;
+out:
+    mutex_unlock(&pcdev_data->read_lock);
+    return ret;
 }
 
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos)
+static ssize_t pcd_fifo_write(struct pcdev_private_data *pcdev_data, struct kiocb *iocb, struct iov_iter *from)
 {
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
-
-    int max_size = pcdev_data->size;
-    pr_info("%s: Wrire requested for %zu bytes \n", pcdev_data->serial_number, count);
-    pr_info("Position before writing %lld \n", *f_pos);
-    
-    /* Adjust the count */
-    if ((count + *f_pos) > max_size)
+    unsigned int mask = pcdev_data->size - 1;
+    unsigned int head;
+    unsigned int space;
+    unsigned int offset;
+    size_t count, first, copied;
+    ssize_t ret;
+
+    ret = pcd_fifo_lock(&pcdev_data->write_lock, iocb);
+    if (ret)
+        return ret;
+    head = pcdev_data->head;
+    offset = head & mask;
+
+    /* pairs with smp_store_release() in pcd_fifo_read, the slots are free once tail is */
+    while (!(space = pcdev_data->size - (head - smp_load_acquire(&pcdev_data->tail))))
     {
-        pr_info("Requested count is out of boundary \n");
-        if (*f_pos >= max_size)
+        if (iocb->ki_filp->f_flags & O_NONBLOCK)
         {
-            /* discard writing */
-            return count;
+            ret = -EAGAIN;
+            goto out;
         }
-        count = max_size - *f_pos;
-
+        ret = wait_event_interruptible(pcdev_data->write_queue,
+                head != smp_load_acquire(&pcdev_data->tail) + pcdev_data->size);
+        if (ret)
+            goto out;
     }
 
-    /* Copy from user */
-    if (copy_from_user(&(pcdev_data->buffer[*f_pos]),buff, count))
+    /* Adjust the count, the copy wraps at most once */
+    count = min_t(size_t, iov_iter_count(from), space);
+    first = min_t(size_t, count, pcdev_data->size - offset);
+
+    /* Copy from user, the wrapped part only if the first one went through */
+    copied = copy_from_iter(&(pcdev_data->buffer[offset]), first, from);
+    if (copied == first)
+        copied += copy_from_iter(pcdev_data->buffer, count - first, from);
+    if (!copied)
     {
         pr_err("Error copying from user \n");
-        return -EFAULT;
+        ret = -EFAULT;
+        goto out;
     }
 
-    /* Update f_pos */
-    *f_pos += count;
-    pr_info("Position after writing %lld \n", *f_pos);
-
-    /* return the number of character successfully read*/
-    return count;
-
+    /* publish the data to the consumer */
+    smp_store_release(&pcdev_data->head, head + copied);
+    pcd_fifo_wake(&pcdev_data->read_queue);
+    ret = copied;
+out:
+    mutex_unlock(&pcdev_data->write_lock);
+    return ret;
 }
 
-int check_permission(int dev_perm, int access_mode)
+/* a flat device never blocks, a FIFO is readable with data or at end of file and writable with space */
+__poll_t pcd_poll (struct file *filp, poll_table *wait)
 {
-    pr_info("Perm: 0x%x",dev_perm);
-    switch (dev_perm)
-    {
-        case RDONLY:
-            if((access_mode & FMODE_READ) && !(access_mode & FMODE_WRITE))
-                return 0;
-            break;
-        case WRONLY:
-            if(!(access_mode & FMODE_READ) && (access_mode & FMODE_WRITE))
-                return 0;
-            break;
-        case RDWR:
-            return 0;
-    }
-    return -EPERM;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    __poll_t mask = 0;
+    unsigned int used;
+
+    if (!pcdev_data->fifo)
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &pcdev_data->read_queue, wait);
+    poll_wait(filp, &pcdev_data->write_queue, wait);
+    /* the queues before the indices, pairs with wq_has_sleeper() in pcd_fifo_wake */
+    smp_mb();
+    used = pcd_fifo_used(pcdev_data);
+    if (used || pcd_fifo_eof(pcdev_data))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (used < pcdev_data->size)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
 }
+
 int pcd_open (struct inode *inode, struct file *filp)
 {
     int ret;
@@ -339,21 +513,73 @@ int pcd_open (struct inode *inode, struct file *filp)
     struct pcdev_private_data *pcdev_data = NULL;
     /* find out on which device file the open operation was attempted from the user space */
     minor_number = MINOR(inode->i_rdev);
-    pr_info("Minor Access: %d\n", minor_number);
+    pcd_dbg("Minor Access: %d\n", minor_number);
 
     /* get device private data structure */
     pcdev_data = container_of(inode->i_cdev,struct pcdev_private_data, cdev);
     /* save private data of this file in the file pointer so other methods can access it */
     filp->private_data = pcdev_data;
+    trace_pcd_open(pcdev_data->serial_number, minor_number, filp->f_mode);
     /* check permission */
-    ret = check_permission(pcdev_data->perm, filp->f_mode);
-    (!ret)? pr_info("PCD %d file oped successfully!\n", minor_number) : pr_info("PCD %d file failed to open!\n", minor_number);
+    pcd_dbg("Perm: 0x%x", pcdev_data->perm);
+    ret = pcd_core_check_permission(pcdev_data->perm, filp->f_mode);
+    if (!ret && pcdev_data->fifo)
+    {
+        /* a FIFO has no file position, and takes one producer and one consumer */
+        stream_open(inode, filp);
+        if ((filp->f_mode & (FMODE_READ | FMODE_WRITE)) == (FMODE_READ | FMODE_WRITE))
+        {
+            /* one file on both sides would wait for itself */
+            ret = -EINVAL;
+        }
+        else if (filp->f_mode & FMODE_READ)
+        {
+            if (test_and_set_bit(FIFO_READER, &pcdev_data->fifo_users))
+            {
+                ret = -EBUSY;
+            }
+            else
+            {
+                /*
+                 * a producer attached now counts as seen: opens is read before the bit,
+                 * the producer sets the bit (a full barrier) before counting its open
+                 */
+                pcdev_data->reader_writer_opens = READ_ONCE(pcdev_data->writer_opens);
+                smp_rmb();
+                if (test_bit(FIFO_WRITER, &pcdev_data->fifo_users))
+                    pcdev_data->reader_writer_opens--;
+            }
+        }
+        else if (test_and_set_bit(FIFO_WRITER, &pcdev_data->fifo_users))
+        {
+            ret = -EBUSY;
+        }
+        else
+        {
+            WRITE_ONCE(pcdev_data->writer_opens, pcdev_data->writer_opens + 1);
+        }
+    }
+    (!ret)? pcd_dbg("PCD %d file oped successfully!\n", minor_number) : pcd_dbg("PCD %d file failed to open!\n", minor_number);
 
     return ret;
 }
 int pcd_release (struct inode *inode, struct file *filp)
 {
-    pr_info("Close requested\n");
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
+    if (pcdev_data->fifo)
+    {
+        /* release the FIFO roles taken in pcd_open */
+        if (filp->f_mode & FMODE_READ)
+            clear_bit(FIFO_READER, &pcdev_data->fifo_users);
+        if (filp->f_mode & FMODE_WRITE)
+        {
+            clear_bit(FIFO_WRITER, &pcdev_data->fifo_users);
+            /* a reader sleeping on an empty FIFO gets its end of file */
+            pcd_fifo_wake(&pcdev_data->read_queue);
+        }
+    }
+    pcd_dbg("Close requested\n");
     return 0;
 }
 
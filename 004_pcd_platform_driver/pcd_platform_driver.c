@@ -21,6 +21,7 @@
 #include <linux/cdev.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
 #include <linux/mod_devicetable.h>
 #include "platform.h"
 
@@ -32,27 +33,32 @@ int pcd_platform_driver_remove(struct platform_device *);
 
 /* File Methods */
 loff_t pcd_lseek (struct file *filp, loff_t offset, int whence);
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos);
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from);
 int pcd_open (struct inode *inode, struct file *filp);
 int pcd_release (struct inode *inode, struct file *filp);
 
 /* helper functions */
-static int check_permission(int dev_perm, int access_mode);
+struct pcdev_private_data;
+static int pcd_get_buffer(struct pcdev_private_data *pcdev_data);
+static void pcd_release_device(struct device *dev);
 
 /* per device private data <<dynamic>> */
 struct pcdev_private_data {
     struct pcdev_platform_data pdata;
+    /* allocated by the first open */
     char *buffer;
     dev_t dev_num;
     struct cdev cdev;
-    struct device *device_pcd;
+    /* its release frees the device data and the buffer, open files hold a reference past remove */
+    struct device device_pcd;
 };
 
 /* driver private data <<static>>*/
 struct pcdrv_private_data
 {
-    int total_devices;
+    /* probes run in parallel */
+    atomic_t total_devices;
     dev_t device_num_base;
     struct class *class_pcd;
 };
@@ -62,8 +68,8 @@ struct file_operations pcd_fOps = {
     .llseek = pcd_lseek,
     .open = pcd_open,
     .release = pcd_release,
-    .read = pcd_read,
-    .write = pcd_write
+    .read_iter = pcd_read_iter,
+    .write_iter = pcd_write_iter
     };
 struct device_configuration {
     int config_item_1;
@@ -99,13 +105,15 @@ struct platform_driver pcd_platform_driver = {
     .remove = pcd_platform_driver_remove,
     .id_table = pcd_id_table,
     .driver = {
-        .name = "pseudo-char-device"
+        .name = "pseudo-char-device",
+        /* devices are probed in parallel, off the module load/device registration path */
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS
     }
 };
 
 
 /* Driver private data object */
-struct pcdrv_private_data pcdrv_data = {.total_devices = 0};
+struct pcdrv_private_data pcdrv_data = {.total_devices = ATOMIC_INIT(0)};
 
 
 static int __init pcd_driver_init(void)
@@ -147,46 +155,74 @@ static void __exit pcd_driver_cleanup(void)
     pr_info("Driver module removed successfully \n");
 }
 
-/* File Methods */
+/* File Methods, the bounds and the copy are done by pcd_core */
 loff_t pcd_lseek (struct file *filp, loff_t offset, int whence)
 {
-    return 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
+    return pcd_core_llseek(filp, offset, whence, pcdev_data->pdata.size);
 }
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos)
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to)
 {
-    return 0;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+
+    return pcd_core_read_iter(iocb, to, pcdev_data->buffer, pcdev_data->pdata.size);
 }
 
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos)
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from)
 {
-    return -ENOMEM;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+
+    return pcd_core_write_iter(iocb, from, pcdev_data->buffer, pcdev_data->pdata.size);
 }
 
-static int check_permission(int dev_perm, int access_mode)
+int pcd_open (struct inode *inode, struct file *filp)
 {
-    pr_info("Perm: 0x%x",dev_perm);
-    switch (dev_perm)
-    {
-        case RDONLY:
-            if((access_mode & FMODE_READ) && !(access_mode & FMODE_WRITE))
-                return 0;
-            break;
-        case WRONLY:
-            if(!(access_mode & FMODE_READ) && (access_mode & FMODE_WRITE))
-                return 0;
-            break;
-        case RDWR:
-            return 0;
-    }
-    return -EPERM;
+    struct pcdev_private_data *pcdev_data = container_of(inode->i_cdev, struct pcdev_private_data, cdev);
+    int ret;
+
+    ret = pcd_core_open(filp, pcdev_data->pdata.perm, pcdev_data);
+    if (ret)
+        return ret;
+    ret = pcd_get_buffer(pcdev_data);
+    if (ret)
+        return ret;
+    /* dropped by pcd_release, the device may be removed by then */
+    get_device(&pcdev_data->device_pcd);
+    return 0;
 }
-int pcd_open (struct inode *inode, struct file *filp)
+/* the buffer is allocated and zeroed by the first open, so probing stays cheap with many or large devices */
+/* kmalloc or vmalloc by its size, see pcd_alloc_flat_buffer */
+static int pcd_get_buffer(struct pcdev_private_data *pcdev_data)
 {
+    char *buffer;
+
+    if (READ_ONCE(pcdev_data->buffer))
+        return 0;
+    buffer = pcd_alloc_flat_buffer(pcdev_data->pdata.size);
+    if (!buffer)
+        return -ENOMEM;
+    /* concurrent first opens, only one of the buffers is kept */
+    if (cmpxchg(&pcdev_data->buffer, NULL, buffer))
+        pcd_free_flat_buffer(buffer);
     return 0;
 }
+/* release of the class device, the last reference: removed and no file open anymore */
+static void pcd_release_device(struct device *dev)
+{
+    struct pcdev_private_data *pcdev_data = container_of(dev, struct pcdev_private_data, device_pcd);
+
+    /* the buffer comes from the first open, it isn't devm managed */
+    pcd_free_flat_buffer(pcdev_data->buffer);
+    kfree_const(pcdev_data->pdata.serial_number);
+    kfree(pcdev_data);
+}
 int pcd_release (struct inode *inode, struct file *filp)
 {
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
     pr_info("Close requested\n");
+    put_device(&pcdev_data->device_pcd);
     return 0;
 }
 
@@ -206,7 +242,8 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
         goto err_no_pdata;
     }
     /* 2. Dynamically allocate memory for the private data */
-    dev_data = (struct pcdev_private_data *) devm_kzalloc(&pdev->dev, sizeof(*dev_data), GFP_KERNEL);
+    /* not devm, open files outlive the device, see pcd_release_device */
+    dev_data = (struct pcdev_private_data *) kzalloc(sizeof(*dev_data), GFP_KERNEL);
     if (!dev_data)
     {
         pr_info("Cannot allocate memory \n");
@@ -219,7 +256,13 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
 
     dev_data->pdata.size  = pdata->size;
     dev_data->pdata.perm  = pdata->perm;
-    dev_data->pdata.serial_number  = pdata->serial_number;
+    /* pdata goes away with the device, the open files still print the serial number */
+    dev_data->pdata.serial_number  = kstrdup_const(pdata->serial_number, GFP_KERNEL);
+    if (!dev_data->pdata.serial_number)
+    {
+        ret = -ENOMEM;
+        goto err_serial_number;
+    }
 
     pr_info("Device serial_number = %s\n", dev_data->pdata.serial_number);
     pr_info("Device perm = 0x%x\n", dev_data->pdata.perm);
@@ -228,47 +271,39 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
     pr_info("DRIVER DATA: config_item_1 = %d\n", device_configs[pdev->id_entry->driver_data].config_item_1);
     pr_info("DRIVER DATA: config_item_2 = %d\n", device_configs[pdev->id_entry->driver_data].config_item_2);
     
-    /* 3. Dynamically allocate memory for the device buffer using size information from the platform data */
-    dev_data->buffer = (char *) devm_kzalloc(&pdev->dev, dev_data->pdata.size, GFP_KERNEL);
-    if (!dev_data->buffer)
-    {
-        pr_info("Cannot allocate memory \n");
-        ret = -ENOMEM;
-        goto err_no_dev_memory;
-    }
+    /* 3. the device buffer is allocated by the first open, see pcd_get_buffer */
     /* 4. get the device number */
     dev_data->dev_num = pcdrv_data.device_num_base + pdev->id;
 
-    /* 5. do cdev_init and cdev_add */
+    /* 5. the device file, from here on the device data is freed by the release of its device */
+    device_initialize(&dev_data->device_pcd);
+    dev_data->device_pcd.class = pcdrv_data.class_pcd;
+    dev_data->device_pcd.devt = dev_data->dev_num;
+    dev_data->device_pcd.release = pcd_release_device;
+    ret = dev_set_name(&dev_data->device_pcd, "rgbpcdev-%d", pdev->id);
+    if (ret)
+        goto err_device_add;
+
+    /* 6. do cdev_init, the cdev holds the device while a file is open */
     cdev_init(&dev_data->cdev, &pcd_fOps);
     dev_data->cdev.owner = THIS_MODULE;
 
-    ret = cdev_add(&dev_data->cdev, dev_data->dev_num, 1);
+    ret = cdev_device_add(&dev_data->cdev, &dev_data->device_pcd);
     if (ret < 0)
-    {
-        pr_err("cdev add failed\n");
-        goto err_cdev_add;
-    }
-    /* 6. Create device file for the detected platform */
-    dev_data->device_pcd = device_create(pcdrv_data.class_pcd, NULL, dev_data->dev_num, NULL, "rgbpcdev-%d", pdev->id);
-    if (IS_ERR(dev_data->device_pcd))
     {
         pr_err("error Creating device \n");
-        ret = PTR_ERR(dev_data->device_pcd);
-        goto err_device_create;
+        goto err_device_add;
     }
     /* 7. Error handling */
     pr_info("A device is probed: %s-%d\n", pdev->name, pdev->id);
-    pcdrv_data.total_devices++;
-    pr_info("Devices manged: %d\n", pcdrv_data.total_devices);
+    pr_info("Devices manged: %d\n", atomic_inc_return(&pcdrv_data.total_devices));
 
     return 0;
-err_device_create:
-    cdev_del(&dev_data->cdev);
-err_cdev_add:
-    devm_kfree(&pdev->dev, dev_data->buffer);
-err_no_dev_memory:
-    devm_kfree(&pdev->dev, dev_data);
+err_device_add:
+    put_device(&dev_data->device_pcd);
+    goto err_no_memory;
+err_serial_number:
+    kfree(dev_data);
 err_no_memory:
 err_no_pdata:
     pr_info("A device probe failed\n");
@@ -279,21 +314,16 @@ int pcd_platform_driver_remove(struct platform_device *pdev)
 {
     /* extract the driver data from the pdev */
     struct pcdev_private_data * dev_data = (struct pcdev_private_data *) dev_get_drvdata(&pdev->dev);
-    /* 1. remove a device that was created with device create */
-    device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
-    /* 2. remove cdev entry from the system */
-    cdev_del(&dev_data->cdev);
+    /* 1. remove the device file and the cdev entry from the system */
+    cdev_device_del(&dev_data->cdev, &dev_data->device_pcd);
     /* 
-        3. free the memory held by the device 
-        Not needed when using devm_APIs
-        kfree(dev_data->buffer);
-        kfree(dev_data);
+        2. free the memory held by the device 
+        the open files keep it with the buffer until their last close, see pcd_release_device
     */
-    
 
     pr_info("A device is removed: %s\n", pdev->name);
-    pcdrv_data.total_devices--;
-    pr_info("Devices manged: %d\n", pcdrv_data.total_devices);
+    pr_info("Devices manged: %d\n", atomic_dec_return(&pcdrv_data.total_devices));
+    put_device(&dev_data->device_pcd);
     return 0;
 }
 
@@ -21,9 +21,11 @@
 #include <linux/cdev.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
 #include <linux/mod_devicetable.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
+#include <linux/idr.h>
 #include "platform.h"
 
 #define BASE_NUMBER 0u
@@ -34,29 +36,36 @@ int pcd_platform_driver_remove(struct platform_device *);
 
 /* helper functions */
 struct pcdev_platform_data * pcdev_get_platfrom_from_dt(struct device *dev);
-static int check_permission(int dev_perm, int access_mode);
+struct pcdev_private_data;
+static int pcd_get_buffer(struct pcdev_private_data *pcdev_data);
+static void pcd_release_device(struct device *dev);
 
 /* File Methods */
 loff_t pcd_lseek (struct file *filp, loff_t offset, int whence);
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos);
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from);
 int pcd_open (struct inode *inode, struct file *filp);
 int pcd_release (struct inode *inode, struct file *filp);
 
 /* per device private data <<dynamic>> */
 struct pcdev_private_data {
     struct pcdev_platform_data pdata;
+    /* allocated by the first open */
     char *buffer;
     dev_t dev_num;
     struct cdev cdev;
-    struct device *device_pcd;
+    /* its release frees the device data and the buffer, open files hold a reference past remove */
+    struct device device_pcd;
 };
 
 /* driver private data <<static>>*/
 struct pcdrv_private_data
 {
-    int total_devices;
+    /* probes run in parallel */
+    atomic_t total_devices;
     dev_t device_num_base;
+    /* free minors of the region, a removed device gives its minor back */
+    struct ida minor_ida;
     struct class *class_pcd;
 };
 
@@ -65,8 +74,8 @@ struct file_operations pcd_fOps = {
     .llseek = pcd_lseek,
     .open = pcd_open,
     .release = pcd_release,
-    .read = pcd_read,
-    .write = pcd_write
+    .read_iter = pcd_read_iter,
+    .write_iter = pcd_write_iter
     };
 struct device_configuration {
     int config_item_1;
@@ -112,17 +121,20 @@ struct platform_driver pcd_platform_driver = {
     .id_table = pcd_id_table,
     .driver = {
         .name = "pseudo-char-device",
-        .of_match_table = of_match_ptr(pcd_of_match_table)
+        .of_match_table = of_match_ptr(pcd_of_match_table),
+        /* devices are probed in parallel, off the module load/device registration path */
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS
     }
 };
 
 /* Driver private data object */
-struct pcdrv_private_data pcdrv_data = {.total_devices = 0};
+struct pcdrv_private_data pcdrv_data = {.total_devices = ATOMIC_INIT(0)};
 
 
 static int __init pcd_driver_init(void)
 {   
     int ret;
+    ida_init(&pcdrv_data.minor_ida);
     /* 1. dynamically allocate a device number for MAX_DEVICES */
     ret = alloc_chrdev_region(&pcdrv_data.device_num_base, BASE_NUMBER, DEVICE_COUNT, "rgb_devices");
     if (ret < 0)
@@ -156,6 +168,8 @@ static void __exit pcd_driver_cleanup(void)
     class_destroy(pcdrv_data.class_pcd);
     /* 3. unregister device numbers for DEVICE_COUNT*/
     unregister_chrdev_region(pcdrv_data.device_num_base, DEVICE_COUNT);
+    /* every device is removed by now */
+    ida_destroy(&pcdrv_data.minor_ida);
     pr_info("Driver module removed successfully \n");
 }
 
@@ -163,126 +177,54 @@ static void __exit pcd_driver_cleanup(void)
 loff_t pcd_lseek (struct file *filp, loff_t offset, int whence)
 {
     struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
-    struct device *dev = pcdev_data->device_pcd;
-    int max_size = pcdev_data->pdata.size;
-
-    loff_t temp;
+    struct device *dev = &pcdev_data->device_pcd;
+    loff_t pos;
 
     dev_info(dev, "%s: lseek requested with offset %lld\n", pcdev_data->pdata.serial_number, offset);
     dev_info(dev, "Initial value of the file pointer %lld\n", filp->f_pos);
 
-    switch (whence)
-    {
-        case SEEK_SET:
-            if ((offset > max_size) || (offset < 0))
-                return -EINVAL;
-            dev_info(dev, "SET value of the file pointer %lld\n", offset);
-            filp->f_pos = offset;
-            break;
-        case SEEK_CUR:
-            temp = filp->f_pos + offset;
-            if ((temp > max_size) || (temp < 0))
-                return -EINVAL;
-
-            dev_info(dev, "CUR value of the file pointer %lld\n", offset);
-            filp->f_pos = temp;
-            break;
-        case SEEK_END:
-            temp = max_size + offset;
-            if ((temp > max_size) || (temp < 0))
-                return -EINVAL;
-            dev_info(dev, "END value of the file pointer %lld\n", offset);
-
-            filp->f_pos = temp;
-            break;
-
-        default:
-            return -EINVAL;
-
-    }
+    pos = pcd_core_llseek(filp, offset, whence, pcdev_data->pdata.size);
     dev_info(dev, "Final value of the file pointer %lld\n", filp->f_pos);
-    return filp->f_pos;
+    return pos;
 }
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos)
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to)
 {
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
-    struct device *dev = pcdev_data->device_pcd;
-    int max_size = pcdev_data->pdata.size;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+    struct device *dev = &pcdev_data->device_pcd;
+    ssize_t ret;
 
-    dev_info(dev, "%s: Read requested for  %zu bytes \n", pcdev_data->pdata.serial_number, count);
-    dev_info(dev, "Position before read %lld \n", *f_pos);
-    
-    /* Adjust the count */
-    if ((count + *f_pos) > max_size)
-    {
-        dev_info(dev, "Requested count is out of boundary \n");
-        count = max_size - *f_pos;
-    }
+    dev_info(dev, "%s: Read requested for  %zu bytes \n", pcdev_data->pdata.serial_number, iov_iter_count(to));
+    dev_info(dev, "Position before read %lld \n", iocb->ki_pos);
 
-    /* Copy to user */
-    if (copy_to_user(buff, &(pcdev_data->buffer[*f_pos]), count))
-    {
+    /* the bounds and the copy are done by pcd_core */
+    ret = pcd_core_read_iter(iocb, to, pcdev_data->buffer, pcdev_data->pdata.size);
+    if (ret == -EFAULT)
         dev_err(dev, "Error copying to user \n");
-        return -EFAULT;
-    }
-
-    /* Update f_pos */
-    *f_pos += count;
-    dev_info(dev, "Position after read %lld \n", *f_pos);
+    dev_info(dev, "Position after read %lld \n", iocb->ki_pos);
 
     /* return the number of character successfully read*/
-    return count;
+    return ret;
 }
 
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos)
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from)
 {
     /* added during open */
-    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
     /* allocated during probe */
-    struct device *dev = pcdev_data->device_pcd;
-    
-    int max_size = pcdev_data->pdata.size;
-    dev_info(dev, "%s: Wrire requested for %zu bytes \n", pcdev_data->pdata.serial_number, count);
-    dev_info(dev, "Position before writing %lld \n", *f_pos);
-    
-    /* Adjust the count */
-    if ((count + *f_pos) > max_size)
-    {
-        dev_info(dev, "Requested count is out of boundary \n");
-        count = max_size - *f_pos;
-    }
+    struct device *dev = &pcdev_data->device_pcd;
+    ssize_t ret;
 
-    /* Copy from user */
-    if (copy_from_user(&(pcdev_data->buffer[*f_pos]),buff, count))
-    {
-        dev_err(dev, "Error copying from user \n");
-        return -EFAULT;
-    }
+    dev_info(dev, "%s: Wrire requested for %zu bytes \n", pcdev_data->pdata.serial_number, iov_iter_count(from));
+    dev_info(dev, "Position before writing %lld \n", iocb->ki_pos);
 
-    /* Update f_pos */
-    *f_pos += count;
-    dev_info(dev, "Position after writing %lld \n", *f_pos);
+    /* the bounds and the copy are done by pcd_core */
+    ret = pcd_core_write_iter(iocb, from, pcdev_data->buffer, pcdev_data->pdata.size);
+    if (ret == -EFAULT)
+        dev_err(dev, "Error copying from user \n");
+    dev_info(dev, "Position after writing %lld \n", iocb->ki_pos);
 
-    /* return the number of character successfully read*/
-    return count;
-}
-static int check_permission(int dev_perm, int access_mode)
-{
-    pr_info("Perm: 0x%x",dev_perm);
-    switch (dev_perm)
-    {
-        case RDONLY:
-            if((access_mode & FMODE_READ) && !(access_mode & FMODE_WRITE))
-                return 0;
-            break;
-        case WRONLY:
-            if(!(access_mode & FMODE_READ) && (access_mode & FMODE_WRITE))
-                return 0;
-            break;
-        case RDWR:
-            return 0;
-    }
-    return -EPERM;
+    /* return the number of character successfully written*/
+    return ret;
 }
 
 int pcd_open (struct inode *inode, struct file *filp)
@@ -297,7 +239,7 @@ int pcd_open (struct inode *inode, struct file *filp)
     
     /* get pointer to struct device data structure */
     /* allocated during probe */
-    dev = pcdev_data->device_pcd;
+    dev = &pcdev_data->device_pcd;
 
     /* find out on which device file the open operation was attempted from the user space */
     minor_number = MINOR(inode->i_rdev);
@@ -306,14 +248,49 @@ int pcd_open (struct inode *inode, struct file *filp)
     /* save private data of this file in the file pointer so other methods can access it */
     filp->private_data = pcdev_data;
     /* check permission */
-    ret = check_permission(pcdev_data->pdata.perm, filp->f_mode);
+    pr_info("Perm: 0x%x", pcdev_data->pdata.perm);
+    ret = pcd_core_check_permission(pcdev_data->pdata.perm, filp->f_mode);
+    if (!ret)
+        ret = pcd_get_buffer(pcdev_data);
+    /* dropped by pcd_release, the device may be removed by then */
+    if (!ret)
+        get_device(dev);
     (!ret)? dev_info(dev, "PCD %d file oped successfully!\n", minor_number) : dev_info(dev, "PCD %d file failed to open!\n", minor_number);
 
     return ret;
 }
+/* the buffer is allocated and zeroed by the first open, so probing stays cheap with many or large devices */
+/* kmalloc or vmalloc by its size, see pcd_alloc_flat_buffer */
+static int pcd_get_buffer(struct pcdev_private_data *pcdev_data)
+{
+    char *buffer;
+
+    if (READ_ONCE(pcdev_data->buffer))
+        return 0;
+    buffer = pcd_alloc_flat_buffer(pcdev_data->pdata.size);
+    if (!buffer)
+        return -ENOMEM;
+    /* concurrent first opens, only one of the buffers is kept */
+    if (cmpxchg(&pcdev_data->buffer, NULL, buffer))
+        pcd_free_flat_buffer(buffer);
+    return 0;
+}
+/* release of the class device, the last reference: removed and no file open anymore */
+static void pcd_release_device(struct device *dev)
+{
+    struct pcdev_private_data *pcdev_data = container_of(dev, struct pcdev_private_data, device_pcd);
+
+    /* the buffer comes from the first open, it isn't devm managed */
+    pcd_free_flat_buffer(pcdev_data->buffer);
+    kfree_const(pcdev_data->pdata.serial_number);
+    kfree(pcdev_data);
+}
 int pcd_release (struct inode *inode, struct file *filp)
 {
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+
     pr_info("Close requested\n");
+    put_device(&pcdev_data->device_pcd);
     return 0;
 }
 struct pcdev_platform_data * pcdev_get_platfrom_from_dt(struct device *dev)
@@ -359,6 +336,8 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
     int ret = 0;
     struct pcdev_private_data *dev_data;
     struct pcdev_platform_data * pdata = NULL;
+    /* index of the device in the char dev region */
+    int index;
     /* holds driver data index -> identifier for the device so the driver can handle it properly */
     int driver_data;
     /*
@@ -371,7 +350,7 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
     /* holds a pointer to device */
     struct device *dev = &pdev->dev;
 
-    dev_info(dev,"A device is detected: %s-%d\n", pdev->name, pcdrv_data.total_devices);
+    dev_info(dev,"A device is detected: %s-%d\n", pdev->name, atomic_read(&pcdrv_data.total_devices));
     /* 
         1. get the platform data 
         Will be different in case of DT device
@@ -411,7 +390,8 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
 
     }
     /* 2. Dynamically allocate memory for the private data */
-    dev_data = (struct pcdev_private_data *) devm_kzalloc(dev, sizeof(*dev_data), GFP_KERNEL);
+    /* not devm, open files outlive the device, see pcd_release_device */
+    dev_data = (struct pcdev_private_data *) kzalloc(sizeof(*dev_data), GFP_KERNEL);
     if (!dev_data)
     {
         dev_info(dev, "Cannot allocate memory \n");
@@ -424,7 +404,13 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
 
     dev_data->pdata.size  = pdata->size;
     dev_data->pdata.perm  = pdata->perm;
-    dev_data->pdata.serial_number  = pdata->serial_number;
+    /* pdata goes away with the device, the open files still print the serial number */
+    dev_data->pdata.serial_number  = kstrdup_const(pdata->serial_number, GFP_KERNEL);
+    if (!dev_data->pdata.serial_number)
+    {
+        ret = -ENOMEM;
+        goto err_serial_number;
+    }
 
     dev_info(dev, "Device serial_number = %s\n", dev_data->pdata.serial_number);
     dev_info(dev, "Device perm = 0x%x\n", dev_data->pdata.perm);
@@ -433,47 +419,49 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
     dev_info(dev, "DRIVER DATA: config_item_1 = %d\n", device_configs[driver_data].config_item_1);
     dev_info(dev, "DRIVER DATA: config_item_2 = %d\n", device_configs[driver_data].config_item_2);
     
-    /* 3. Dynamically allocate memory for the device buffer using size information from the platform data */
-    dev_data->buffer = (char *) devm_kzalloc(dev, dev_data->pdata.size, GFP_KERNEL);
-    if (!dev_data->buffer)
+    /* 3. the device buffer is allocated by the first open, see pcd_get_buffer */
+    /* 4. get the device number, the lowest minor that isn't in use, other probes run at the same time */
+    index = ida_alloc_max(&pcdrv_data.minor_ida, DEVICE_COUNT - 1, GFP_KERNEL);
+    if (index < 0)
     {
-        dev_info(dev, "Cannot allocate memory \n");
-        ret = -ENOMEM;
-        goto err_no_dev_memory;
+        dev_err(dev, "no free minor, %u devices at most\n", DEVICE_COUNT);
+        ret = index;
+        goto err_minor_alloc;
     }
-    /* 4. get the device number */
-    dev_data->dev_num = pcdrv_data.device_num_base + pcdrv_data.total_devices;
-
-    /* 5. do cdev_init and cdev_add */
+    dev_data->dev_num = pcdrv_data.device_num_base + index;
+
+    /* 5. the device file, from here on the device data is freed by the release of its device */
+    device_initialize(&dev_data->device_pcd);
+    dev_data->device_pcd.class = pcdrv_data.class_pcd;
+    dev_data->device_pcd.devt = dev_data->dev_num;
+    dev_data->device_pcd.release = pcd_release_device;
+    ret = dev_set_name(&dev_data->device_pcd, "rgbpcdev-%d", index);
+    if (ret)
+        goto err_device_add;
+
+    /* 6. do cdev_init, the cdev holds the device while a file is open */
     cdev_init(&dev_data->cdev, &pcd_fOps);
     dev_data->cdev.owner = THIS_MODULE;
 
-    ret = cdev_add(&dev_data->cdev, dev_data->dev_num, 1);
+    ret = cdev_device_add(&dev_data->cdev, &dev_data->device_pcd);
     if (ret < 0)
-    {
-        dev_err(dev, "cdev add failed\n");
-        goto err_cdev_add;
-    }
-    /* 6. Create device file for the detected platform */
-    dev_data->device_pcd = device_create(pcdrv_data.class_pcd, NULL, dev_data->dev_num, NULL, "rgbpcdev-%d", pcdrv_data.total_devices);
-    if (IS_ERR(dev_data->device_pcd))
     {
         dev_err(dev, "error Creating device \n");
-        ret = PTR_ERR(dev_data->device_pcd);
-        goto err_device_create;
+        goto err_device_add;
     }
     /* 7. Error handling */
     dev_info(dev, "A device is probed: %s-%d\n", pdev->name, pdev->id);
-    pcdrv_data.total_devices++;
-    dev_info(dev, "Devices manged: %d\n", pcdrv_data.total_devices);
+    dev_info(dev, "Devices manged: %d\n", atomic_inc_return(&pcdrv_data.total_devices));
 
     return 0;
-err_device_create:
-    cdev_del(&dev_data->cdev);
-err_cdev_add:
-    devm_kfree(dev, dev_data->buffer);
-err_no_dev_memory:
-    devm_kfree(dev, dev_data);
+err_device_add:
+    ida_free(&pcdrv_data.minor_ida, index);
+    put_device(&dev_data->device_pcd);
+    goto err_no_memory;
+err_minor_alloc:
+    kfree_const(dev_data->pdata.serial_number);
+err_serial_number:
+    kfree(dev_data);
 err_no_memory:
 err_no_pdata:
     pr_info("A device probe failed\n");
@@ -484,21 +472,18 @@ int pcd_platform_driver_remove(struct platform_device *pdev)
 {
     /* extract the driver data from the pdev */
     struct pcdev_private_data * dev_data = (struct pcdev_private_data *) dev_get_drvdata(&pdev->dev);
-    /* 1. remove a device that was created with device create */
-    device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
-    /* 2. remove cdev entry from the system */
-    cdev_del(&dev_data->cdev);
+    /* 1. remove the device file and the cdev entry from the system */
+    cdev_device_del(&dev_data->cdev, &dev_data->device_pcd);
+    /* the minor can be handed out again */
+    ida_free(&pcdrv_data.minor_ida, MINOR(dev_data->dev_num) - MINOR(pcdrv_data.device_num_base));
     /* 
-        3. free the memory held by the device 
-        Not needed when using devm_APIs
-        kfree(dev_data->buffer);
-        kfree(dev_data);
+        2. free the memory held by the device 
+        the open files keep it with the buffer until their last close, see pcd_release_device
     */
-    
 
     dev_info(&pdev->dev, "A device is removed: %s\n", pdev->name);
-    pcdrv_data.total_devices--;
-    dev_info(&pdev->dev, "Devices manged: %d\n", pcdrv_data.total_devices);
+    dev_info(&pdev->dev, "Devices manged: %d\n", atomic_dec_return(&pcdrv_data.total_devices));
+    put_device(&dev_data->device_pcd);
     return 0;
 }
 
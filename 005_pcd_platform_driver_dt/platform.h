@@ -19,9 +19,8 @@
 #undef pr_fmt
 #define pr_fmt(fmt) "%s :" fmt,__func__
 
-#define RDONLY 0x01u
-#define WRONLY 0x10u
-#define RDWR 0x11u
+/* RDONLY, WRONLY and RDWR */
+#include "pcd_core.h"
 
 struct pcdev_platform_data
 {
@@ -0,0 +1,145 @@
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/device.h>
+#include <linux/numa.h>
+#include "platform.h"
+
+#define SERIAL_NUMBER_LEN 16
+
+/*
+ * registers platform devices for the pcd_sysfs driver without a device tree
+ * instances=N creates N devices, cycles=M removes and probes all of them M more times at load
+ */
+static unsigned int instances = 4;
+module_param(instances, uint, 0444);
+MODULE_PARM_DESC(instances, "number of platform devices to register");
+
+static unsigned int cycles;
+module_param(cycles, uint, 0444);
+MODULE_PARM_DESC(cycles, "remove/probe cycles of all the devices run at load");
+
+/* the device types of the driver id table, used round robin */
+static const char * const pcdev_names[] = {"pcdev-A1x", "pcdev-B1x", "pcdev-C1x", "pcdev-D1x"};
+static const int pcdev_sizes[] = {512, 1024, 128, 32};
+
+static struct platform_device **platform_pcdevs;
+/* platform data only holds a pointer to the serial number, the strings live here */
+static char (*serial_numbers)[SERIAL_NUMBER_LEN];
+
+static int pcdev_register_all(void);
+static void pcdev_unregister_all(unsigned int count);
+
+static int pcdev_register_all(void)
+{
+    struct pcdev_platform_data pdata = {.perm = RDWR, .node = NUMA_NO_NODE};
+    struct platform_device *pdev;
+    unsigned int i;
+
+    for (i = 0; i < instances; i++)
+    {
+        pdata.size = pcdev_sizes[i % ARRAY_SIZE(pcdev_sizes)];
+        pdata.serial_number = serial_numbers[i];
+        /* pdata is copied into the device */
+        pdev = platform_device_register_data(NULL, pcdev_names[i % ARRAY_SIZE(pcdev_names)], i, &pdata, sizeof(pdata));
+        if (IS_ERR(pdev))
+        {
+            pr_err("registering device %u failed\n", i);
+            pcdev_unregister_all(i);
+            return PTR_ERR(pdev);
+        }
+        platform_pcdevs[i] = pdev;
+    }
+    return 0;
+}
+
+/* removes the first count devices, newest first */
+static void pcdev_unregister_all(unsigned int count)
+{
+    while (count--)
+    {
+        platform_device_unregister(platform_pcdevs[count]);
+        platform_pcdevs[count] = NULL;
+    }
+}
+
+static int __init pcdev_platform_init(void)
+{
+    unsigned int i;
+    ktime_t start;
+    int ret;
+
+    platform_pcdevs = kcalloc(instances, sizeof(*platform_pcdevs), GFP_KERNEL);
+    serial_numbers = kcalloc(instances, sizeof(*serial_numbers), GFP_KERNEL);
+    if (!platform_pcdevs || !serial_numbers)
+    {
+        ret = -ENOMEM;
+        goto err_alloc;
+    }
+    for (i = 0; i < instances; i++)
+        snprintf(serial_numbers[i], SERIAL_NUMBER_LEN, "RGBPCD%05u", i);
+
+    /* the driver probes asynchronously, the time counts until every probe is done */
+    start = ktime_get();
+    ret = pcdev_register_all();
+    if (ret < 0)
+        goto err_alloc;
+    wait_for_device_probe();
+    pr_info("registering and probing %u devices took %lld us\n", instances, ktime_us_delta(ktime_get(), start));
+
+    /* churn, the driver must hand out the freed minors again */
+    start = ktime_get();
+    for (i = 0; i < cycles; i++)
+    {
+        pcdev_unregister_all(instances);
+        ret = pcdev_register_all();
+        if (ret < 0)
+        {
+            pr_err("cycle %u failed\n", i);
+            goto err_alloc;
+        }
+    }
+    wait_for_device_probe();
+    if (cycles)
+        pr_info("%u remove/probe cycles of %u devices took %lld us\n", cycles, instances, ktime_us_delta(ktime_get(), start));
+
+    pr_info("Setup module loaded successfully, %u devices \n", instances);
+    return 0;
+err_alloc:
+    kfree(serial_numbers);
+    kfree(platform_pcdevs);
+    return ret;
+}
+
+static void __exit pcdev_platform_exit(void)
+{
+    pcdev_unregister_all(instances);
+    kfree(serial_numbers);
+    kfree(platform_pcdevs);
+    pr_info("Setup module unloaded successfully \n");
+}
+
+module_init(pcdev_platform_init);
+module_exit(pcdev_platform_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Module which registers the pcd_sysfs platform devices");
+MODULE_AUTHOR("Ragab Hassan");
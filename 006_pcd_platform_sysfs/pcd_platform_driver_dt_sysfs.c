@@ -21,8 +21,22 @@ struct file_operations pcd_fOps = {
     .llseek = pcd_lseek,
     .open = pcd_open,
     .release = pcd_release,
-    .read = pcd_read,
-    .write = pcd_write
+    /* read()/write() go through the iter methods as well */
+    .read_iter = pcd_read_iter,
+    .write_iter = pcd_write_iter,
+    /* sendfile()/splice() move data between the buffer and a pipe inside the kernel */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .mmap = pcd_mmap,
+    .poll = pcd_poll,
+#ifdef PCD_URING_CMD
+    /* batches of positional reads/writes in one io_uring submission */
+    .uring_cmd = pcd_uring_cmd
+#endif
     };
 
 /* device-driver data*/
@@ -58,26 +72,37 @@ struct platform_driver pcd_platform_driver = {
     .id_table = pcd_id_table,
     .driver = {
         .name = "pseudo-char-device",
-        .of_match_table = of_match_ptr(pcd_of_match_table)
+        .of_match_table = of_match_ptr(pcd_of_match_table),
+        /* devices are probed in parallel, off the module load/device registration path */
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS
     }
 };
 
 /* Driver private data object */
-struct pcdrv_private_data pcdrv_data = {.total_devices = 0};
+struct pcdrv_private_data pcdrv_data = {.total_devices = ATOMIC_INIT(0)};
+
+/* size of the char dev region, one minor per probed device */
+static unsigned int max_devices = DEFAULT_MAX_DEVICES;
+module_param(max_devices, uint, 0444);
+MODULE_PARM_DESC(max_devices, "maximum number of pcd devices, 1 to 1048576");
 /* attribute functions */
 ssize_t show_max_size(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t store_max_size(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 
 ssize_t show_serial_number(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t show_resident_size(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t show_buffer_node(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t store_buffer_node(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 ssize_t store_serial_number(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 /* Helper functions */
 int pcd_create_attribute_files(struct device* dev);
+static void pcd_release_device(struct kref *ref);
 
 ssize_t show_max_size(struct device *dev, struct device_attribute *attr, char *buf)
 {
     /* access device data */
     struct pcdev_private_data *priv_data = dev_get_drvdata(dev->parent);
-    return sprintf(buf, "%d\n", priv_data->pdata.size);
+    return sprintf(buf, "%d\n", READ_ONCE(priv_data->pdata.size));
 }
 ssize_t show_serial_number(struct device *dev, struct device_attribute *attr, char *buf)
 {
@@ -86,22 +111,151 @@ ssize_t show_serial_number(struct device *dev, struct device_attribute *attr, ch
     return sprintf(buf, "%s\n", priv_data->pdata.serial_number);
 }
 
+/* memory actually held by the buffer, max_size is the logical size */
+ssize_t show_resident_size(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    /* access device data */
+    struct pcdev_private_data *priv_data = dev_get_drvdata(dev->parent);
+    struct pcd_buffer *buffer;
+    unsigned long resident = 0;
+    int idx;
+
+    idx = srcu_read_lock(&priv_data->srcu);
+    buffer = srcu_dereference(priv_data->buffer, &priv_data->srcu);
+    /* nothing is allocated before the first open */
+    if (buffer)
+        resident = pcd_buffer_resident(buffer);
+    srcu_read_unlock(&priv_data->srcu, idx);
+    return sprintf(buf, "%lu\n", resident);
+}
+
+/* NUMA placement of the buffer: a node number, "interleave" or "local" for the writer's node */
+ssize_t show_buffer_node(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    /* access device data */
+    struct pcdev_private_data *priv_data = dev_get_drvdata(dev->parent);
+    int node = READ_ONCE(priv_data->pdata.node);
+
+    if (node == PCD_NODE_INTERLEAVE)
+        return sprintf(buf, "interleave\n");
+    if (node == NUMA_NO_NODE)
+        return sprintf(buf, "local\n");
+    return sprintf(buf, "%d\n", node);
+}
+
+/* only the pages allocated after the change move, set it before the device is written to */
+ssize_t store_buffer_node(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    /* access device data */
+    struct pcdev_private_data *priv_data = dev_get_drvdata(dev->parent);
+    struct pcd_buffer *buffer;
+    unsigned int value;
+    int node;
+
+    if (sysfs_streq(buf, "interleave"))
+    {
+        node = PCD_NODE_INTERLEAVE;
+    }
+    else if (sysfs_streq(buf, "local"))
+    {
+        node = NUMA_NO_NODE;
+    }
+    else
+    {
+        if (kstrtouint(buf, 10, &value) || (value >= MAX_NUMNODES) || !node_online(value))
+        {
+            return -EINVAL;
+        }
+        node = value;
+    }
+    /* the buffer of the first open and of a resize picks it up from pdata */
+    mutex_lock(&priv_data->lock);
+    WRITE_ONCE(priv_data->pdata.node, node);
+    buffer = rcu_dereference_protected(priv_data->buffer, lockdep_is_held(&priv_data->lock));
+    if (buffer)
+    {
+        pcd_buffer_set_node(buffer, node);
+    }
+    mutex_unlock(&priv_data->lock);
+    return count;
+}
+
 ssize_t store_max_size(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
     /* access device data */
     struct pcdev_private_data *priv_data = dev_get_drvdata(dev->parent);
     long new_size;
+    struct pcd_buffer *old_buffer;
+    struct pcd_buffer *new_buffer;
     int ret = kstrtol(buf, 10, &new_size);
     if (ret < 0)
     {
         return ret;
     }
-    priv_data->pdata.size = new_size;
+    if ((new_size <= 0) || (new_size > INT_MAX))
+    {
+        return -EINVAL;
+    }
+    /*
+     * online resize: the new buffer is built and published while readers keep going on the old one,
+     * writers and mmap are only held off while the pages are shared with the new buffer
+     */
+    if (mutex_lock_interruptible(&priv_data->lock))
+    {
+        return -ERESTARTSYS;
+    }
+    if (new_size == priv_data->pdata.size)
+    {
+        goto out_unchanged;
+    }
+    /* user space still holds the pages of the current buffer */
+    if (atomic_read(&priv_data->mmap_count))
+    {
+        dev_info(dev->parent, "buffer is mapped, cannot resize\n");
+        ret = -EBUSY;
+        goto err_unlock;
+    }
+    old_buffer = rcu_dereference_protected(priv_data->buffer, lockdep_is_held(&priv_data->lock));
+    /* never opened, the first open allocates the new size */
+    if (!old_buffer)
+    {
+        WRITE_ONCE(priv_data->pdata.size, new_size);
+        mutex_unlock(&priv_data->lock);
+        dev_info(dev->parent, "new buffer size %ld\n", new_size);
+        return count;
+    }
+    /* the pages are shared with the old buffer, not copied */
+    new_buffer = pcd_resize_buffer(old_buffer, new_size);
+    if (!new_buffer)
+    {
+        ret = -ENOMEM;
+        goto err_unlock;
+    }
+    /* data beyond the new end is gone, file positions past it are clamped by their next access */
+    if (atomic_read(&priv_data->data_len) > new_size)
+    {
+        atomic_set(&priv_data->data_len, new_size);
+    }
+    WRITE_ONCE(priv_data->pdata.size, new_size);
+    rcu_assign_pointer(priv_data->buffer, new_buffer);
     dev_info(dev->parent, "new buffer size %ld\n", new_size);
-    priv_data->buffer = devm_krealloc(dev->parent, priv_data->buffer, new_size, GFP_KERNEL);
-    dev_info(dev->parent, "new buffer location %p\n", priv_data->buffer);
+    dev_info(dev->parent, "resident %lu bytes\n", pcd_buffer_resident(new_buffer));
+    mutex_unlock(&priv_data->lock);
+
+    /* readers that picked up the old buffer are done with it after this */
+    synchronize_srcu(&priv_data->srcu);
+    pcd_free_buffer(old_buffer);
+
+    /* writers may have space now, readers past the new end get end of file */
+    wake_up_interruptible(&priv_data->write_queue);
+    wake_up_interruptible(&priv_data->read_queue);
 
     return count;
+out_unchanged:
+    ret = count;
+err_unlock:
+    mutex_unlock(&priv_data->lock);
+    return ret;
 }
 
 ssize_t store_serial_number(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
@@ -112,13 +266,23 @@ ssize_t store_serial_number(struct device *dev, struct device_attribute *attr, c
 /*create the attributes*/
 static DEVICE_ATTR(max_size, (S_IRUGO | S_IWUSR), show_max_size, store_max_size);
 static DEVICE_ATTR(serial_number, S_IRUGO , show_serial_number, store_serial_number);
+static DEVICE_ATTR(resident_size, S_IRUGO, show_resident_size, NULL);
+static DEVICE_ATTR(buffer_node, (S_IRUGO | S_IWUSR), show_buffer_node, store_buffer_node);
 
 
 static int __init pcd_driver_init(void)
 {   
     int ret;
-    /* 1. dynamically allocate a device number for MAX_DEVICES */
-    ret = alloc_chrdev_region(&pcdrv_data.device_num_base, BASE_NUMBER, DEVICE_COUNT, "rgb_devices");
+    if (!max_devices || (max_devices > (MINORMASK + 1)))
+    {
+        pr_err("invalid max_devices %u\n", max_devices);
+        return -EINVAL;
+    }
+    pcdrv_data.max_devices = max_devices;
+    ida_init(&pcdrv_data.minor_ida);
+    xa_init(&pcdrv_data.devices);
+    /* 1. dynamically allocate a device number for max_devices */
+    ret = alloc_chrdev_region(&pcdrv_data.device_num_base, BASE_NUMBER, pcdrv_data.max_devices, "rgb_devices");
     if (ret < 0)
     {
         pr_err("error allocating char dev\n");
@@ -134,22 +298,37 @@ static int __init pcd_driver_init(void)
     {
         pr_err("error Creating class \n");
         ret = PTR_ERR(pcdrv_data.class_pcd);
-        unregister_chrdev_region(pcdrv_data.device_num_base, DEVICE_COUNT);
+        goto err_class_create;
     }
     /* 3. register a platform driver */
-    platform_driver_register(&pcd_platform_driver);
-    pr_info("Driver module added successfully \n");
+    ret = platform_driver_register(&pcd_platform_driver);
+    if (ret < 0)
+    {
+        pr_err("error registering platform driver \n");
+        goto err_driver_register;
+    }
+    pcd_debugfs_init();
+    pr_info("Driver module added successfully, %u minors \n", pcdrv_data.max_devices);
     return 0;
+err_driver_register:
+    class_destroy(pcdrv_data.class_pcd);
+err_class_create:
+    unregister_chrdev_region(pcdrv_data.device_num_base, pcdrv_data.max_devices);
+    return ret;
 }
 
 static void __exit pcd_driver_cleanup(void)
 {
+    pcd_debugfs_exit();
     /* 1. unregister a platform driver */
     platform_driver_unregister(&pcd_platform_driver);
     /* 2. destroy class */
     class_destroy(pcdrv_data.class_pcd);
-    /* 3. unregister device numbers for DEVICE_COUNT*/
-    unregister_chrdev_region(pcdrv_data.device_num_base, DEVICE_COUNT);
+    /* 3. unregister device numbers for max_devices*/
+    unregister_chrdev_region(pcdrv_data.device_num_base, pcdrv_data.max_devices);
+    /* every device is removed by now, both are empty */
+    xa_destroy(&pcdrv_data.devices);
+    ida_destroy(&pcdrv_data.minor_ida);
     pr_info("Driver module removed successfully \n");
 }
 int pcd_create_attribute_files(struct device* dev)
@@ -160,7 +339,83 @@ int pcd_create_attribute_files(struct device* dev)
     {
         return ret;
     }
-    return sysfs_create_file(&dev->kobj, &dev_attr_serial_number.attr);
+    ret = sysfs_create_file(&dev->kobj, &dev_attr_serial_number.attr);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = sysfs_create_file(&dev->kobj, &dev_attr_resident_size.attr);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = sysfs_create_file(&dev->kobj, &dev_attr_buffer_node.attr);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    /* I/O counters under stats/ */
+    return sysfs_create_group(&dev->kobj, &pcd_stats_group);
+}
+
+/* probed device of a minor with a reference for the caller, NULL once it's removed */
+struct pcdev_private_data *pcd_lookup_device(unsigned int minor)
+{
+    struct pcdev_private_data *pcdev_data;
+
+    /* remove erases the entry before it drops the probe reference, the count can't be 0 here */
+    xa_lock(&pcdrv_data.devices);
+    pcdev_data = xa_load(&pcdrv_data.devices, minor - MINOR(pcdrv_data.device_num_base));
+    if (pcdev_data)
+        kref_get(&pcdev_data->ref);
+    xa_unlock(&pcdrv_data.devices);
+    return pcdev_data;
+}
+
+void pcd_put_device(struct pcdev_private_data *pcdev_data)
+{
+    kref_put(&pcdev_data->ref, pcd_release_device);
+}
+
+/*
+ * the buffer is allocated by the first open, file methods run on an open file and always find it
+ * its pages come later, with the writes
+ */
+int pcd_get_buffer(struct pcdev_private_data *pcdev_data)
+{
+    struct pcd_buffer *buffer;
+    int ret = 0;
+
+    mutex_lock(&pcdev_data->lock);
+    if (!rcu_dereference_protected(pcdev_data->buffer, lockdep_is_held(&pcdev_data->lock)))
+    {
+        buffer = pcd_alloc_buffer(pcdev_data->pdata.size, pcdev_data->pdata.node);
+        if (buffer)
+            rcu_assign_pointer(pcdev_data->buffer, buffer);
+        else
+            ret = -ENOMEM;
+    }
+    mutex_unlock(&pcdev_data->lock);
+    return ret;
+}
+
+/*
+ * last reference gone, no probed device, open file or mapping uses the state anymore
+ * frees the buffer current at that time and the srcu readers state
+ */
+static void pcd_release_device(struct kref *ref)
+{
+    struct pcdev_private_data *dev_data = container_of(ref, struct pcdev_private_data, ref);
+    struct pcd_buffer *buffer = rcu_dereference_protected(dev_data->buffer, 1);
+    /* the device may never have been opened */
+    if (buffer)
+        pcd_free_buffer(buffer);
+    cleanup_srcu_struct(&dev_data->srcu);
+    free_percpu(dev_data->latency);
+    free_percpu(dev_data->stats);
+    put_device(dev_data->device_pcd);
+    kfree_const(dev_data->pdata.serial_number);
+    kfree(dev_data);
 }
 
 int pcd_platform_driver_probe(struct platform_device *pdev)
@@ -168,6 +423,8 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
     int ret = 0;
     struct pcdev_private_data *dev_data;
     struct pcdev_platform_data * pdata = NULL;
+    int minor;
+    int cpu;
     /* holds driver data index -> identifier for the device so the driver can handle it properly */
     int driver_data;
     /*
@@ -180,7 +437,7 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
     /* holds a pointer to device */
     struct device *dev = &pdev->dev;
 
-    dev_info(dev,"A device is detected: %s-%d\n", pdev->name, pcdrv_data.total_devices);
+    dev_info(dev,"A device is detected: %s-%d\n", pdev->name, atomic_read(&pcdrv_data.total_devices));
     /* 
         1. get the platform data 
         Will be different in case of DT device
@@ -219,21 +476,39 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
         driver_data = (size_t)of_device_get_match_data(dev);
 
     }
-    /* 2. Dynamically allocate memory for the private data */
-    dev_data = (struct pcdev_private_data *) devm_kzalloc(dev, sizeof(*dev_data), GFP_KERNEL);
+    /*
+        2. Dynamically allocate memory for the private data
+        not devm managed, open files and mappings keep it after remove, see pcd_release_device
+    */
+    dev_data = (struct pcdev_private_data *) kzalloc(sizeof(*dev_data), GFP_KERNEL);
     if (!dev_data)
     {
         dev_info(dev, "Cannot allocate memory \n");
         ret = -ENOMEM;
         goto err_no_memory;
     }
+    kref_init(&dev_data->ref);
+    ret = init_srcu_struct(&dev_data->srcu);
+    if (ret < 0)
+    {
+        kfree(dev_data);
+        goto err_no_memory;
+    }
     /* save the allocated pointer in the driver_data inside the dev member of pdev in order to use it later at removal */
     /* pdev->dev.driver_data = dev_data; */
     dev_set_drvdata(dev, dev_data);
 
     dev_data->pdata.size  = pdata->size;
     dev_data->pdata.perm  = pdata->perm;
-    dev_data->pdata.serial_number  = pdata->serial_number;
+    dev_data->pdata.node  = pdata->node;
+    /* the platform data can be gone while a file still traces the serial number */
+    dev_data->pdata.serial_number  = kstrdup_const(pdata->serial_number, GFP_KERNEL);
+    if (pdata->serial_number && !dev_data->pdata.serial_number)
+    {
+        dev_info(dev, "Cannot allocate memory \n");
+        ret = -ENOMEM;
+        goto err_no_dev_memory;
+    }
 
     dev_info(dev, "Device serial_number = %s\n", dev_data->pdata.serial_number);
     dev_info(dev, "Device perm = 0x%x\n", dev_data->pdata.perm);
@@ -242,56 +517,105 @@ int pcd_platform_driver_probe(struct platform_device *pdev)
     dev_info(dev, "DRIVER DATA: config_item_1 = %d\n", device_configs[driver_data].config_item_1);
     dev_info(dev, "DRIVER DATA: config_item_2 = %d\n", device_configs[driver_data].config_item_2);
     
-    /* 3. Dynamically allocate memory for the device buffer using size information from the platform data */
-    dev_data->buffer = (char *) devm_kzalloc(dev, dev_data->pdata.size, GFP_KERNEL);
-    if (!dev_data->buffer)
+    /* 3. the sparse device buffer is allocated by the first open, see pcd_get_buffer */
+    if (dev_data->pdata.size <= 0)
+    {
+        dev_info(dev, "Invalid device size \n");
+        ret = -EINVAL;
+        goto err_no_dev_memory;
+    }
+    /* per cpu counters, freed with the state */
+    dev_data->stats = alloc_percpu(struct pcd_stats);
+    if (!dev_data->stats)
+    {
+        dev_info(dev, "Cannot allocate memory \n");
+        ret = -ENOMEM;
+        goto err_no_dev_memory;
+    }
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(dev_data->stats, cpu)->syncp);
+    dev_data->latency = alloc_percpu(struct pcd_latency);
+    if (!dev_data->latency)
     {
         dev_info(dev, "Cannot allocate memory \n");
         ret = -ENOMEM;
         goto err_no_dev_memory;
     }
-    /* 4. get the device number */
-    dev_data->dev_num = pcdrv_data.device_num_base + pcdrv_data.total_devices;
+    RCU_INIT_POINTER(dev_data->buffer, NULL);
+    mutex_init(&dev_data->lock);
+    atomic_set(&dev_data->mmap_count, 0);
+    atomic_set(&dev_data->data_len, 0);
+    init_waitqueue_head(&dev_data->read_queue);
+    init_waitqueue_head(&dev_data->write_queue);
+    /* 4. get the device number, the lowest minor that isn't in use */
+    minor = ida_alloc_max(&pcdrv_data.minor_ida, pcdrv_data.max_devices - 1, GFP_KERNEL);
+    if (minor < 0)
+    {
+        dev_err(dev, "no free minor, max_devices %u\n", pcdrv_data.max_devices);
+        ret = minor;
+        goto err_minor_alloc;
+    }
+    dev_data->dev_num = pcdrv_data.device_num_base + minor;
+    /* open finds the device through the registry */
+    ret = xa_insert(&pcdrv_data.devices, minor, dev_data, GFP_KERNEL);
+    if (ret < 0)
+    {
+        dev_err(dev, "registering minor %d failed\n", minor);
+        goto err_xa_insert;
+    }
 
-    /* 5. do cdev_init and cdev_add */
-    cdev_init(&dev_data->cdev, &pcd_fOps);
-    dev_data->cdev.owner = THIS_MODULE;
+    /* 5. do cdev_alloc and cdev_add, the cdev frees itself once the last open file is closed */
+    dev_data->cdev = cdev_alloc();
+    if (!dev_data->cdev)
+    {
+        ret = -ENOMEM;
+        goto err_cdev_add;
+    }
+    dev_data->cdev->ops = &pcd_fOps;
+    dev_data->cdev->owner = THIS_MODULE;
 
-    ret = cdev_add(&dev_data->cdev, dev_data->dev_num, 1);
+    ret = cdev_add(dev_data->cdev, dev_data->dev_num, 1);
     if (ret < 0)
     {
         dev_err(dev, "cdev add failed\n");
+        kobject_put(&dev_data->cdev->kobj);
         goto err_cdev_add;
     }
     /* 6. Create device file for the detected platform */
-    dev_data->device_pcd = device_create(pcdrv_data.class_pcd, dev, dev_data->dev_num, NULL, "rgbpcdev-%d", pcdrv_data.total_devices);
+    dev_data->device_pcd = device_create(pcdrv_data.class_pcd, dev, dev_data->dev_num, NULL, "rgbpcdev-%d", minor);
     if (IS_ERR(dev_data->device_pcd))
     {
         dev_err(dev, "error Creating device \n");
         ret = PTR_ERR(dev_data->device_pcd);
+        dev_data->device_pcd = NULL;
         goto err_device_create;
     }
-    /* 7. Error handling */
-    dev_info(dev, "A device is probed: %s-%d\n", pdev->name, pdev->id);
-    pcdrv_data.total_devices++;
-    dev_info(dev, "Devices manged: %d\n", pcdrv_data.total_devices);
-    /* 8. Create the attributes */
+    /* open files log through it after remove, put by pcd_release_device */
+    get_device(dev_data->device_pcd);
+    /* 7. Create the attributes */
     ret = pcd_create_attribute_files(dev_data->device_pcd);
     if (ret < 0)
     {
         dev_err(dev, "failed to create attributes");
         goto err_attr_create;
     }
+    /* 8. counted once nothing can fail anymore, remove takes it back */
+    dev_info(dev, "A device is probed: %s-%d\n", pdev->name, pdev->id);
+    dev_info(dev, "Devices manged: %d\n", atomic_inc_return(&pcdrv_data.total_devices));
     dev_info(dev, "pdev->dev: 0x%p, dev_data->device_pcd: 0x%p", &pdev->dev, dev_data->device_pcd);
     return 0;
 err_attr_create:
     device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
 err_device_create:
-    cdev_del(&dev_data->cdev);
+    cdev_del(dev_data->cdev);
 err_cdev_add:
-    devm_kfree(dev, dev_data->buffer);
+    xa_erase(&pcdrv_data.devices, minor);
+err_xa_insert:
+    ida_free(&pcdrv_data.minor_ida, minor);
+err_minor_alloc:
 err_no_dev_memory:
-    devm_kfree(dev, dev_data);
+    /* an open that found the device in the registry holds the state until it's released */
+    pcd_put_device(dev_data);
 err_no_memory:
 err_no_pdata:
     pr_info("A device probe failed\n");
@@ -302,21 +626,20 @@ int pcd_platform_driver_remove(struct platform_device *pdev)
 {
     /* extract the driver data from the pdev */
     struct pcdev_private_data * dev_data = (struct pcdev_private_data *) dev_get_drvdata(&pdev->dev);
+    unsigned int minor = MINOR(dev_data->dev_num) - MINOR(pcdrv_data.device_num_base);
+    /* 0. new opens of the device fail from now on */
+    xa_erase(&pcdrv_data.devices, minor);
     /* 1. remove a device that was created with device create */
     device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
     /* 2. remove cdev entry from the system */
-    cdev_del(&dev_data->cdev);
-    /* 
-        3. free the memory held by the device 
-        Not needed when using devm_APIs
-        kfree(dev_data->buffer);
-        kfree(dev_data);
-    */
-    
+    cdev_del(dev_data->cdev);
+    /* the minor can be handed out again, open files of this device keep their own cdev */
+    ida_free(&pcdrv_data.minor_ida, minor);
 
     dev_info(&pdev->dev, "A device is removed: %s\n", pdev->name);
-    pcdrv_data.total_devices--;
-    dev_info(&pdev->dev, "Devices manged: %d\n", pcdrv_data.total_devices);
+    dev_info(&pdev->dev, "Devices manged: %d\n", atomic_dec_return(&pcdrv_data.total_devices));
+    /* 3. drop the probe reference, the last open file or mapping frees the memory held by the device */
+    pcd_put_device(dev_data);
     return 0;
 }
 
@@ -26,25 +26,104 @@
 #include <linux/mod_devicetable.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/srcu.h>
+#include <linux/uio.h>
+#include <linux/string.h>
+#include <linux/overflow.h>
+#include <linux/splice.h>
+#include <linux/version.h>
+#include <linux/idr.h>
+#include <linux/xarray.h>
+#include <linux/kref.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/numa.h>
+#include <linux/nodemask.h>
+/* io_uring_sqe_cmd() and the io_uring_cmd helpers moved to their own header in 6.7 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#define PCD_URING_CMD
+#endif
 #include "platform.h"
+#include "pcd_uring.h"
 
 #define BASE_NUMBER 0u
-#define DEVICE_COUNT 10u
+/* default size of the char dev region, max_devices module parameter */
+#define DEFAULT_MAX_DEVICES 1024u
+
+/*
+ * per call logs of the file methods, built in with PCD_VERBOSE=1 only
+ * production builds rely on the pcd_sysfs tracepoints instead
+ */
+#ifdef PCD_VERBOSE
+#define pcd_dbg(dev, fmt, ...) dev_info(dev, fmt, ##__VA_ARGS__)
+#else
+#define pcd_dbg(dev, fmt, ...) ({ if (0) dev_info(dev, fmt, ##__VA_ARGS__); })
+#endif
+
+/* bucket i counts the calls that took [2^i, 2^(i+1)) ns, the last one everything slower */
+#define PCD_LATENCY_BUCKETS 32
+
+/* per cpu latency histograms of a device, one per direction */
+struct pcd_latency {
+    unsigned long buckets[PCD_STATS_DIRS][PCD_LATENCY_BUCKETS];
+};
 
 /* per device private data <<dynamic>> */
 struct pcdev_private_data {
+    /* held by the probed device, every open file and every mapping, the last put frees the state */
+    struct kref ref;
     struct pcdev_platform_data pdata;
-    char *buffer;
+    /* current buffer, readers access it under srcu, writers under lock. NULL until the first open */
+    struct pcd_buffer __rcu *buffer;
+    /* readers of the buffer, sleepable since copy_to_user can fault */
+    struct srcu_struct srcu;
+    /* serializes writers, mmap and resize */
+    struct mutex lock;
     dev_t dev_num;
-    struct cdev cdev;
+    /* allocated on its own, an open file can hold it after the state is freed */
+    struct cdev *cdev;
     struct device *device_pcd;
+    /* number of user space mappings of the buffer, the buffer can't be reallocated while mapped */
+    atomic_t mmap_count;
+    /*
+     * bytes written so far, reads past this point block until a writer adds data
+     * a shared writable mmap is raw fixed size storage, its whole range counts as written (pcd_mmap)
+     */
+    atomic_t data_len;
+    /* readers waiting for data */
+    wait_queue_head_t read_queue;
+    /* writers waiting for space, the device grows through max_size */
+    wait_queue_head_t write_queue;
+    /* I/O statistics */
+    struct pcd_stats __percpu *stats;
+    /* read/write latency, recorded while pcd_latency_enabled is on */
+    struct pcd_latency __percpu *latency;
 };
 
 /* driver private data <<static>>*/
 struct pcdrv_private_data
 {
-    int total_devices;
+    /* probes run in parallel */
+    atomic_t total_devices;
     dev_t device_num_base;
+    /* number of minors reserved at device_num_base */
+    unsigned int max_devices;
+    /* free minors of the region, released ones are reused only once their device is gone */
+    struct ida minor_ida;
+    /* probed devices indexed by minor - MINOR(device_num_base) */
+    struct xarray devices;
     struct class *class_pcd;
 };
 
@@ -65,11 +144,50 @@ int pcd_platform_driver_remove(struct platform_device *);
 
 /* File Methods */
 loff_t pcd_lseek (struct file *filp, loff_t offset, int whence);
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos);
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos);
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from);
 int pcd_open (struct inode *inode, struct file *filp);
 int pcd_release (struct inode *inode, struct file *filp);
+int pcd_mmap (struct file *filp, struct vm_area_struct *vma);
+__poll_t pcd_poll (struct file *filp, poll_table *wait);
+#ifdef PCD_URING_CMD
+int pcd_uring_cmd (struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+#endif
+
+/* buffer helpers, the buffer itself is in pcd_core */
+int pcd_get_buffer(struct pcdev_private_data *pcdev_data);
 
 struct pcdev_platform_data * pcdev_get_platfrom_from_dt(struct device *dev);
 
+/* statistics */
+extern struct pcdrv_private_data pcdrv_data;
+extern const struct attribute_group pcd_stats_group;
+void pcd_debugfs_init(void);
+void pcd_debugfs_exit(void);
+
+/*
+ * latency histograms, off by default and switched through debugfs
+ * with the key disabled the read/write paths only run a patched out jump
+ */
+DECLARE_STATIC_KEY_FALSE(pcd_latency_enabled);
+
+static inline u64 pcd_latency_start(void)
+{
+    return static_branch_unlikely(&pcd_latency_enabled) ? ktime_get_ns() : 0;
+}
+
+static inline void pcd_latency_end(struct pcdev_private_data *pcdev_data, int dir, u64 start)
+{
+    u64 delta;
+
+    /* start is 0 when the key was enabled in the middle of the call */
+    if (static_branch_unlikely(&pcd_latency_enabled) && start)
+    {
+        delta = ktime_get_ns() - start;
+        this_cpu_inc(pcdev_data->latency->buckets[dir][min_t(unsigned int, ilog2(delta | 1), PCD_LATENCY_BUCKETS - 1)]);
+    }
+}
+struct pcdev_private_data *pcd_lookup_device(unsigned int minor);
+void pcd_put_device(struct pcdev_private_data *pcdev_data);
+
 #endif /*PCD_PLATFORM_DRIVER_DT_SYSFS_H*/
\ No newline at end of file
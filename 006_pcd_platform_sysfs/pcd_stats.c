@@ -0,0 +1,211 @@
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "pcd_platform_driver_dt_sysfs.h"
+
+/*
+ * per device I/O statistics and latency histograms
+ * the per cpu counters are kept by pcd_core, this exposes them through sysfs and debugfs
+ */
+
+/* debugfs directory of the driver */
+static struct dentry *pcd_debugfs_dir;
+
+DEFINE_STATIC_KEY_FALSE(pcd_latency_enabled);
+
+/* one read only attribute per counter under rgbpcdev-N/stats/ */
+#define PCD_STATS_ATTR(_field)                                                                  \
+static ssize_t _field##_show(struct device *dev, struct device_attribute *attr, char *buf)      \
+{                                                                                               \
+    struct pcdev_private_data *priv_data = dev_get_drvdata(dev->parent);                        \
+    struct pcd_stats_snapshot snap;                                                             \
+    pcd_stats_snapshot(priv_data->stats, &snap);                                                \
+    return sprintf(buf, "%llu\n", snap._field);                                                 \
+}                                                                                               \
+static DEVICE_ATTR_RO(_field)
+
+PCD_STATS_ATTR(bytes_read);
+PCD_STATS_ATTR(bytes_written);
+PCD_STATS_ATTR(reads);
+PCD_STATS_ATTR(writes);
+PCD_STATS_ATTR(short_reads);
+PCD_STATS_ATTR(short_writes);
+PCD_STATS_ATTR(efaults);
+PCD_STATS_ATTR(opens);
+
+static struct attribute *pcd_stats_attrs[] = {
+    &dev_attr_bytes_read.attr,
+    &dev_attr_bytes_written.attr,
+    &dev_attr_reads.attr,
+    &dev_attr_writes.attr,
+    &dev_attr_short_reads.attr,
+    &dev_attr_short_writes.attr,
+    &dev_attr_efaults.attr,
+    &dev_attr_opens.attr,
+    NULL
+};
+
+const struct attribute_group pcd_stats_group = {
+    .name = "stats",
+    .attrs = pcd_stats_attrs
+};
+
+/* debugfs stats, one line per probed device */
+static int pcd_stats_show(struct seq_file *s, void *unused)
+{
+    struct pcdev_private_data *pcdev_data;
+    struct pcd_stats_snapshot snap;
+    unsigned long minor;
+
+    seq_puts(s, "minor serial bytes_read bytes_written reads writes short_reads short_writes efaults opens\n");
+    /* remove erases the device under the same lock, the ones found here stay alive until unlock */
+    xa_lock(&pcdrv_data.devices);
+    xa_for_each(&pcdrv_data.devices, minor, pcdev_data)
+    {
+        pcd_stats_snapshot(pcdev_data->stats, &snap);
+        seq_printf(s, "%lu %s %llu %llu %llu %llu %llu %llu %llu %llu\n", minor, pcdev_data->pdata.serial_number,
+                snap.bytes_read, snap.bytes_written, snap.reads, snap.writes,
+                snap.short_reads, snap.short_writes, snap.efaults, snap.opens);
+    }
+    xa_unlock(&pcdrv_data.devices);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pcd_stats);
+
+/* latency_enable, 1 starts recording the histograms, 0 stops */
+static int pcd_latency_enable_get(void *data, u64 *val)
+{
+    *val = static_key_enabled(&pcd_latency_enabled);
+    return 0;
+}
+
+static int pcd_latency_enable_set(void *data, u64 val)
+{
+    if (val)
+        static_branch_enable(&pcd_latency_enabled);
+    else
+        static_branch_disable(&pcd_latency_enabled);
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(pcd_latency_enable_fops, pcd_latency_enable_get, pcd_latency_enable_set, "%llu\n");
+
+/* upper bound in ns of the bucket holding the permille-th call, 0 without calls */
+static u64 pcd_latency_percentile(const u64 *buckets, u64 total, unsigned int permille)
+{
+    u64 target = div_u64(total * permille + 999, 1000);
+    u64 seen = 0;
+    int i;
+
+    for (i = 0; i < PCD_LATENCY_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (seen && (seen >= target))
+            return 1ULL << (i + 1);
+    }
+    return 0;
+}
+
+/*
+ * latency, one line per device and direction: call count, p50/p99/p999 upper bounds in ns
+ * and the raw buckets. writing anything to it clears the histograms
+ */
+static int pcd_latency_show(struct seq_file *s, void *unused)
+{
+    struct pcdev_private_data *pcdev_data;
+    struct pcd_latency *latency;
+    u64 buckets[PCD_LATENCY_BUCKETS];
+    unsigned long minor;
+    u64 total;
+    int dir;
+    int cpu;
+    int i;
+
+    seq_puts(s, "minor serial op count p50_ns p99_ns p999_ns buckets\n");
+    /* same rule as pcd_stats_show */
+    xa_lock(&pcdrv_data.devices);
+    xa_for_each(&pcdrv_data.devices, minor, pcdev_data)
+    {
+        for (dir = 0; dir < PCD_STATS_DIRS; dir++)
+        {
+            memset(buckets, 0, sizeof(buckets));
+            total = 0;
+            for_each_possible_cpu(cpu)
+            {
+                latency = per_cpu_ptr(pcdev_data->latency, cpu);
+                for (i = 0; i < PCD_LATENCY_BUCKETS; i++)
+                    buckets[i] += READ_ONCE(latency->buckets[dir][i]);
+            }
+            for (i = 0; i < PCD_LATENCY_BUCKETS; i++)
+                total += buckets[i];
+
+            seq_printf(s, "%lu %s %s %llu %llu %llu %llu", minor, pcdev_data->pdata.serial_number,
+                    (dir == PCD_STATS_READ) ? "read" : "write", total,
+                    pcd_latency_percentile(buckets, total, 500),
+                    pcd_latency_percentile(buckets, total, 990),
+                    pcd_latency_percentile(buckets, total, 999));
+            for (i = 0; i < PCD_LATENCY_BUCKETS; i++)
+                seq_printf(s, " %llu", buckets[i]);
+            seq_putc(s, '\n');
+        }
+    }
+    xa_unlock(&pcdrv_data.devices);
+    return 0;
+}
+
+static int pcd_latency_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, pcd_latency_show, NULL);
+}
+
+/* clears the histograms of all devices, calls running meanwhile may still land in the old counts */
+static ssize_t pcd_latency_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct pcdev_private_data *pcdev_data;
+    unsigned long minor;
+    int cpu;
+
+    xa_lock(&pcdrv_data.devices);
+    xa_for_each(&pcdrv_data.devices, minor, pcdev_data)
+    {
+        for_each_possible_cpu(cpu)
+            memset(per_cpu_ptr(pcdev_data->latency, cpu), 0, sizeof(struct pcd_latency));
+    }
+    xa_unlock(&pcdrv_data.devices);
+    return count;
+}
+
+static const struct file_operations pcd_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = pcd_latency_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .write = pcd_latency_write,
+    .release = single_release
+};
+
+/* /sys/kernel/debug/pcd_sysfs/, debugfs failures aren't fatal to the driver */
+void pcd_debugfs_init(void)
+{
+    pcd_debugfs_dir = debugfs_create_dir("pcd_sysfs", NULL);
+    debugfs_create_file("stats", 0444, pcd_debugfs_dir, NULL, &pcd_stats_fops);
+    debugfs_create_file_unsafe("latency_enable", 0644, pcd_debugfs_dir, NULL, &pcd_latency_enable_fops);
+    debugfs_create_file("latency", 0644, pcd_debugfs_dir, NULL, &pcd_latency_fops);
+}
+
+void pcd_debugfs_exit(void)
+{
+    debugfs_remove_recursive(pcd_debugfs_dir);
+}
@@ -15,141 +15,511 @@
  * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
  */
 #include "pcd_platform_driver_dt_sysfs.h"
-static int check_permission(int dev_perm, int access_mode);
+
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
+
+static ssize_t pcd_do_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t pcd_do_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static void pcd_vma_open(struct vm_area_struct *vma);
+static void pcd_vma_close(struct vm_area_struct *vma);
+static vm_fault_t pcd_vma_fault(struct vm_fault *vmf);
+#ifdef PCD_URING_CMD
+static int pcd_uring_op(struct file *filp, const struct pcd_uring_op *op);
+#endif
+
+/*
+ * tracks the mappings of a device buffer, copies made by fork() are counted as well
+ * pages are mapped one at a time as they are touched
+ */
+static const struct vm_operations_struct pcd_vm_ops = {
+    .open = pcd_vma_open,
+    .close = pcd_vma_close,
+    .fault = pcd_vma_fault
+};
 
 /* File Methods */
 loff_t pcd_lseek (struct file *filp, loff_t offset, int whence)
 {
     struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
     struct device *dev = pcdev_data->device_pcd;
-    int max_size = pcdev_data->pdata.size;
-
-    loff_t temp;
-
-    dev_info(dev, "%s: lseek requested with offset %lld\n", pcdev_data->pdata.serial_number, offset);
-    dev_info(dev, "Initial value of the file pointer %lld\n", filp->f_pos);
-
-    switch (whence)
-    {
-        case SEEK_SET:
-            if ((offset > max_size) || (offset < 0))
-                return -EINVAL;
-            dev_info(dev, "SET value of the file pointer %lld\n", offset);
-            filp->f_pos = offset;
-            break;
-        case SEEK_CUR:
-            temp = filp->f_pos + offset;
-            if ((temp > max_size) || (temp < 0))
-                return -EINVAL;
+    int max_size = READ_ONCE(pcdev_data->pdata.size);
 
-            dev_info(dev, "CUR value of the file pointer %lld\n", offset);
-            filp->f_pos = temp;
-            break;
-        case SEEK_END:
-            temp = max_size + offset;
-            if ((temp > max_size) || (temp < 0))
-                return -EINVAL;
-            dev_info(dev, "END value of the file pointer %lld\n", offset);
+    loff_t pos;
 
-            filp->f_pos = temp;
-            break;
+    trace_pcd_lseek(pcdev_data->pdata.serial_number, offset, whence, filp->f_pos);
+    pcd_dbg(dev, "%s: lseek requested with offset %lld\n", pcdev_data->pdata.serial_number, offset);
+    pcd_dbg(dev, "Initial value of the file pointer %lld\n", filp->f_pos);
 
-        default:
-            return -EINVAL;
-
-    }
-    dev_info(dev, "Final value of the file pointer %lld\n", filp->f_pos);
+    /* the device may have shrunk under this file, SEEK_CUR then starts from the new end */
+    pos = pcd_core_lseek(filp->f_pos, offset, whence, max_size);
+    if (pos < 0)
+        return pos;
+    filp->f_pos = pos;
+    pcd_dbg(dev, "Final value of the file pointer %lld\n", filp->f_pos);
     return filp->f_pos;
 }
-ssize_t pcd_read (struct file * filp, char __user *buff, size_t count, loff_t * f_pos)
+ssize_t pcd_read_iter (struct kiocb *iocb, struct iov_iter *to)
+{
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(to);
+    u64 start = pcd_latency_start();
+    ssize_t ret = pcd_do_read_iter(iocb, to);
+
+    pcd_latency_end(pcdev_data, PCD_STATS_READ, start);
+    pcd_stats_account(pcdev_data->stats, PCD_STATS_READ, count, ret);
+    return ret;
+}
+
+static ssize_t pcd_do_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
+    struct file *filp = iocb->ki_filp;
     struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
     struct device *dev = pcdev_data->device_pcd;
-    int max_size = pcdev_data->pdata.size;
+    bool nonblock = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t count = iov_iter_count(to);
+    struct pcd_buffer *buffer;
+    ssize_t copied;
+    int max_size;
+    int data_len;
+    int idx;
+
+    trace_pcd_read(pcdev_data->pdata.serial_number, count, iocb->ki_pos);
+    pcd_dbg(dev, "Max size  %d bytes \n", pcdev_data->pdata.size);
+    pcd_dbg(dev, "%s: Read requested for  %zu bytes \n", pcdev_data->pdata.serial_number, count);
+    pcd_dbg(dev, "Position before read %lld \n", iocb->ki_pos);
+
+    if (!count)
+        return 0;
 
-    dev_info(dev, "Max size  %d bytes \n", pcdev_data->pdata.size);
-    dev_info(dev, "%s: Read requested for  %zu bytes \n", pcdev_data->pdata.serial_number, count);
-    dev_info(dev, "Position before read %lld \n", *f_pos);
-    
-    /* Adjust the count */
-    if ((count + *f_pos) > max_size)
+    /*
+     * readers only pin the current buffer, they never take the device lock
+     * and a resize waits for them before freeing the old buffer
+     */
+    idx = srcu_read_lock(&pcdev_data->srcu);
+    buffer = srcu_dereference(pcdev_data->buffer, &pcdev_data->srcu);
+    max_size = buffer->size;
+
+    /* Wait for data, only the bytes written so far can be read */
+    while (iocb->ki_pos >= (data_len = min(atomic_read(&pcdev_data->data_len), max_size)))
     {
-        dev_info(dev, "Requested count is out of boundary \n");
-        count = max_size - *f_pos;
+        /* don't hold up a resize while sleeping */
+        srcu_read_unlock(&pcdev_data->srcu, idx);
+        /* end of the device, a position left past it by a shrink is pulled back to the new end */
+        if (iocb->ki_pos >= max_size)
+        {
+            iocb->ki_pos = max_size;
+            return 0;
+        }
+        if (nonblock)
+            return -EAGAIN;
+        pcd_dbg(dev, "Waiting for data at %lld \n", iocb->ki_pos);
+        if (wait_event_interruptible(pcdev_data->read_queue,
+                (iocb->ki_pos < atomic_read(&pcdev_data->data_len)) || (iocb->ki_pos >= READ_ONCE(pcdev_data->pdata.size))))
+            return -ERESTARTSYS;
+        idx = srcu_read_lock(&pcdev_data->srcu);
+        buffer = srcu_dereference(pcdev_data->buffer, &pcdev_data->srcu);
+        max_size = buffer->size;
     }
 
-    /* Copy to user */
-    if (copy_to_user(buff, &(pcdev_data->buffer[*f_pos]), count))
+    /* Adjust the count, the loop left ki_pos inside the data */
+    count = pcd_core_clamp(iocb->ki_pos, count, data_len);
+
+    /* Copy to user, all the segments of a readv()/pipe in one go, holes read as zeros */
+    copied = pcd_buffer_read(buffer, iocb->ki_pos, count, to);
+    srcu_read_unlock(&pcdev_data->srcu, idx);
+    if (copied < 0)
     {
         dev_err(dev, "Error copying to user \n");
-        return -EFAULT;
+        return copied;
     }
 
     /* Update f_pos */
-    *f_pos += count;
-    dev_info(dev, "Position after read %lld \n", *f_pos);
+    iocb->ki_pos += copied;
+    pcd_dbg(dev, "Position after read %lld \n", iocb->ki_pos);
 
     /* return the number of character successfully read*/
-    return count;
+    return copied;
+}
+
+ssize_t pcd_write_iter (struct kiocb *iocb, struct iov_iter *from)
+{
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(from);
+    u64 start = pcd_latency_start();
+    ssize_t ret = pcd_do_write_iter(iocb, from);
+
+    pcd_latency_end(pcdev_data, PCD_STATS_WRITE, start);
+    pcd_stats_account(pcdev_data->stats, PCD_STATS_WRITE, count, ret);
+    return ret;
 }
 
-ssize_t pcd_write (struct file * filp, const char __user *buff, size_t count, loff_t *f_pos)
+static ssize_t pcd_do_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+    struct file *filp = iocb->ki_filp;
     /* added during open */
     struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
     /* allocated during probe */
     struct device *dev = pcdev_data->device_pcd;
-    
-    int max_size = pcdev_data->pdata.size;
-    dev_info(dev, "Max size  %d bytes \n", pcdev_data->pdata.size);
-    dev_info(dev, "%s: Wrire requested for %zu bytes \n", pcdev_data->pdata.serial_number, count);
-    dev_info(dev, "Position before writing %lld \n", *f_pos);
-    
-    /* Adjust the count */
-    if ((count + *f_pos) > max_size)
-    {
-        dev_info(dev, "Requested count is out of boundary \n");
-        if (*f_pos >= max_size)
-        {
-            /* discard writing */
-            return count;
-        }
-        count = max_size - *f_pos;
+    bool nonblock = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t count = iov_iter_count(from);
+    struct pcd_buffer *buffer;
+    ssize_t copied;
+    int max_size;
+
+    trace_pcd_write(pcdev_data->pdata.serial_number, count, iocb->ki_pos);
+    pcd_dbg(dev, "Max size  %d bytes \n", pcdev_data->pdata.size);
+    pcd_dbg(dev, "%s: Wrire requested for %zu bytes \n", pcdev_data->pdata.serial_number, count);
+    pcd_dbg(dev, "Position before writing %lld \n", iocb->ki_pos);
+
+    if (!count)
+        return 0;
+
+    /* writers are serialized against each other and against resize */
+    if (nonblock)
+    {
+        if (!mutex_trylock(&pcdev_data->lock))
+            return -EAGAIN;
+    }
+    else if (mutex_lock_interruptible(&pcdev_data->lock))
+    {
+        return -ERESTARTSYS;
+    }
+    buffer = rcu_dereference_protected(pcdev_data->buffer, lockdep_is_held(&pcdev_data->lock));
+    max_size = buffer->size;
 
+    /* Wait for space, the device is full past its end until max_size grows */
+    while (iocb->ki_pos >= max_size)
+    {
+        /* a shrink doesn't leave a gap, the writer continues at the new end */
+        iocb->ki_pos = max_size;
+        mutex_unlock(&pcdev_data->lock);
+        if (nonblock)
+            return -EAGAIN;
+        pcd_dbg(dev, "Waiting for space at %lld \n", iocb->ki_pos);
+        if (wait_event_interruptible(pcdev_data->write_queue, iocb->ki_pos < READ_ONCE(pcdev_data->pdata.size)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&pcdev_data->lock))
+            return -ERESTARTSYS;
+        buffer = rcu_dereference_protected(pcdev_data->buffer, lockdep_is_held(&pcdev_data->lock));
+        max_size = buffer->size;
     }
 
-    /* Copy from user */
-    if (copy_from_user(&(pcdev_data->buffer[*f_pos]),buff, count))
+    /* Adjust the count, the loop left ki_pos inside the device */
+    count = pcd_core_clamp(iocb->ki_pos, count, max_size);
+
+    /* Copy from user, all the segments of a writev()/pipe in one go, the pages are allocated here */
+    copied = pcd_buffer_write(buffer, iocb->ki_pos, count, from);
+    if (copied < 0)
     {
+        mutex_unlock(&pcdev_data->lock);
         dev_err(dev, "Error copying from user \n");
-        return -EFAULT;
+        return copied;
     }
 
     /* Update f_pos */
-    *f_pos += count;
-    dev_info(dev, "Position after writing %lld \n", *f_pos);
+    iocb->ki_pos += copied;
+    pcd_dbg(dev, "Position after writing %lld \n", iocb->ki_pos);
+
+    /* new data for the readers, data_len only grows with writes */
+    if (iocb->ki_pos > atomic_read(&pcdev_data->data_len))
+        atomic_set(&pcdev_data->data_len, iocb->ki_pos);
+    mutex_unlock(&pcdev_data->lock);
+    wake_up_interruptible(&pcdev_data->read_queue);
 
     /* return the number of character successfully read*/
-    return count;
+    return copied;
+}
+
+__poll_t pcd_poll (struct file *filp, poll_table *wait)
+{
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    loff_t pos = READ_ONCE(filp->f_pos);
+    int max_size = READ_ONCE(pcdev_data->pdata.size);
+    __poll_t mask = 0;
+
+    poll_wait(filp, &pcdev_data->read_queue, wait);
+    poll_wait(filp, &pcdev_data->write_queue, wait);
+
+    /* new data or end of the device, read won't block */
+    if ((pos < atomic_read(&pcdev_data->data_len)) || (pos >= max_size))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (pos < max_size)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
+static void pcd_vma_open(struct vm_area_struct *vma)
+{
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)vma->vm_private_data;
+    /* each mapping keeps the state, a split or fork comes here as well */
+    kref_get(&pcdev_data->ref);
+    atomic_inc(&pcdev_data->mmap_count);
+}
+
+static void pcd_vma_close(struct vm_area_struct *vma)
+{
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)vma->vm_private_data;
+    atomic_dec(&pcdev_data->mmap_count);
+    pcd_put_device(pcdev_data);
+}
+
+/* maps the page under the faulting address, a hole gets its page here like with a write */
+static vm_fault_t pcd_vma_fault(struct vm_fault *vmf)
+{
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)vmf->vma->vm_private_data;
+    struct pcd_buffer *buffer;
+    struct page *page;
+    vm_fault_t ret = 0;
+    int idx;
+
+    /* a resize is refused while the buffer is mapped, this is the buffer pcd_mmap checked against */
+    idx = srcu_read_lock(&pcdev_data->srcu);
+    buffer = srcu_dereference(pcdev_data->buffer, &pcdev_data->srcu);
+    if (vmf->pgoff >= DIV_ROUND_UP(buffer->size, PAGE_SIZE))
+    {
+        ret = VM_FAULT_SIGBUS;
+        goto out;
+    }
+    page = pcd_buffer_page(buffer, vmf->pgoff);
+    if (!page)
+    {
+        ret = VM_FAULT_OOM;
+        goto out;
+    }
+    /* the mapping holds its own reference, the page outlives the buffer until it's unmapped */
+    get_page(page);
+    vmf->page = page;
+out:
+    srcu_read_unlock(&pcdev_data->srcu, idx);
+    return ret;
 }
-static int check_permission(int dev_perm, int access_mode)
+
+int pcd_mmap (struct file *filp, struct vm_area_struct *vma)
 {
-    pr_info("Perm: 0x%x",dev_perm);
-    switch (dev_perm)
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    struct device *dev = pcdev_data->device_pcd;
+    struct pcd_buffer *buffer;
+    unsigned long buffer_pages;
+    unsigned long nr_pages = vma_pages(vma);
+    loff_t end;
+    int ret = 0;
+
+    pcd_dbg(dev, "%s: mmap requested for %lu pages at page offset %lu\n", pcdev_data->pdata.serial_number, nr_pages, vma->vm_pgoff);
+
+    /* a resize can't replace the buffer until the mapping is counted */
+    mutex_lock(&pcdev_data->lock);
+    buffer = rcu_dereference_protected(pcdev_data->buffer, lockdep_is_held(&pcdev_data->lock));
+    /* the buffer is mapped in whole pages */
+    buffer_pages = PAGE_ALIGN(buffer->size) >> PAGE_SHIFT;
+
+    /* the mapping has to fit inside the device buffer */
+    if ((vma->vm_pgoff >= buffer_pages) || (nr_pages > (buffer_pages - vma->vm_pgoff)))
     {
-        case RDONLY:
-            if((access_mode & FMODE_READ) && !(access_mode & FMODE_WRITE))
-                return 0;
+        dev_err(dev, "mmap request is out of boundary \n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* the buffer pages are mapped directly by pcd_vma_fault, no copy_to_user/copy_from_user on this path */
+    vma->vm_ops = &pcd_vm_ops;
+    vma->vm_private_data = pcdev_data;
+    pcd_vma_open(vma);
+
+    /*
+     * a shared mapping that can be written is raw fixed size storage: stores through it never pass
+     * pcd_write, so the whole mapped range counts as data for read() from now on
+     */
+    if ((vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_MAYWRITE))
+    {
+        end = min_t(loff_t, (loff_t)(vma->vm_pgoff + nr_pages) << PAGE_SHIFT, buffer->size);
+        if (end > atomic_read(&pcdev_data->data_len))
+            atomic_set(&pcdev_data->data_len, end);
+    }
+out:
+    mutex_unlock(&pcdev_data->lock);
+    if (!ret)
+        wake_up_interruptible(&pcdev_data->read_queue);
+    return ret;
+}
+
+#ifdef PCD_URING_CMD
+/*
+ * io_uring passthrough, one PCD_URING_CMD_BATCH runs up to PCD_URING_MAX_OPS positional
+ * reads/writes/fills and completes inline, so the per operation syscall cost goes away.
+ * the ops never wait for data or space, they are short instead like pread()/pwrite() on a file
+ */
+int pcd_uring_cmd (struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct file *filp = ioucmd->file;
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    struct device *dev = pcdev_data->device_pcd;
+    const struct pcd_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+    struct pcd_uring_op __user *uops;
+    struct pcd_uring_op *ops;
+    /* an inline issue must not sleep on the lock, io_uring retries from a worker on -EAGAIN */
+    bool nonblock = issue_flags & IO_URING_F_NONBLOCK;
+    bool locked = false;
+    bool written = false;
+    int ret = 0;
+    u32 nr;
+    u32 i;
+    int idx;
+
+    if (ioucmd->cmd_op != PCD_URING_CMD_BATCH)
+        return -ENOTTY;
+
+    /* the sqe is shared with user space, read every field only once */
+    uops = u64_to_user_ptr(READ_ONCE(cmd->ops));
+    nr = READ_ONCE(cmd->nr);
+    if (READ_ONCE(cmd->flags) || !nr || (nr > PCD_URING_MAX_OPS))
+        return -EINVAL;
+
+    pcd_dbg(dev, "%s: uring batch of %u ops \n", pcdev_data->pdata.serial_number, nr);
+
+    /*
+     * the ops are read once, user space rewriting them during the batch changes nothing.
+     * whether the batch locks is known before srcu, the lock is never taken inside it:
+     * store_max_size calls synchronize_srcu after dropping the lock and the order must stay lock -> srcu
+     */
+    ops = memdup_user(uops, array_size(nr, sizeof(*ops)));
+    if (IS_ERR(ops))
+        return PTR_ERR(ops);
+    for (i = 0; i < nr; i++)
+    {
+        if (ops[i].opcode != PCD_OP_READ)
+        {
+            locked = true;
             break;
-        case WRONLY:
-            if(!(access_mode & FMODE_READ) && (access_mode & FMODE_WRITE))
-                return 0;
+        }
+    }
+    /*
+     * a batch that writes takes the lock before its first op, so an inline issue that can't get it
+     * returns -EAGAIN with nothing done and io_uring issues the whole batch again from a worker
+     */
+    if (locked)
+    {
+        if (nonblock)
+        {
+            if (!mutex_trylock(&pcdev_data->lock))
+                ret = -EAGAIN;
+        }
+        else if (mutex_lock_interruptible(&pcdev_data->lock))
+        {
+            ret = -EINTR;
+        }
+        if (ret)
+        {
+            kfree(ops);
+            return ret;
+        }
+    }
+
+    /* the buffer can't be freed under the batch */
+    idx = srcu_read_lock(&pcdev_data->srcu);
+    for (i = 0; i < nr; i++)
+    {
+        ret = pcd_uring_op(filp, &ops[i]);
+        pcd_stats_account(pcdev_data->stats, (ops[i].opcode == PCD_OP_READ) ? PCD_STATS_READ : PCD_STATS_WRITE, ops[i].len, ret);
+        if ((ops[i].opcode != PCD_OP_READ) && (ret > 0))
+            written = true;
+        if (put_user(ret, &uops[i].res))
+        {
+            ret = -EFAULT;
             break;
-        case RDWR:
+        }
+        /* stop at the first failing op, the following ones may depend on it */
+        if (ret < 0)
+        {
+            i++;
+            break;
+        }
+    }
+    srcu_read_unlock(&pcdev_data->srcu, idx);
+    if (locked)
+        mutex_unlock(&pcdev_data->lock);
+    kfree(ops);
+
+    if (written)
+        wake_up_interruptible(&pcdev_data->read_queue);
+
+    /* number of ops executed, their res tells how each went */
+    return i ? i : ret;
+}
+
+/* runs one op of a batch under srcu, pcd_uring_cmd holds the lock when the batch has a write */
+static int pcd_uring_op(struct file *filp, const struct pcd_uring_op *op)
+{
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    void __user *ubuf = u64_to_user_ptr(op->addr);
+    struct pcd_buffer *buffer;
+    struct iov_iter iter;
+    size_t count = op->len;
+    u64 pos = op->offset;
+    ssize_t ret;
+    int max_size;
+    int data_len;
+
+    if (op->flags)
+        return -EINVAL;
+    if (!count)
+        return 0;
+
+    if (op->opcode == PCD_OP_READ)
+    {
+        if (!(filp->f_mode & FMODE_READ))
+            return -EBADF;
+        /* when a write of this batch holds the lock, this is the buffer it wrote to */
+        buffer = srcu_dereference(pcdev_data->buffer, &pcdev_data->srcu);
+        trace_pcd_read(pcdev_data->pdata.serial_number, count, pos);
+        /* only the bytes written so far can be read */
+        data_len = min(atomic_read(&pcdev_data->data_len), buffer->size);
+        count = pcd_core_clamp(pos, count, data_len);
+        if (!count)
             return 0;
+        ret = import_ubuf(ITER_DEST, ubuf, count, &iter);
+        if (ret < 0)
+            return ret;
+        return pcd_buffer_read(buffer, pos, count, &iter);
     }
-    return -EPERM;
+
+    if ((op->opcode != PCD_OP_WRITE) && (op->opcode != PCD_OP_FILL))
+        return -EINVAL;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+
+    /* writers are serialized against each other and against resize, as in pcd_write_iter */
+    buffer = rcu_dereference_protected(pcdev_data->buffer, lockdep_is_held(&pcdev_data->lock));
+    max_size = buffer->size;
+
+    trace_pcd_write(pcdev_data->pdata.serial_number, count, pos);
+    /* the device is full past its end */
+    count = pcd_core_clamp(pos, count, max_size);
+    if (!count)
+        return -ENOSPC;
+
+    if (op->opcode == PCD_OP_FILL)
+    {
+        ret = pcd_buffer_fill(buffer, pos, count, op->fill);
+    }
+    else
+    {
+        ret = import_ubuf(ITER_SOURCE, ubuf, count, &iter);
+        if (ret < 0)
+            return ret;
+        ret = pcd_buffer_write(buffer, pos, count, &iter);
+    }
+    if (ret < 0)
+        return ret;
+
+    /* new data for the readers, data_len only grows with writes */
+    if ((pos + ret) > atomic_read(&pcdev_data->data_len))
+        atomic_set(&pcdev_data->data_len, pos + ret);
+
+    return ret;
 }
+#endif
 
 int pcd_open (struct inode *inode, struct file *filp)
 {
@@ -158,34 +528,61 @@ int pcd_open (struct inode *inode, struct file *filp)
     struct pcdev_private_data *pcdev_data = NULL; /* contained in driver data of struct platform_device->struct device dev -> void* driver_data */
     struct device *dev = NULL;
 
-    /* get device private data structure */
-    pcdev_data = container_of(inode->i_cdev,struct pcdev_private_data, cdev);
-    
+    /* find out on which device file the open operation was attempted from the user space */
+    minor_number = MINOR(inode->i_rdev);
+
+    /* get device private data structure, a device that is being removed isn't there anymore
+       the reference is dropped by pcd_release */
+    pcdev_data = pcd_lookup_device(minor_number);
+    if (!pcdev_data)
+        return -ENODEV;
+
     /* get pointer to struct device data structure */
     /* allocated during probe */
     dev = pcdev_data->device_pcd;
 
-    /* find out on which device file the open operation was attempted from the user space */
-    minor_number = MINOR(inode->i_rdev);
-    dev_info(dev, "Minor Access: %d\n", minor_number);
+    pcd_dbg(dev, "Minor Access: %d\n", minor_number);
 
     /* save private data of this file in the file pointer so other methods can access it */
     filp->private_data = pcdev_data;
+    trace_pcd_open(pcdev_data->pdata.serial_number, minor_number, filp->f_mode);
     /* check permission */
-    ret = check_permission(pcdev_data->pdata.perm, filp->f_mode);
-    (!ret)? dev_info(dev, "PCD %d file oped successfully!\n", minor_number) : dev_info(dev, "PCD %d file failed to open!\n", minor_number);
+    pcd_dbg(dev, "Perm: 0x%x\n", pcdev_data->pdata.perm);
+    ret = pcd_core_check_permission(pcdev_data->pdata.perm, filp->f_mode);
+    if (!ret)
+        ret = pcd_get_buffer(pcdev_data);
+    if (!ret)
+        pcd_stats_opened(pcdev_data->stats);
+    /*
+     * opening for write with O_TRUNC discards the data, readers wait for new writes
+     * a mapped buffer is raw storage, the data the mappings hold stays readable
+     */
+    if (!ret && (filp->f_mode & FMODE_WRITE) && (filp->f_flags & O_TRUNC))
+    {
+        mutex_lock(&pcdev_data->lock);
+        if (!atomic_read(&pcdev_data->mmap_count))
+            atomic_set(&pcdev_data->data_len, 0);
+        mutex_unlock(&pcdev_data->lock);
+    }
+    (!ret)? pcd_dbg(dev, "PCD %d file oped successfully!\n", minor_number) : pcd_dbg(dev, "PCD %d file failed to open!\n", minor_number);
+    /* release isn't called for a failed open */
+    if (ret)
+        pcd_put_device(pcdev_data);
 
     return ret;
 }
 int pcd_release (struct inode *inode, struct file *filp)
 {
-    pr_info("Close requested\n");
+    struct pcdev_private_data *pcdev_data = (struct pcdev_private_data *)filp->private_data;
+    pcd_dbg(pcdev_data->device_pcd, "Close requested\n");
+    pcd_put_device(pcdev_data);
     return 0;
 }
 struct pcdev_platform_data * pcdev_get_platfrom_from_dt(struct device *dev)
 {
     struct device_node* dev_node = dev->of_node;
     struct pcdev_platform_data *pdata;
+    u32 node;
     /* check if it's a DT node or a notmal module device*/
     if (!dev_node)
     {
@@ -218,5 +615,20 @@ struct pcdev_platform_data * pcdev_get_platfrom_from_dt(struct device *dev)
         dev_info(dev, "missing permission Property\n");
         return ERR_PTR(-EINVAL);
     }
+    /* optional buffer placement, rgb,numa-node = <N> or rgb,numa-interleave */
+    pdata->node = NUMA_NO_NODE;
+    if (of_property_read_bool(dev_node, "rgb,numa-interleave"))
+    {
+        pdata->node = PCD_NODE_INTERLEAVE;
+    }
+    else if (!of_property_read_u32(dev_node, "rgb,numa-node", &node))
+    {
+        if ((node >= MAX_NUMNODES) || !node_online(node))
+        {
+            dev_info(dev, "invalid numa-node Property %u\n", node);
+            return ERR_PTR(-EINVAL);
+        }
+        pdata->node = node;
+    }
     return pdata;
 }
\ No newline at end of file
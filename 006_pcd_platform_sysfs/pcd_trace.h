@@ -0,0 +1,35 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pcd_sysfs
+
+#if !defined(PCD_SYSFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define PCD_SYSFS_TRACE_H
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * tracepoints of the file methods, enabled at run time through
+ * /sys/kernel/tracing/events/pcd_sysfs/ and free when disabled
+ */
+#include "pcd_trace_events.h"
+
+#endif /*PCD_SYSFS_TRACE_H*/
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pcd_trace
+#include <trace/define_trace.h>
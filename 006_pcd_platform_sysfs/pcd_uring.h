@@ -0,0 +1,72 @@
+#ifndef PCD_URING_H
+#define PCD_URING_H
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * io_uring passthrough commands of the pcd_sysfs devices, shared with user space
+ *
+ * a PCD_URING_CMD_BATCH sqe (IORING_OP_URING_CMD) carries a struct pcd_uring_cmd in sqe->cmd
+ * pointing to an array of struct pcd_uring_op, executed in order by one call of the driver.
+ * execution stops after the first failing op, the driver stores the outcome of every executed op
+ * in its res field. the cqe result is the number of executed ops, negative when the batch itself
+ * is invalid or can't be read. the driver copies the array once before the first op, changing it
+ * while the batch runs has no effect other than on res. a batch with a write holds the device lock
+ * from its first op to its last, so the ops of one batch don't interleave with other writers
+ */
+#include <linux/types.h>
+
+/* sqe->cmd_op */
+#define PCD_URING_CMD_BATCH 0x01u
+
+/* upper bound of pcd_uring_cmd.nr */
+#define PCD_URING_MAX_OPS 256u
+
+/* pcd_uring_op.opcode */
+enum {
+    /* copy len bytes at offset to addr, short past the written data */
+    PCD_OP_READ,
+    /* copy len bytes from addr to offset, short past the end of the buffer */
+    PCD_OP_WRITE,
+    /* set len bytes at offset to fill, addr is unused */
+    PCD_OP_FILL
+};
+
+struct pcd_uring_op {
+    /* user buffer */
+    __u64 addr;
+    /* device offset */
+    __u64 offset;
+    __u32 len;
+    __u8 opcode;
+    __u8 fill;
+    /* must be 0 */
+    __u16 flags;
+    /* bytes done or -errno, set by the driver */
+    __s32 res;
+    __u32 resv;
+};
+
+/* payload of sqe->cmd, fits in a regular 64 byte sqe */
+struct pcd_uring_cmd {
+    /* user pointer to struct pcd_uring_op[nr] */
+    __u64 ops;
+    __u32 nr;
+    /* must be 0 */
+    __u32 flags;
+};
+
+#endif /*PCD_URING_H*/
@@ -19,15 +19,16 @@
 #undef pr_fmt
 #define pr_fmt(fmt) "%s :" fmt,__func__
 
-#define RDONLY 0x01u
-#define WRONLY 0x10u
-#define RDWR 0x11u
+/* RDONLY, WRONLY and RDWR */
+#include "pcd_core.h"
 
 struct pcdev_platform_data
 {
     int size;
     int perm;
     const char* serial_number;
+    /* NUMA node of the buffer, NUMA_NO_NODE for the writer's node or PCD_NODE_INTERLEAVE */
+    int node;
 };
 
 #endif
\ No newline at end of file
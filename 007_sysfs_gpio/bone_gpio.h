@@ -0,0 +1,79 @@
+#ifndef BONE_GPIO_H
+#define BONE_GPIO_H
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * character device interface of a bone-gpios instance, shared with user space
+ *
+ * /dev/bone-gpioN drives all the lines of instance N at once, bit i of a bitmap is the line of
+ * the i-th child node of the DT node, in DT order:
+ *  read()   samples every line into a little endian bitmap of DIV_ROUND_UP(nlines, 8) bytes
+ *  write()  sets every line from a bitmap of the same layout
+ *  ioctl()  the same on a 64 bit bitmap, with a mask to touch only some of the lines
+ *
+ * edge events: a line set to rising, falling or both in its sysfs edge attribute queues a
+ * struct bone_gpio_event per edge, BONE_GPIO_WATCH_EVENTS picks the lines of a file, then
+ *  read()   returns as many queued events of those lines as fit, oldest first, and blocks
+ *           until there is one unless O_NONBLOCK
+ *  poll()   EPOLLIN while one of those lines has an event queued
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* lines of one instance, one bit each in the bitmaps */
+#define BONE_GPIO_MAX_LINES 64u
+
+struct bone_gpio_info {
+    /* lines of the instance */
+    __u32 nlines;
+    /* must be 0 */
+    __u32 resv;
+};
+
+struct bone_gpio_values {
+    /* bit i is the value of line i */
+    __u64 bits;
+    /* lines the call applies to, GET leaves the other bits 0, SET leaves the other lines as they are */
+    __u64 mask;
+};
+
+/* id of an event, also the bits of the edges a line reports */
+#define BONE_GPIO_EVENT_RISING 0x1u
+#define BONE_GPIO_EVENT_FALLING 0x2u
+
+struct bone_gpio_event {
+    /* CLOCK_MONOTONIC of the interrupt, in ns */
+    __u64 timestamp_ns;
+    /* BONE_GPIO_EVENT_RISING or BONE_GPIO_EVENT_FALLING */
+    __u32 id;
+    /* bit of the line in the bitmaps */
+    __u32 line;
+    /* per line count of the events, a gap means the queue of the line overflowed */
+    __u32 seqno;
+    /* 0 */
+    __u32 resv;
+};
+
+#define BONE_GPIO_IOC_MAGIC 'B'
+
+#define BONE_GPIO_GET_INFO _IOR(BONE_GPIO_IOC_MAGIC, 0x00, struct bone_gpio_info)
+#define BONE_GPIO_GET_VALUES _IOWR(BONE_GPIO_IOC_MAGIC, 0x01, struct bone_gpio_values)
+#define BONE_GPIO_SET_VALUES _IOW(BONE_GPIO_IOC_MAGIC, 0x02, struct bone_gpio_values)
+/* bitmap of the lines read() returns the events of on this file, 0 makes read() sample the values again */
+#define BONE_GPIO_WATCH_EVENTS _IOW(BONE_GPIO_IOC_MAGIC, 0x03, __u64)
+
+#endif /*BONE_GPIO_H*/
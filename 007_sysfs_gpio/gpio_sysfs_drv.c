@@ -26,6 +26,36 @@
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/gpio/consumer.h>
+#include <linux/uaccess.h>
+#include <linux/idr.h>
+#include <linux/bits.h>
+#include <linux/bitmap.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/interrupt.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/srcu.h>
+#include "bone_gpio.h"
+
+/* instances with a char device, minors of the region */
+#define BONE_GPIO_MAX_INSTANCES 8u
+/* events queued per line, a power of 2 */
+#define BONE_GPIO_EVENT_FIFO 64
+/* shortest step of a waveform, the engine is a FIFO thread that must leave the cpu to the others */
+#define GPIO_WAVE_MIN_NS 10000ULL
+/* the first step is this far after start, every line starting with it */
+#define GPIO_WAVE_LEAD_NS 1000000ULL
+/* log2 buckets of the engine lateness, 1ns to 4s */
+#define GPIO_JITTER_BUCKETS 32
 
 #undef pr_fmt
 #define pr_fmt(fmt) "%s :" fmt,__func__
@@ -43,15 +73,169 @@ static int gpio_driver_remove(struct platform_device *pdev);
 SHOW(direction);
 SHOW(value);
 SHOW(label);
+SHOW(edge);
+SHOW(debounce);
+SHOW(waveform);
 
 STORE(direction);
 STORE(value);
+STORE(edge);
+STORE(debounce);
+STORE(waveform);
+
+/* char device of an instance, see bone_gpio.h */
+static int gpio_bank_open(struct inode *inode, struct file *filp);
+static ssize_t gpio_bank_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos);
+static ssize_t gpio_bank_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos);
+static long gpio_bank_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static __poll_t gpio_bank_poll(struct file *filp, poll_table *wait);
+static int gpio_bank_release(struct inode *inode, struct file *filp);
+
+/* bulk access of all the lines of an instance, on its char device */
+SHOW(values);
+STORE(values);
+SHOW(waveforms);
+STORE(waveforms);
+
+/* helper functions */
+struct gpiobank_private_data;
+static int gpio_bank_create(struct device *dev, struct gpiobank_private_data *bank);
+static u64 gpio_bank_mask(struct gpiobank_private_data *bank);
+static int gpio_bank_get(struct gpiobank_private_data *bank, u64 mask, u64 *bits);
+static int gpio_bank_set(struct gpiobank_private_data *bank, u64 mask, u64 bits);
+static bool gpio_bank_events_pending(struct gpiobank_private_data *bank, u64 watch);
+static bool gpio_bank_pop_event(struct gpiobank_private_data *bank, u64 watch, struct bone_gpio_event *event);
+static ssize_t gpio_bank_read_events(struct file *filp, char __user *buff, size_t count);
+static long gpio_bank_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int gpio_bank_enter(struct gpiobank_private_data *bank, int *idx);
+static void gpio_bank_exit(struct gpiobank_private_data *bank, int idx);
+static bool gpio_bank_readable(struct gpiobank_private_data *bank, u64 watch);
+static void gpio_bank_free(struct device *dev);
+static void gpio_bank_put(void *data);
+int device_unregister_wrapper(struct device* dev, void* data);
+
+/* edge interrupts of a line */
+struct gpiodev_private_data;
+static int gpio_line_set_edge(struct gpiodev_private_data *dev_data, unsigned int edge);
+static irqreturn_t gpio_line_irq(int irq, void *data);
+static irqreturn_t gpio_line_irq_thread(int irq, void *data);
+static void gpio_line_push_event(struct gpiodev_private_data *dev_data, u32 id, u64 timestamp);
+
+/* debouncing of a line, by the controller or by the software filter */
+static int gpio_line_set_debounce(struct gpiodev_private_data *dev_data, unsigned int debounce_us);
+static enum hrtimer_restart gpio_line_filter_expired(struct hrtimer *timer);
 
+/* waveform engine of an instance */
+struct gpio_wave;
+struct gpio_jitter;
+static int gpio_wave_start(struct gpiobank_private_data *bank);
+static void gpio_wave_stop(struct gpiobank_private_data *bank);
+static int gpio_wave_thread(void *data);
+static u64 gpio_wave_duration(const struct gpio_wave *wave, unsigned int index);
+static int gpio_wave_advance(struct gpio_wave *wave);
+static u64 gpio_wave_skip(struct gpio_wave *wave, ktime_t now);
+static ktime_t gpio_wave_next(struct gpiobank_private_data *bank);
+static void gpio_wave_account(struct gpiobank_private_data *bank, u64 late_ns, u64 skipped);
+static void gpio_jitter_snapshot(struct gpiobank_private_data *bank, struct gpio_jitter *snap);
+static u64 gpio_jitter_percentile(const struct gpio_jitter *snap, unsigned int permille);
+
+/*
+ * waveform of an output line, nbits 0 for none
+ * segment i drives bit i of bits for step_ns, a PWM is the 2 segments high for duty_ns then low
+ */
+struct gpio_wave {
+    u64 bits;
+    unsigned int nbits;
+    u64 step_ns;
+    /* 0 for a pattern */
+    u64 period_ns;
+    u64 duty_ns;
+    /* segment driven now, and when the next one starts */
+    unsigned int index;
+    ktime_t next;
+};
+
+/* lateness of the engine wake ups against their deadline */
+struct gpio_jitter {
+    u64 samples;
+    u64 min_ns;
+    u64 max_ns;
+    u64 total_ns;
+    /* whole periods skipped since the engine woke up too late for them, summed over the lines */
+    u64 overruns;
+    u64 buckets[GPIO_JITTER_BUCKETS];
+};
 
 /* per device private data <<dynamic>> */
 struct gpiodev_private_data {
     char label[20];
     struct gpio_desc *desc;
+    /* instance and bit of the line, for its events */
+    struct gpiobank_private_data *bank;
+    unsigned int line;
+    /* the sysfs device, its value attribute is notified on every event */
+    struct device *dev;
+    /* node of the value attribute, looked up once since events are pushed from hard irq context */
+    struct kernfs_node *value_kn;
+    /* BONE_GPIO_EVENT_* edges that queue an event, 0 when the irq isn't requested */
+    unsigned int edge;
+    int irq;
+    /* taken by the hard handler, as close to the edge as it gets */
+    u64 timestamp;
+    u32 seqno;
+    /* events not read yet, the readers of the instance share them */
+    DECLARE_KFIFO(events, struct bone_gpio_event, BONE_GPIO_EVENT_FIFO);
+    /* the queue and the filter state below, the filter timer takes it in hard irq context */
+    spinlock_t events_lock;
+    /* debounce period in us, 0 off, by the controller when it supports it */
+    unsigned int debounce_us;
+    bool debounce_hw;
+    /* software filter: every edge restarts it, the level the line settles on is the event */
+    struct hrtimer filter;
+    /* logical level after the last edge, and the last one reported */
+    int raw_level;
+    int stable_level;
+    /* the first edge since the line was last stable */
+    bool bouncing;
+    u64 burst_ts;
+    /* under wave_lock of the instance, fixed while its engine runs */
+    struct gpio_wave wave;
+};
+
+/* per instance data <<dynamic>>, all the lines of one DT node behind one char device */
+struct gpiobank_private_data {
+    /* lines in DT order, line i is bit i of the bitmaps */
+    struct gpiodev_private_data *lines[BONE_GPIO_MAX_LINES];
+    unsigned int nlines;
+    /* the descriptors of lines as one array, set and sampled by one gpiolib call */
+    struct gpio_descs *descs;
+    /* a masked set packs the descriptors of its lines here */
+    struct gpio_desc *set_descs[BONE_GPIO_MAX_LINES];
+    /* serializes the users of set_descs and the edge changes of the lines */
+    struct mutex lock;
+    /* readers sleeping for an event of one of the lines */
+    wait_queue_head_t wait;
+    /* waveform engine, runs the lines in wave_mask while wave_task exists, both under wave_lock */
+    struct mutex wave_lock;
+    struct task_struct *wave_task;
+    u64 wave_mask;
+    /* the engine updates it, sysfs reads it */
+    spinlock_t jitter_lock;
+    struct gpio_jitter jitter;
+    dev_t dev_num;
+    struct cdev cdev;
+    /* its release frees the instance, open files hold a reference past remove */
+    struct device chardev;
+    /* set by remove, the file methods check it inside srcu and no longer touch the lines */
+    struct srcu_struct srcu;
+    bool gone;
+};
+
+/* per open file of an instance char device */
+struct gpiobank_file {
+    struct gpiobank_private_data *bank;
+    /* lines read() returns the events of, 0 keeps read() sampling the values */
+    u64 watch;
 };
 
 /* driver private data <<static>>*/
@@ -59,6 +243,9 @@ struct gpiodrv_private_data
 {
     int total_devices;
     struct class *class_gpio;
+    /* char device region, one minor per instance */
+    dev_t device_num_base;
+    struct ida minor_ida;
 };
 
 struct gpiodrv_private_data gpoi_driver_data;
@@ -77,16 +264,94 @@ struct platform_driver gpio_driver = {
     }
 };
 
+/* one syscall reads or sets every line of an instance, no string parsing on the way */
+struct file_operations gpio_bank_fops = {
+    .owner = THIS_MODULE,
+    .open = gpio_bank_open,
+    .read = gpio_bank_read,
+    .write = gpio_bank_write,
+    .unlocked_ioctl = gpio_bank_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .poll = gpio_bank_poll,
+    .release = gpio_bank_release
+};
+
+/* names of the edge attribute, indexed by the BONE_GPIO_EVENT_* bits */
+static const char *const gpio_edge_names[] = {
+    [0] = "none",
+    [BONE_GPIO_EVENT_RISING] = "rising",
+    [BONE_GPIO_EVENT_FALLING] = "falling",
+    [BONE_GPIO_EVENT_RISING | BONE_GPIO_EVENT_FALLING] = "both"
+};
+
 /* attributes */
 DEVICE_ATTR_RW(direction);
 DEVICE_ATTR_RW(value);
 DEVICE_ATTR_RO(label);
+DEVICE_ATTR_RW(edge);
+DEVICE_ATTR_RW(debounce);
+DEVICE_ATTR_RW(waveform);
+DEVICE_ATTR_RW(values);
+DEVICE_ATTR_RW(waveforms);
+
+/* one read only attribute per jitter figure under bone-gpioN/jitter/, in ns, since the last start */
+#define GPIO_JITTER_ATTR(_name, _value)                                                         \
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf)      \
+{                                                                                               \
+    struct gpiobank_private_data *bank = (struct gpiobank_private_data *)dev_get_drvdata(dev); \
+    struct gpio_jitter snap;                                                                    \
+    gpio_jitter_snapshot(bank, &snap);                                                          \
+    return sprintf(buf, "%llu\n", (u64)(_value));                                              \
+}                                                                                               \
+static DEVICE_ATTR_RO(_name)
+
+GPIO_JITTER_ATTR(samples, snap.samples);
+GPIO_JITTER_ATTR(min_ns, snap.samples ? snap.min_ns : 0);
+GPIO_JITTER_ATTR(max_ns, snap.max_ns);
+GPIO_JITTER_ATTR(mean_ns, snap.samples ? div64_u64(snap.total_ns, snap.samples) : 0);
+GPIO_JITTER_ATTR(p99_ns, gpio_jitter_percentile(&snap, 990));
+GPIO_JITTER_ATTR(overruns, snap.overruns);
+
+struct attribute *gpio_jitter_attrs[] = {
+    &dev_attr_samples.attr,
+    &dev_attr_min_ns.attr,
+    &dev_attr_max_ns.attr,
+    &dev_attr_mean_ns.attr,
+    &dev_attr_p99_ns.attr,
+    &dev_attr_overruns.attr,
+    NULL
+};
+
+/* attributes of the instance char device */
+struct attribute *gpio_bank_attrs[] = {
+    &dev_attr_values.attr,
+    &dev_attr_waveforms.attr,
+    NULL
+};
+
+struct attribute_group gpio_bank_group = {
+    .attrs = gpio_bank_attrs,
+};
+
+struct attribute_group gpio_jitter_group = {
+    .name = "jitter",
+    .attrs = gpio_jitter_attrs,
+};
+
+const struct attribute_group *gpio_bank_groups[] = {
+    &gpio_bank_group,
+    &gpio_jitter_group,
+    NULL
+};
 
 /* attributes list */
 struct attribute *gpio_node_attrs[] = {
     &dev_attr_direction.attr,
     &dev_attr_label.attr,
     &dev_attr_value.attr,
+    &dev_attr_edge.attr,
+    &dev_attr_debounce.attr,
+    &dev_attr_waveform.attr,
     NULL
 };
 
@@ -125,9 +390,9 @@ SHOW(value)
      /* get the value */
     int value = gpiod_get_value(dev_data->desc);
     /* check for errors */
-    if (value)
+    if (value < 0)
     {
-        dev_err(dev,"cannot get gpio direction\n");
+        dev_err(dev,"cannot get gpio value\n");
         return value;
     }
     /* set direction_string*/
@@ -181,7 +446,7 @@ STORE(value)
     struct gpiodev_private_data *dev_data = (struct gpiodev_private_data*)dev_get_drvdata(dev);
     /* get the value */
     int value;
-    int ret = kstrtol(buf, 10, (long*)&value);
+    int ret = kstrtoint(buf, 10, &value);
     if(ret)
     {
         dev_err(dev, "cannot set value: %s\n", buf);
@@ -191,6 +456,948 @@ STORE(value)
     return count;
 }
 
+SHOW(edge)
+{
+    struct gpiodev_private_data *dev_data = (struct gpiodev_private_data*)dev_get_drvdata(dev);
+    return sprintf(buf, "%s\n", gpio_edge_names[dev_data->edge]);
+}
+
+/* none, rising, falling or both, the line has to be an input */
+STORE(edge)
+{
+    struct gpiodev_private_data *dev_data = (struct gpiodev_private_data*)dev_get_drvdata(dev);
+    int edge = sysfs_match_string(gpio_edge_names, buf);
+    int ret;
+
+    if (edge < 0)
+    {
+        dev_err(dev, "unsuppoertd value: %s\n", buf);
+        return edge;
+    }
+    mutex_lock(&dev_data->bank->lock);
+    ret = gpio_line_set_edge(dev_data, edge);
+    mutex_unlock(&dev_data->bank->lock);
+    if (ret)
+    {
+        dev_err(dev, "cannot set edge %s: %d\n", gpio_edge_names[edge], ret);
+        return ret;
+    }
+    return count;
+}
+
+SHOW(debounce)
+{
+    struct gpiodev_private_data *dev_data = (struct gpiodev_private_data*)dev_get_drvdata(dev);
+    return sprintf(buf, "%u\n", dev_data->debounce_us);
+}
+
+/* period in us the line has to be stable for, 0 turns debouncing off */
+STORE(debounce)
+{
+    struct gpiodev_private_data *dev_data = (struct gpiodev_private_data*)dev_get_drvdata(dev);
+    unsigned int debounce_us;
+    int ret = kstrtouint(buf, 0, &debounce_us);
+
+    if (ret)
+    {
+        dev_err(dev, "unsuppoertd value: %s\n", buf);
+        return ret;
+    }
+    mutex_lock(&dev_data->bank->lock);
+    ret = gpio_line_set_debounce(dev_data, debounce_us);
+    mutex_unlock(&dev_data->bank->lock);
+    if (ret)
+    {
+        dev_err(dev, "cannot set debounce %u: %d\n", debounce_us, ret);
+        return ret;
+    }
+    return count;
+}
+
+SHOW(waveform)
+{
+    struct gpiodev_private_data *dev_data = (struct gpiodev_private_data*)dev_get_drvdata(dev);
+    struct gpio_wave wave;
+
+    /* a store may be replacing it, the fields of one waveform only */
+    mutex_lock(&dev_data->bank->wave_lock);
+    wave = dev_data->wave;
+    mutex_unlock(&dev_data->bank->wave_lock);
+    if (!wave.nbits)
+        return sprintf(buf, "none\n");
+    if (wave.period_ns)
+        return sprintf(buf, "pwm %llu %llu\n", wave.period_ns, wave.duty_ns);
+    return sprintf(buf, "pattern %llu 0x%llx %u\n", wave.step_ns, wave.bits, wave.nbits);
+}
+
+/*
+ * "pwm PERIOD_NS DUTY_NS", "pattern STEP_NS BITS NBITS" played from bit 0, or "none"
+ * the line runs it from the next start of the waveforms of its instance
+ */
+STORE(waveform)
+{
+    struct gpiodev_private_data *dev_data = (struct gpiodev_private_data*)dev_get_drvdata(dev);
+    struct gpio_wave wave = {0};
+    int ret = 0;
+
+    if (sysfs_streq(buf, "none"))
+        ;
+    else if (sscanf(buf, "pwm %llu %llu", &wave.period_ns, &wave.duty_ns) == 2)
+    {
+        /* high for duty, low for the rest */
+        wave.bits = 0x1;
+        wave.nbits = 2;
+        if ((wave.period_ns < GPIO_WAVE_MIN_NS) || (wave.duty_ns > wave.period_ns))
+            ret = -EINVAL;
+    }
+    else if (sscanf(buf, "pattern %llu %lli %u", &wave.step_ns, (long long *)&wave.bits, &wave.nbits) == 3)
+    {
+        if ((wave.step_ns < GPIO_WAVE_MIN_NS) || !wave.nbits || (wave.nbits > 64))
+            ret = -EINVAL;
+    }
+    else
+        ret = -EINVAL;
+    if (ret)
+    {
+        dev_err(dev, "unsuppoertd value: %s\n", buf);
+        return ret;
+    }
+
+    mutex_lock(&dev_data->bank->wave_lock);
+    /* the engine reads the waveforms without a lock */
+    if (dev_data->bank->wave_task)
+        ret = -EBUSY;
+    else
+        dev_data->wave = wave;
+    mutex_unlock(&dev_data->bank->wave_lock);
+    return ret ? ret : count;
+}
+
+/* char device methods */
+static int gpio_bank_open(struct inode *inode, struct file *filp)
+{
+    struct gpiobank_file *file = kzalloc(sizeof(*file), GFP_KERNEL);
+
+    if (!file)
+        return -ENOMEM;
+    file->bank = container_of(inode->i_cdev, struct gpiobank_private_data, cdev);
+    /* dropped by release, the instance may be unbound by then */
+    get_device(&file->bank->chardev);
+    filp->private_data = file;
+    /* every read samples the lines again, there is no file position */
+    return stream_open(inode, filp);
+}
+
+static int gpio_bank_release(struct inode *inode, struct file *filp)
+{
+    struct gpiobank_file *file = (struct gpiobank_file *)filp->private_data;
+
+    put_device(&file->bank->chardev);
+    kfree(file);
+    return 0;
+}
+
+static ssize_t gpio_bank_read(struct file *filp, char __user *buff, size_t count, loff_t *f_pos)
+{
+    struct gpiobank_file *file = (struct gpiobank_file *)filp->private_data;
+    struct gpiobank_private_data *bank = file->bank;
+    size_t len = DIV_ROUND_UP(bank->nlines, 8);
+    __le64 bitmap;
+    u64 bits;
+    int idx;
+    int ret;
+
+    if (file->watch)
+        return gpio_bank_read_events(filp, buff, count);
+    /* the whole bitmap or nothing */
+    if (count < len)
+        return -EINVAL;
+    ret = gpio_bank_enter(bank, &idx);
+    if (ret)
+        return ret;
+    ret = gpio_bank_get(bank, gpio_bank_mask(bank), &bits);
+    gpio_bank_exit(bank, idx);
+    if (ret)
+        return ret;
+    /* line 0 is bit 0 of the first byte */
+    bitmap = cpu_to_le64(bits);
+    if (copy_to_user(buff, &bitmap, len))
+        return -EFAULT;
+    return len;
+}
+
+/* whole events only, as many as fit in count */
+static ssize_t gpio_bank_read_events(struct file *filp, char __user *buff, size_t count)
+{
+    struct gpiobank_file *file = (struct gpiobank_file *)filp->private_data;
+    struct gpiobank_private_data *bank = file->bank;
+    struct bone_gpio_event event;
+    size_t done = 0;
+    int idx;
+    int ret;
+
+    if (count < sizeof(event))
+        return -EINVAL;
+    do
+    {
+        ret = gpio_bank_enter(bank, &idx);
+        if (ret)
+            return ret;
+        if (!gpio_bank_events_pending(bank, file->watch))
+        {
+            /* no sleeping inside srcu, remove waits for it */
+            gpio_bank_exit(bank, idx);
+            if (filp->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            ret = wait_event_interruptible(bank->wait, gpio_bank_readable(bank, file->watch));
+            if (ret)
+                return ret;
+            continue;
+        }
+        while ((count - done >= sizeof(event)) && gpio_bank_pop_event(bank, file->watch, &event))
+        {
+            if (copy_to_user(buff + done, &event, sizeof(event)))
+            {
+                ret = -EFAULT;
+                break;
+            }
+            done += sizeof(event);
+        }
+        gpio_bank_exit(bank, idx);
+        if (ret)
+            return done ? done : ret;
+        /* another reader of the lines took the events, sleep again */
+    } while (!done);
+    return done;
+}
+
+static __poll_t gpio_bank_poll(struct file *filp, poll_table *wait)
+{
+    struct gpiobank_file *file = (struct gpiobank_file *)filp->private_data;
+    struct gpiobank_private_data *bank = file->bank;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    int idx;
+
+    /* remove wakes the queue, the next poll sees the instance gone */
+    poll_wait(filp, &bank->wait, wait);
+    if (gpio_bank_enter(bank, &idx))
+        return EPOLLERR | EPOLLHUP;
+    /* sampling the values never blocks */
+    if (!file->watch || gpio_bank_events_pending(bank, file->watch))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    gpio_bank_exit(bank, idx);
+    return mask;
+}
+
+static ssize_t gpio_bank_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos)
+{
+    struct gpiobank_private_data *bank = ((struct gpiobank_file *)filp->private_data)->bank;
+    size_t len = DIV_ROUND_UP(bank->nlines, 8);
+    __le64 bitmap = 0;
+    int idx;
+    int ret;
+
+    if (count < len)
+        return -EINVAL;
+    if (copy_from_user(&bitmap, buff, len))
+        return -EFAULT;
+    ret = gpio_bank_enter(bank, &idx);
+    if (ret)
+        return ret;
+    ret = gpio_bank_set(bank, gpio_bank_mask(bank), le64_to_cpu(bitmap));
+    gpio_bank_exit(bank, idx);
+    return ret ? ret : len;
+}
+
+static long gpio_bank_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct gpiobank_private_data *bank = ((struct gpiobank_file *)filp->private_data)->bank;
+    long ret;
+    int idx;
+
+    ret = gpio_bank_enter(bank, &idx);
+    if (ret)
+        return ret;
+    ret = gpio_bank_do_ioctl(filp, cmd, arg);
+    gpio_bank_exit(bank, idx);
+    return ret;
+}
+
+static long gpio_bank_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct gpiobank_file *file = (struct gpiobank_file *)filp->private_data;
+    struct gpiobank_private_data *bank = file->bank;
+    void __user *argp = (void __user *)arg;
+    struct bone_gpio_info info = {0};
+    struct bone_gpio_values values;
+    u64 watch;
+    int ret;
+
+    switch (cmd)
+    {
+        case BONE_GPIO_GET_INFO:
+            info.nlines = bank->nlines;
+            return copy_to_user(argp, &info, sizeof(info)) ? -EFAULT : 0;
+        case BONE_GPIO_GET_VALUES:
+            if (copy_from_user(&values, argp, sizeof(values)))
+                return -EFAULT;
+            values.mask &= gpio_bank_mask(bank);
+            ret = gpio_bank_get(bank, values.mask, &values.bits);
+            if (ret)
+                return ret;
+            return copy_to_user(argp, &values, sizeof(values)) ? -EFAULT : 0;
+        case BONE_GPIO_SET_VALUES:
+            if (copy_from_user(&values, argp, sizeof(values)))
+                return -EFAULT;
+            /* a bit past the last line is a caller bug, not something to ignore */
+            if (values.mask & ~gpio_bank_mask(bank))
+                return -EINVAL;
+            return gpio_bank_set(bank, values.mask, values.bits);
+        case BONE_GPIO_WATCH_EVENTS:
+            if (copy_from_user(&watch, argp, sizeof(watch)))
+                return -EFAULT;
+            if (watch & ~gpio_bank_mask(bank))
+                return -EINVAL;
+            file->watch = watch;
+            /* a reader sleeping on the old lines looks at the new ones */
+            wake_up_interruptible(&bank->wait);
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
+/*
+ * the file methods use the lines between enter and exit, -ENODEV once the instance is unbound
+ * remove sets gone and waits for srcu before the lines go away
+ */
+static int gpio_bank_enter(struct gpiobank_private_data *bank, int *idx)
+{
+    *idx = srcu_read_lock(&bank->srcu);
+    if (READ_ONCE(bank->gone))
+    {
+        srcu_read_unlock(&bank->srcu, *idx);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+static void gpio_bank_exit(struct gpiobank_private_data *bank, int idx)
+{
+    srcu_read_unlock(&bank->srcu, idx);
+}
+
+/* wake up condition of a reader, an event of its lines or the instance gone */
+static bool gpio_bank_readable(struct gpiobank_private_data *bank, u64 watch)
+{
+    bool ret;
+    int idx;
+
+    idx = srcu_read_lock(&bank->srcu);
+    ret = READ_ONCE(bank->gone) || gpio_bank_events_pending(bank, watch);
+    srcu_read_unlock(&bank->srcu, idx);
+    return ret;
+}
+
+/* bits of the lines the instance has */
+static u64 gpio_bank_mask(struct gpiobank_private_data *bank)
+{
+    return bank->nlines ? GENMASK_ULL(bank->nlines - 1, 0) : 0;
+}
+
+/*
+ * samples the lines in mask, the other bits of bits are 0
+ * one call for all the lines, the lines of one controller are read together by its get_multiple
+ */
+static int gpio_bank_get(struct gpiobank_private_data *bank, u64 mask, u64 *bits)
+{
+    DECLARE_BITMAP(values, BONE_GPIO_MAX_LINES);
+    int ret;
+
+    *bits = 0;
+    if (!bank->nlines)
+        return 0;
+    /* process context, the controller may sleep (i2c/spi expanders) */
+    ret = gpiod_get_array_value_cansleep(bank->descs->ndescs, bank->descs->desc, bank->descs->info, values);
+    if (ret)
+        return ret;
+    bitmap_to_arr64(bits, values, bank->nlines);
+    *bits &= mask;
+    return 0;
+}
+
+/*
+ * drives the lines in mask to their bit of bits, in one call like gpio_bank_get
+ * a whole port goes through the array as is, a subset through the packed set_descs
+ */
+static int gpio_bank_set(struct gpiobank_private_data *bank, u64 mask, u64 bits)
+{
+    DECLARE_BITMAP(values, BONE_GPIO_MAX_LINES);
+    unsigned int n = 0;
+    unsigned int i;
+    int ret;
+
+    if (!mask)
+        return 0;
+    if (mask == gpio_bank_mask(bank))
+    {
+        bitmap_from_arr64(values, &bits, bank->nlines);
+        return gpiod_set_array_value_cansleep(bank->descs->ndescs, bank->descs->desc, bank->descs->info, values);
+    }
+
+    bitmap_zero(values, BONE_GPIO_MAX_LINES);
+    mutex_lock(&bank->lock);
+    for (i = 0; i < bank->nlines; i++)
+    {
+        if (!(mask & BIT_ULL(i)))
+            continue;
+        bank->set_descs[n] = bank->lines[i]->desc;
+        if (bits & BIT_ULL(i))
+            __set_bit(n, values);
+        n++;
+    }
+    ret = gpiod_set_array_value_cansleep(n, bank->set_descs, NULL, values);
+    mutex_unlock(&bank->lock);
+    return ret;
+}
+
+/* one of the lines in watch has an event queued */
+static bool gpio_bank_events_pending(struct gpiobank_private_data *bank, u64 watch)
+{
+    unsigned int i;
+
+    for (i = 0; i < bank->nlines; i++)
+    {
+        if ((watch & BIT_ULL(i)) && !kfifo_is_empty(&bank->lines[i]->events))
+            return true;
+    }
+    return false;
+}
+
+/* takes the oldest event of the lines in watch, false if they have none */
+static bool gpio_bank_pop_event(struct gpiobank_private_data *bank, u64 watch, struct bone_gpio_event *event)
+{
+    struct gpiodev_private_data *oldest = NULL;
+    struct gpiodev_private_data *dev_data;
+    struct bone_gpio_event head;
+    u64 oldest_ts = 0;
+    unsigned int i;
+    bool found;
+
+    /* each queue is in order, the earliest head is the next event of the instance */
+    for (i = 0; i < bank->nlines; i++)
+    {
+        dev_data = bank->lines[i];
+        if (!(watch & BIT_ULL(i)))
+            continue;
+        spin_lock_irq(&dev_data->events_lock);
+        found = kfifo_peek(&dev_data->events, &head);
+        spin_unlock_irq(&dev_data->events_lock);
+        if (found && (!oldest || (head.timestamp_ns < oldest_ts)))
+        {
+            oldest = dev_data;
+            oldest_ts = head.timestamp_ns;
+        }
+    }
+    if (!oldest)
+        return false;
+    /* a concurrent reader may have taken that one, the next of the line is still in order for it */
+    spin_lock_irq(&oldest->events_lock);
+    found = kfifo_get(&oldest->events, event);
+    spin_unlock_irq(&oldest->events_lock);
+    return found;
+}
+
+/*
+ * requests the irq of the line for the edges in edge, or frees it for 0
+ * called with bank->lock held
+ */
+static int gpio_line_set_edge(struct gpiodev_private_data *dev_data, unsigned int edge)
+{
+    unsigned long flags = IRQF_ONESHOT;
+    int irq;
+    int ret;
+
+    if (edge == dev_data->edge)
+        return 0;
+    if (dev_data->edge)
+    {
+        free_irq(dev_data->irq, dev_data);
+        /* no thread left to restart the filter */
+        hrtimer_cancel(&dev_data->filter);
+        dev_data->edge = 0;
+    }
+    if (!edge)
+        return 0;
+
+    irq = gpiod_to_irq(dev_data->desc);
+    if (irq < 0)
+        return irq;
+    /* the software filter follows every edge to know the level the line settles on */
+    if (dev_data->debounce_us && !dev_data->debounce_hw)
+        flags |= IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING;
+    /* the trigger is on the physical level, the events on the logical one */
+    if (edge & BONE_GPIO_EVENT_RISING)
+        flags |= gpiod_is_active_low(dev_data->desc) ? IRQF_TRIGGER_FALLING : IRQF_TRIGGER_RISING;
+    if (edge & BONE_GPIO_EVENT_FALLING)
+        flags |= gpiod_is_active_low(dev_data->desc) ? IRQF_TRIGGER_RISING : IRQF_TRIGGER_FALLING;
+
+    /* the thread reads edge, it can run before request_threaded_irq returns */
+    dev_data->edge = edge;
+    dev_data->timestamp = 0;
+    dev_data->raw_level = gpiod_get_value_cansleep(dev_data->desc);
+    dev_data->stable_level = dev_data->raw_level;
+    dev_data->bouncing = false;
+    ret = request_threaded_irq(irq, gpio_line_irq, gpio_line_irq_thread, flags, dev_data->label, dev_data);
+    if (ret)
+    {
+        dev_data->edge = 0;
+        return ret;
+    }
+    dev_data->irq = irq;
+    return 0;
+}
+
+static irqreturn_t gpio_line_irq(int irq, void *data)
+{
+    struct gpiodev_private_data *dev_data = data;
+
+    dev_data->timestamp = ktime_get_ns();
+    return IRQ_WAKE_THREAD;
+}
+
+/* queues the event, or feeds the software filter, the line stays masked until it returns (IRQF_ONESHOT) */
+static irqreturn_t gpio_line_irq_thread(int irq, void *data)
+{
+    struct gpiodev_private_data *dev_data = data;
+    unsigned long flags;
+    u64 timestamp;
+    int level;
+    u32 id;
+
+    /* nested irqs of sleeping controllers (i2c expanders) skip the hard handler */
+    timestamp = dev_data->timestamp ? dev_data->timestamp : ktime_get_ns();
+    dev_data->timestamp = 0;
+
+    if (dev_data->debounce_us && !dev_data->debounce_hw)
+    {
+        level = gpiod_get_value_cansleep(dev_data->desc);
+        spin_lock_irqsave(&dev_data->events_lock, flags);
+        if (!dev_data->bouncing)
+        {
+            dev_data->bouncing = true;
+            dev_data->burst_ts = timestamp;
+        }
+        dev_data->raw_level = level;
+        spin_unlock_irqrestore(&dev_data->events_lock, flags);
+        /* every edge pushes the end of the stable period further */
+        hrtimer_start(&dev_data->filter, us_to_ktime(dev_data->debounce_us), HRTIMER_MODE_REL);
+        return IRQ_HANDLED;
+    }
+
+    /* one edge configured is the edge that fired, for both the level tells which */
+    if (dev_data->edge != (BONE_GPIO_EVENT_RISING | BONE_GPIO_EVENT_FALLING))
+        id = dev_data->edge;
+    else
+        id = gpiod_get_value_cansleep(dev_data->desc) ? BONE_GPIO_EVENT_RISING : BONE_GPIO_EVENT_FALLING;
+    gpio_line_push_event(dev_data, id, timestamp);
+    return IRQ_HANDLED;
+}
+
+/* queues an event and wakes its readers, from the irq thread or the filter timer */
+static void gpio_line_push_event(struct gpiodev_private_data *dev_data, u32 id, u64 timestamp)
+{
+    struct bone_gpio_event event = {0};
+    unsigned long flags;
+    bool queued;
+
+    event.timestamp_ns = timestamp;
+    event.id = id;
+    event.line = dev_data->line;
+    spin_lock_irqsave(&dev_data->events_lock, flags);
+    event.seqno = ++dev_data->seqno;
+    queued = kfifo_put(&dev_data->events, event);
+    spin_unlock_irqrestore(&dev_data->events_lock, flags);
+
+    if (!queued)
+        dev_warn_ratelimited(dev_data->dev, "event queue full, dropped event %u\n", event.seqno);
+    wake_up_interruptible_poll(&dev_data->bank->wait, EPOLLIN | EPOLLRDNORM);
+    /* poll() on the value attribute wakes up too, unlike sysfs_notify() this doesn't sleep */
+    sysfs_notify_dirent(dev_data->value_kn);
+}
+
+/*
+ * sets the period in us, 0 off, called with bank->lock held
+ * the controller filters the line if it supports debounce, the software filter otherwise
+ */
+static int gpio_line_set_debounce(struct gpiodev_private_data *dev_data, unsigned int debounce_us)
+{
+    unsigned int edge = dev_data->edge;
+    int ret;
+
+    /* the triggers of the irq depend on where the filter is, it is requested again */
+    gpio_line_set_edge(dev_data, 0);
+    ret = gpiod_set_debounce(dev_data->desc, debounce_us);
+    dev_data->debounce_hw = (debounce_us && !ret);
+    dev_data->debounce_us = debounce_us;
+    if (debounce_us)
+        dev_info(dev_data->dev, "debounce %uus in %s\n", debounce_us, dev_data->debounce_hw ? "hardware" : "software");
+    return gpio_line_set_edge(dev_data, edge);
+}
+
+/*
+ * the line was stable for the debounce period, hard irq context
+ * one event per change of the settled level, a glitch back to the old level is none
+ */
+static enum hrtimer_restart gpio_line_filter_expired(struct hrtimer *timer)
+{
+    struct gpiodev_private_data *dev_data = container_of(timer, struct gpiodev_private_data, filter);
+    unsigned long flags;
+    u64 timestamp;
+    u32 id = 0;
+
+    spin_lock_irqsave(&dev_data->events_lock, flags);
+    dev_data->bouncing = false;
+    if (dev_data->raw_level != dev_data->stable_level)
+    {
+        dev_data->stable_level = dev_data->raw_level;
+        id = dev_data->stable_level ? BONE_GPIO_EVENT_RISING : BONE_GPIO_EVENT_FALLING;
+    }
+    /* the first edge of the burst is the closest to the real transition */
+    timestamp = dev_data->burst_ts;
+    spin_unlock_irqrestore(&dev_data->events_lock, flags);
+
+    if (id & dev_data->edge)
+        gpio_line_push_event(dev_data, id, timestamp);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * starts the engine on the lines with a waveform, called with wave_lock held
+ * the lines become outputs, a line with an edge irq can't and fails the start
+ */
+static int gpio_wave_start(struct gpiobank_private_data *bank)
+{
+    struct task_struct *task;
+    struct gpio_wave *wave;
+    ktime_t start;
+    u64 mask = 0;
+    unsigned int i;
+    int ret;
+
+    if (bank->gone)
+        return -ENODEV;
+    if (bank->wave_task)
+        return -EBUSY;
+    for (i = 0; i < bank->nlines; i++)
+    {
+        wave = &bank->lines[i]->wave;
+        if (!wave->nbits)
+            continue;
+        ret = gpiod_direction_output(bank->lines[i]->desc, 0);
+        if (ret)
+            return ret;
+        mask |= BIT_ULL(i);
+    }
+    if (!mask)
+        return -EINVAL;
+
+    spin_lock(&bank->jitter_lock);
+    memset(&bank->jitter, 0, sizeof(bank->jitter));
+    spin_unlock(&bank->jitter_lock);
+    /* the first segment of every line starts at the same time, the lines stay in step from there */
+    start = ktime_add_ns(ktime_get(), GPIO_WAVE_LEAD_NS);
+    for (i = 0; i < bank->nlines; i++)
+    {
+        if (!(mask & BIT_ULL(i)))
+            continue;
+        wave = &bank->lines[i]->wave;
+        /* the first advance moves to segment 0 */
+        wave->index = wave->nbits - 1;
+        wave->next = start;
+    }
+    bank->wave_mask = mask;
+
+    task = kthread_create(gpio_wave_thread, bank, "%s-wave", dev_name(&bank->chardev));
+    if (IS_ERR(task))
+        return PTR_ERR(task);
+    /* a fifo thread runs as soon as its timer fires, a normal one waits for its turn */
+    sched_set_fifo(task);
+    bank->wave_task = task;
+    wake_up_process(task);
+    return 0;
+}
+
+/* called with wave_lock held, the engine doesn't take it */
+static void gpio_wave_stop(struct gpiobank_private_data *bank)
+{
+    if (!bank->wave_task)
+        return;
+    kthread_stop(bank->wave_task);
+    bank->wave_task = NULL;
+}
+
+/*
+ * the engine of an instance
+ * sleeps on an absolute hrtimer until the next segment of a line and sets every line due then in
+ * one array set: the deadlines never drift, only the wake up is late, that lateness is the jitter
+ * a thread and not the timer callback, the controller may sleep (gpio-sim, i2c expanders)
+ */
+static int gpio_wave_thread(void *data)
+{
+    struct gpiobank_private_data *bank = data;
+    struct gpio_wave *wave;
+    ktime_t deadline;
+    ktime_t now;
+    unsigned int i;
+    u64 skipped;
+    u64 late;
+    u64 mask;
+    u64 bits;
+    int ret;
+
+    while (!kthread_should_stop())
+    {
+        deadline = gpio_wave_next(bank);
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (kthread_should_stop())
+        {
+            __set_current_state(TASK_RUNNING);
+            break;
+        }
+        schedule_hrtimeout_range(&deadline, 0, HRTIMER_MODE_ABS);
+        now = ktime_get();
+        /* woken up by kthread_stop() */
+        if (ktime_before(now, deadline))
+            continue;
+
+        late = ktime_to_ns(ktime_sub(now, deadline));
+
+        /* one segment per line and wake up at most */
+        mask = 0;
+        bits = 0;
+        for (i = 0; i < bank->nlines; i++)
+        {
+            wave = &bank->lines[i]->wave;
+            if (!(bank->wave_mask & BIT_ULL(i)) || ktime_after(wave->next, now))
+                continue;
+            mask |= BIT_ULL(i);
+            if (gpio_wave_advance(wave))
+                bits |= BIT_ULL(i);
+        }
+        ret = gpio_bank_set(bank, mask, bits);
+        if (ret)
+            dev_warn_ratelimited(&bank->chardev, "waveform set failed: %d\n", ret);
+
+        /*
+         * segments whose time is already gone are not replayed back to back, that would keep the
+         * cpu busy for as long as the engine is behind: the lines jump ahead in whole periods
+         */
+        now = ktime_get();
+        skipped = 0;
+        for (i = 0; i < bank->nlines; i++)
+        {
+            if (mask & BIT_ULL(i))
+                skipped += gpio_wave_skip(&bank->lines[i]->wave, now);
+        }
+        gpio_wave_account(bank, late, skipped);
+    }
+    return 0;
+}
+
+/* length of segment index in ns */
+static u64 gpio_wave_duration(const struct gpio_wave *wave, unsigned int index)
+{
+    if (wave->period_ns)
+        return index ? (wave->period_ns - wave->duty_ns) : wave->duty_ns;
+    return wave->step_ns;
+}
+
+/* moves to the next segment, returns its level */
+static int gpio_wave_advance(struct gpio_wave *wave)
+{
+    unsigned int i;
+
+    /* a PWM at 0 or 100% has an empty segment, it is skipped */
+    for (i = 0; i < wave->nbits; i++)
+    {
+        wave->index = (wave->index + 1) % wave->nbits;
+        if (gpio_wave_duration(wave, wave->index))
+            break;
+    }
+    wave->next = ktime_add_ns(wave->next, gpio_wave_duration(wave, wave->index));
+    return (wave->bits >> wave->index) & 1;
+}
+
+/*
+ * moves the start of the next segment past now in whole periods, the pattern keeps its phase
+ * returns the number of periods skipped
+ */
+static u64 gpio_wave_skip(struct gpio_wave *wave, ktime_t now)
+{
+    u64 period = wave->period_ns ? wave->period_ns : (wave->step_ns * wave->nbits);
+    u64 missed;
+
+    if (ktime_after(wave->next, now) || !period)
+        return 0;
+    missed = div64_u64(ktime_to_ns(ktime_sub(now, wave->next)), period) + 1;
+    wave->next = ktime_add_ns(wave->next, missed * period);
+    return missed;
+}
+
+/* the earliest segment start of the running lines */
+static ktime_t gpio_wave_next(struct gpiobank_private_data *bank)
+{
+    ktime_t next = KTIME_MAX;
+    unsigned int i;
+
+    for (i = 0; i < bank->nlines; i++)
+    {
+        if ((bank->wave_mask & BIT_ULL(i)) && ktime_before(bank->lines[i]->wave.next, next))
+            next = bank->lines[i]->wave.next;
+    }
+    return next;
+}
+
+static void gpio_wave_account(struct gpiobank_private_data *bank, u64 late_ns, u64 skipped)
+{
+    struct gpio_jitter *jitter = &bank->jitter;
+    unsigned int bucket = late_ns ? min_t(unsigned int, ilog2(late_ns), GPIO_JITTER_BUCKETS - 1) : 0;
+
+    spin_lock(&bank->jitter_lock);
+    if (!jitter->samples || (late_ns < jitter->min_ns))
+        jitter->min_ns = late_ns;
+    if (late_ns > jitter->max_ns)
+        jitter->max_ns = late_ns;
+    jitter->samples++;
+    jitter->total_ns += late_ns;
+    jitter->buckets[bucket]++;
+    jitter->overruns += skipped;
+    spin_unlock(&bank->jitter_lock);
+}
+
+static void gpio_jitter_snapshot(struct gpiobank_private_data *bank, struct gpio_jitter *snap)
+{
+    spin_lock(&bank->jitter_lock);
+    *snap = bank->jitter;
+    spin_unlock(&bank->jitter_lock);
+}
+
+/* upper bound in ns of the bucket holding the permille-th wake up, 0 without any */
+static u64 gpio_jitter_percentile(const struct gpio_jitter *snap, unsigned int permille)
+{
+    u64 target = div_u64(snap->samples * permille + 999, 1000);
+    u64 seen = 0;
+    int i;
+
+    for (i = 0; i < GPIO_JITTER_BUCKETS; i++)
+    {
+        seen += snap->buckets[i];
+        if (seen && (seen >= target))
+            return 1ULL << (i + 1);
+    }
+    return 0;
+}
+
+/* all the lines as a hex bitmap, line i is bit i */
+SHOW(values)
+{
+    struct gpiobank_private_data *bank = (struct gpiobank_private_data *)dev_get_drvdata(dev);
+    u64 bits;
+    int ret = gpio_bank_get(bank, gpio_bank_mask(bank), &bits);
+
+    if (ret)
+    {
+        dev_err(dev, "cannot get gpio values\n");
+        return ret;
+    }
+    return sprintf(buf, "0x%llx\n", bits);
+}
+
+/* "BITS" sets every line, "BITS MASK" only the lines in MASK, hex or decimal */
+STORE(values)
+{
+    struct gpiobank_private_data *bank = (struct gpiobank_private_data *)dev_get_drvdata(dev);
+    u64 mask = gpio_bank_mask(bank);
+    u64 bits;
+    int ret;
+
+    ret = sscanf(buf, "%lli %lli", (long long *)&bits, (long long *)&mask);
+    if ((ret < 1) || (mask & ~gpio_bank_mask(bank)))
+    {
+        dev_err(dev, "unsuppoertd value: %s\n", buf);
+        return -EINVAL;
+    }
+    ret = gpio_bank_set(bank, mask, bits);
+    return ret ? ret : count;
+}
+
+SHOW(waveforms)
+{
+    struct gpiobank_private_data *bank = (struct gpiobank_private_data *)dev_get_drvdata(dev);
+    return sprintf(buf, "%s\n", READ_ONCE(bank->wave_task) ? "running" : "stopped");
+}
+
+/* "start" runs the waveforms of the lines, all in step, "stop" leaves the lines where they are */
+STORE(waveforms)
+{
+    struct gpiobank_private_data *bank = (struct gpiobank_private_data *)dev_get_drvdata(dev);
+    int ret = 0;
+
+    mutex_lock(&bank->wave_lock);
+    if (sysfs_streq(buf, "start"))
+        ret = gpio_wave_start(bank);
+    else if (sysfs_streq(buf, "stop"))
+        gpio_wave_stop(bank);
+    else
+        ret = -EINVAL;
+    mutex_unlock(&bank->wave_lock);
+    if (ret)
+    {
+        dev_err(dev, "cannot %s waveforms: %d\n", buf, ret);
+        return ret;
+    }
+    return count;
+}
+
+/* char device of an instance, /dev/bone-gpioN with the lowest free N */
+static int gpio_bank_create(struct device *dev, struct gpiobank_private_data *bank)
+{
+    int minor;
+    int ret;
+
+    minor = ida_alloc_max(&gpoi_driver_data.minor_ida, BONE_GPIO_MAX_INSTANCES - 1, GFP_KERNEL);
+    if (minor < 0)
+    {
+        dev_err(dev, "no free minor, max instances %u\n", BONE_GPIO_MAX_INSTANCES);
+        return minor;
+    }
+    bank->dev_num = MKDEV(MAJOR(gpoi_driver_data.device_num_base), MINOR(gpoi_driver_data.device_num_base) + minor);
+
+    /* initialized by probe, the cdev holds the device while a file is open */
+    bank->chardev.class = gpoi_driver_data.class_gpio;
+    bank->chardev.parent = dev;
+    bank->chardev.devt = bank->dev_num;
+    bank->chardev.groups = gpio_bank_groups;
+    dev_set_drvdata(&bank->chardev, bank);
+    ret = dev_set_name(&bank->chardev, "bone-gpio%d", minor);
+    if (ret)
+        goto err_cdev_add;
+    cdev_init(&bank->cdev, &gpio_bank_fops);
+    bank->cdev.owner = THIS_MODULE;
+    ret = cdev_device_add(&bank->cdev, &bank->chardev);
+    if (ret < 0)
+    {
+        dev_err(dev, "Error creating char device\n");
+        goto err_cdev_add;
+    }
+    dev_info(dev, "bone-gpio%d drives %u lines\n", minor, bank->nlines);
+    return 0;
+err_cdev_add:
+    ida_free(&gpoi_driver_data.minor_ida, minor);
+    return ret;
+}
+
 int gpio_driver_probe(struct platform_device *pdev)
 {
     /* get the dev */
@@ -211,6 +1418,46 @@ int gpio_driver_probe(struct platform_device *pdev)
     const char* of_label = NULL;
     /* temp variable to hold the sysfs device node */
     struct device *sysfs_dev = NULL;
+    /* the lines of this instance, for the char device */
+    struct gpiobank_private_data *bank = NULL;
+    /* temp variable to hold the debounce period */
+    u32 debounce_us;
+
+    /* not devm, open files of the char device outlive the instance */
+    bank = kzalloc(sizeof(*bank), GFP_KERNEL);
+    if (!bank)
+    {
+        dev_err(dev, "Cannot allocate memory for instance data\n");
+        return -ENOMEM;
+    }
+    ret = init_srcu_struct(&bank->srcu);
+    if (ret)
+    {
+        kfree(bank);
+        return ret;
+    }
+    device_initialize(&bank->chardev);
+    bank->chardev.release = gpio_bank_free;
+    /* runs after remove, or now if it fails */
+    ret = devm_add_action_or_reset(dev, gpio_bank_put, bank);
+    if (ret)
+        return ret;
+    /*
+     * room for every line the bitmaps can hold, ndescs counts the ones found
+     * no array info, the lines come from separate child nodes: gpiolib still hands the lines of one
+     * controller to its get_multiple/set_multiple in one call, only its bitmap shortcut is lost
+     */
+    bank->descs = devm_kzalloc(dev, struct_size(bank->descs, desc, BONE_GPIO_MAX_LINES), GFP_KERNEL);
+    if (!bank->descs)
+    {
+        dev_err(dev, "Cannot allocate memory for instance data\n");
+        return -ENOMEM;
+    }
+    mutex_init(&bank->lock);
+    init_waitqueue_head(&bank->wait);
+    mutex_init(&bank->wave_lock);
+    spin_lock_init(&bank->jitter_lock);
+    platform_set_drvdata(pdev, bank);
 
     for_each_available_child_of_node(parent, child)
     {
@@ -222,7 +1469,8 @@ int gpio_driver_probe(struct platform_device *pdev)
         if(!dev_data)
         {
             dev_err(dev, "Cannot allocate memory for device data\n");
-            return -ENOMEM;
+            ret = -ENOMEM;
+            goto err_lines;
         }
         /* non-zero means failure*/
         if(of_property_read_string(child, "label", &of_label))
@@ -245,41 +1493,129 @@ int gpio_driver_probe(struct platform_device *pdev)
             dev_err(dev, "Error occured while getting gpio info for : %s\n", child->name);           
             if (ret == -ENOENT)
                 dev_err(dev, "No gpio entry found for : %s\n", child->name);    
-            return ret;
+            goto err_lines;
         }
         /* set pin direction to output */
         ret = gpiod_direction_output(dev_data->desc, 0);
         if (ret)
         {
             dev_err(dev, "error while setting gpio direction\n");
-            return ret;
+            goto err_lines;
         }
 
-        /* create device using device create with groups */
+        /* events are off until edge is set */
+        dev_data->bank = bank;
+        dev_data->line = i;
+        INIT_KFIFO(dev_data->events);
+        spin_lock_init(&dev_data->events_lock);
+        hrtimer_init(&dev_data->filter, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        dev_data->filter.function = gpio_line_filter_expired;
+
+        /* create device using device create with groups, edge can't be set before dev is known */
+        mutex_lock(&bank->lock);
         sysfs_dev = device_create_with_groups(gpoi_driver_data.class_gpio, dev, 0, dev_data, gpio_dev_attr_groups, dev_data->label);
+        dev_data->dev = sysfs_dev;
+        /* put by device_unregister_wrapper */
+        if (!IS_ERR(sysfs_dev))
+            dev_data->value_kn = sysfs_get_dirent(sysfs_dev->kobj.sd, "value");
+        mutex_unlock(&bank->lock);
         if (IS_ERR(sysfs_dev))
         {
             dev_err(dev, "Error creating sysfs device\n");
-            return PTR_ERR(sysfs_dev);
+            ret = PTR_ERR(sysfs_dev);
+            goto err_lines;
+        }
+        if (!dev_data->value_kn)
+        {
+            dev_err(dev, "no value attribute for %s\n", dev_data->label);
+            /* edge may have been written already */
+            mutex_lock(&bank->lock);
+            gpio_line_set_edge(dev_data, 0);
+            mutex_unlock(&bank->lock);
+            device_unregister(sysfs_dev);
+            ret = -ENOENT;
+            goto err_lines;
+        }
+        /* optional, debounce period of the line in us */
+        if (!of_property_read_u32(child, "rgb,debounce-us", &debounce_us))
+        {
+            mutex_lock(&bank->lock);
+            ret = gpio_line_set_debounce(dev_data, debounce_us);
+            mutex_unlock(&bank->lock);
+            if (ret)
+                goto err_lines;
         }
 
+        /* the char device only covers the lines that fit in its bitmaps */
+        if (bank->nlines < BONE_GPIO_MAX_LINES)
+        {
+            bank->lines[bank->nlines++] = dev_data;
+            bank->descs->desc[bank->descs->ndescs++] = dev_data->desc;
+        }
+        else
+            dev_warn(dev, "%s isn't driven by the char device, more than %u lines\n", dev_data->label, BONE_GPIO_MAX_LINES);
+
         i++;
         gpoi_driver_data.total_devices++;
     }
     /* for each available child node */
+    ret = gpio_bank_create(dev, bank);
+    if (ret)
+        goto err_lines;
     return 0;
+err_lines:
+    /* NULL once the loop is done, else the reference the loop holds */
+    of_node_put(child);
+    /* the line devices, their irqs and filters go before devm frees the line data */
+    device_for_each_child(dev, NULL, device_unregister_wrapper);
+    return ret;
 }
-int device_unregister_wrapper(struct device* dev, void* data);
+/* release of the char device, the last reference to the instance */
+static void gpio_bank_free(struct device *dev)
+{
+    struct gpiobank_private_data *bank = container_of(dev, struct gpiobank_private_data, chardev);
+
+    cleanup_srcu_struct(&bank->srcu);
+    kfree(bank);
+}
+
+/* the reference of probe */
+static void gpio_bank_put(void *data)
+{
+    struct gpiobank_private_data *bank = (struct gpiobank_private_data *)data;
+
+    put_device(&bank->chardev);
+}
+
 int device_unregister_wrapper(struct device* dev, void* data)
 {
     struct gpiodev_private_data *dev_data = (struct gpiodev_private_data*)dev_get_drvdata(dev);
     dev_info(dev, "removing device: %s\n", dev_data->label);
+    /* no event may notify the device once it is gone */
+    gpio_line_set_edge(dev_data, 0);
+    /* a filter left armed must not fire on freed line data */
+    hrtimer_cancel(&dev_data->filter);
+    sysfs_put(dev_data->value_kn);
     device_unregister(dev);
     return 0;
 }
 int gpio_driver_remove(struct platform_device *pdev)
 {
+    struct gpiobank_private_data *bank = platform_get_drvdata(pdev);
+
     dev_info(&pdev->dev, "removing driver\n");
+    /* the engine can't be started again */
+    mutex_lock(&bank->wave_lock);
+    gpio_wave_stop(bank);
+    WRITE_ONCE(bank->gone, true);
+    mutex_unlock(&bank->wave_lock);
+    /* the file methods inside srcu are done with the lines, the later ones get -ENODEV */
+    synchronize_srcu(&bank->srcu);
+    /* sleeping readers see gone and return -ENODEV */
+    wake_up_interruptible_all(&bank->wait);
+    /* the char device is a child too, it goes first so only the line devices are left */
+    cdev_device_del(&bank->cdev, &bank->chardev);
+    ida_free(&gpoi_driver_data.minor_ida, MINOR(bank->dev_num) - MINOR(gpoi_driver_data.device_num_base));
     device_for_each_child(&pdev->dev,NULL,device_unregister_wrapper);
     return 0;
 }
@@ -290,6 +1626,14 @@ int __init gpio_driver_init(void)
     int ret;
     
     gpoi_driver_data.total_devices = 0;
+    ida_init(&gpoi_driver_data.minor_ida);
+    /* device numbers of the instance char devices */
+    ret = alloc_chrdev_region(&gpoi_driver_data.device_num_base, 0, BONE_GPIO_MAX_INSTANCES, "bone-gpios");
+    if (ret < 0)
+    {
+        pr_err("error allocating char dev\n");
+        return ret;
+    }
     /* creat the class in the sysfs */
     #ifdef HOST
     gpoi_driver_data.class_gpio = class_create("bone-gpios");
@@ -300,7 +1644,8 @@ int __init gpio_driver_init(void)
     if (IS_ERR(gpoi_driver_data.class_gpio))
     {
         pr_err("error Creating class \n");
-        return PTR_ERR(gpoi_driver_data.class_gpio);
+        ret = PTR_ERR(gpoi_driver_data.class_gpio);
+        goto err_class_create;
     }
     /* register the driver */
     ret = platform_driver_register(&gpio_driver);
@@ -308,9 +1653,14 @@ int __init gpio_driver_init(void)
     if (ret)
     {
         pr_err("error registering the driver \n");
-        return ret;
+        goto err_driver_register;
     }
     return 0;
+err_driver_register:
+    class_destroy(gpoi_driver_data.class_gpio);
+err_class_create:
+    unregister_chrdev_region(gpoi_driver_data.device_num_base, BONE_GPIO_MAX_INSTANCES);
+    return ret;
 
 }
 
@@ -321,6 +1671,9 @@ void __exit pcd_driver_cleanup(void)
     platform_driver_unregister(&gpio_driver);
     /* destroy the class*/
     class_destroy(gpoi_driver_data.class_gpio);
+    /* release the char device numbers */
+    unregister_chrdev_region(gpoi_driver_data.device_num_base, BONE_GPIO_MAX_INSTANCES);
+    ida_destroy(&gpoi_driver_data.minor_ida);
 }
 
 
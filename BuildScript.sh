@@ -29,6 +29,8 @@ IS_CLEAN="NO"
 IS_CROSS=
 #extra flags
 EXTRA_CFLAGS=
+#keep the per call logs of the pcd file methods, production builds use tracepoints only
+PCD_VERBOSE=0
 
 # copy dtb file
 DTB_FILE=
@@ -43,6 +45,7 @@ usage() {
   echo "  --cross   Cross compiler prefix"
   echo "            could be: arm-linux-gnueabihf- , arm-none-linux-gnueabi-, ...etc"
   echo "  --get_dtb copy dtb file to current location, currently only arm supported"
+  echo "  --verbose build the per call logs of the pcd file methods in"
 }
 
 # Parse command-line options
@@ -105,6 +108,11 @@ while [[ $# -gt 0 ]]; do
             IS_CLEAN="YES"
             shift
         ;;
+        --verbose)
+            # debug build, the pcd drivers log every read/write/lseek
+            PCD_VERBOSE=1
+            shift
+        ;;
         --get-dtb=*)
             # slice the string after =
             DTB_FILE="${1#*=}"
@@ -135,6 +143,7 @@ export ARCH
 export KDIR
 export CROSS_COMPILE
 export EXTRA_CFLAGS
+export PCD_VERBOSE
 
 
 # state the build parameters
@@ -143,7 +152,8 @@ echo "  ARCH         : ${ARCH}"
 echo "  KERNEL_SOURCE: ${KDIR}"
 echo "  CROSS_COMPILE: ${IS_CROSS}"
 echo "  IS_CLEAN     : ${IS_CLEAN}"
-echo "  EXTRA_FLAGS  : ${EXTRA_FLAGS}"
+echo "  EXTRA_FLAGS  : ${EXTRA_CFLAGS}"
+echo "  PCD_VERBOSE  : ${PCD_VERBOSE}"
 
 
 # check for clean
@@ -0,0 +1,210 @@
+#!/bin/bash
+
+#####################################################################################
+# This file is part of Linux Device Drivers (LDD) project.                          #
+#                                                                                   #
+# Linux Device Drivers is free software: you can redistribute it and/or modify      #
+# it under the terms of the GNU General Public License as published by              #
+# the Free Software Foundation, either version 3 of the License, or                 #
+# (at your option) any later version.                                               #
+#                                                                                   #
+# Linux Device Drivers is distributed in the hope that it will be useful,           #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of                    #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                      #
+# GNU General Public License for more details.                                      #
+#                                                                                   #
+# You should have received a copy of the GNU General Public License                 #
+# along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.     #
+#####################################################################################
+
+# builds the modules, pcd_bench and gpio_bench with BuildScript.sh, boots a kernel in QEMU with virtme-ng
+# (no network, the host file system shared read only) and runs vm/GuestTests.sh inside it
+# the results land in --out: summary.txt, guest.log, dmesg.txt and bench_*.csv
+
+#holds the architecture, empty for the host one
+ARCH=
+#holds the cross compiler prefix
+CROSS_COMPILE=
+# holds the kernel directory the modules are built against
+KDIR=
+# kernel image to boot, empty boots the running host kernel
+IMAGE=
+# guest root file system, required by vng for another architecture
+ROOT_FS=
+# results directory
+OUT_DIR="$(pwd)/vm_results"
+# module directories to test, by number
+ONLY="001,002,003,004,005,006,007,008"
+# extra pcd_bench.elf options
+BENCH_ARGS="-d 1"
+# guest size
+CPUS=4
+MEM=1G
+# apply vm/pcd_vm.dtso to the QEMU device tree, arm64 guests only
+IS_DT="NO"
+# two NUMA nodes, half of the cpus and of the memory each
+IS_NUMA="NO"
+# skip building, reuse the modules in the tree
+IS_BUILD="YES"
+
+usage() {
+  echo "Usage: $0 [--arch=ARCH --kern=KERNEL_SRC --cross=CROSS_COMPILE] [options]"
+  echo "  --arch    guest architecture, default the host one"
+  echo "  --kern    kernel source the modules are built against, see build.sh"
+  echo "  --cross   cross compiler prefix"
+  echo "  --image   kernel image to boot, default the running kernel"
+  echo "  --root    guest root file system, needed for another architecture"
+  echo "  --out     results directory, default ${OUT_DIR}"
+  echo "  --only    comma separated module numbers, default ${ONLY}"
+  echo "  --bench   extra pcd_bench.elf options, default \"${BENCH_ARGS}\""
+  echo "  --cpus    guest cpus, default ${CPUS}"
+  echo "  --mem     guest memory, default ${MEM}"
+  echo "  --dt      boot with vm/pcd_vm.dtso applied (arm64), probes 005/006 from DT and 007 on gpio-sim"
+  echo "  --numa    split the guest in two NUMA nodes, 006 benchmarks local and remote buffers"
+  echo "  --no-build use the modules already built"
+}
+
+while [[ $# -gt 0 ]]; do
+    case $1 in
+        --arch=*)
+            ARCH="${1#*=}"
+            shift
+        ;;
+        --kern=*)
+            KDIR="${1#*=}"
+            shift
+        ;;
+        --cross=*)
+            CROSS_COMPILE="${1#*=}"
+            shift
+        ;;
+        --image=*)
+            IMAGE="${1#*=}"
+            shift
+        ;;
+        --root=*)
+            ROOT_FS="${1#*=}"
+            shift
+        ;;
+        --out=*)
+            OUT_DIR="$(realpath -m "${1#*=}")"
+            shift
+        ;;
+        --only=*)
+            ONLY="${1#*=}"
+            shift
+        ;;
+        --bench=*)
+            BENCH_ARGS="${1#*=}"
+            shift
+        ;;
+        --cpus=*)
+            CPUS="${1#*=}"
+            shift
+        ;;
+        --mem=*)
+            MEM="${1#*=}"
+            shift
+        ;;
+        --dt)
+            IS_DT="YES"
+            shift
+        ;;
+        --numa)
+            IS_NUMA="YES"
+            shift
+        ;;
+        --no-build)
+            IS_BUILD="NO"
+            shift
+        ;;
+        *)
+            # passing any invalid option will cause the script to fail
+            echo "Invalid option: $1"
+            usage
+            exit 1
+        ;;
+  esac
+done
+
+if ! command -v vng > /dev/null; then
+    echo "virtme-ng (vng) is required, e.g. pip install virtme-ng"
+    exit 1
+fi
+
+# the module directories are named after their number
+cd "$(dirname "$(realpath "$0")")"
+mkdir -p "${OUT_DIR}"
+
+# build every selected module with its build.sh and the benchmark
+if [[ "YES" == ${IS_BUILD} ]]; then
+    BUILD_ARGS=""
+    if [[ -n ${CROSS_COMPILE} ]]; then
+        BUILD_ARGS="--arch=${ARCH} --kern=${KDIR} --cross=${CROSS_COMPILE}"
+    fi
+    for num in ${ONLY//,/ }; do
+        dir=$(ls -d ${num}*/ 2> /dev/null | head -n 1)
+        if [[ -z ${dir} ]]; then
+            echo "No module directory for ${num}"
+            exit 1
+        fi
+        echo "Building ${dir}..."
+        (cd "${dir}" && ./build.sh ${BUILD_ARGS}) > "${OUT_DIR}/build_${num}.log" 2>&1
+        if [[ 0 -ne $? ]]; then
+            echo "Build of ${dir} failed, see ${OUT_DIR}/build_${num}.log"
+            exit 1
+        fi
+    done
+    echo "Building pcd_bench..."
+    make -C pcd_bench CROSS_COMPILE=${CROSS_COMPILE} > "${OUT_DIR}/build_bench.log" 2>&1 || exit 1
+    echo "Building gpio_bench..."
+    make -C gpio_bench CROSS_COMPILE=${CROSS_COMPILE} > "${OUT_DIR}/build_gpio_bench.log" 2>&1 || exit 1
+fi
+
+# vng has no network unless --net is given
+VNG_ARGS=(--run ${IMAGE} --user root --cpus "${CPUS}" --memory "${MEM}" --rwdir="${OUT_DIR}")
+if [[ -n ${ARCH} ]]; then
+    VNG_ARGS+=(--arch "${ARCH}")
+fi
+if [[ -n ${ROOT_FS} ]]; then
+    VNG_ARGS+=(--root "${ROOT_FS}")
+fi
+GUEST_ARGS="--out=${OUT_DIR} --only=${ONLY}"
+
+# node 0 gets the first half of the cpus and of the memory, node 1 the rest
+if [[ "YES" == ${IS_NUMA} ]]; then
+    if [[ ${CPUS} -lt 2 ]]; then
+        echo "--numa needs --cpus=2 or more"
+        exit 1
+    fi
+    NODE_MEM=$(( $(numfmt --from=iec "${MEM}") / 2 / 1048576 ))M
+    VNG_ARGS+=(--numa "${NODE_MEM},cpus=0-$((CPUS / 2 - 1))" --numa "${NODE_MEM},cpus=$((CPUS / 2))-$((CPUS - 1))")
+fi
+
+# QEMU generates the virt device tree, dump it with the same cpus/memory and add our nodes
+if [[ "YES" == ${IS_DT} ]]; then
+    if [[ "arm64" != ${ARCH} ]]; then
+        echo "--dt needs --arch=arm64"
+        exit 1
+    fi
+    qemu-system-aarch64 -machine virt,dumpdtb="${OUT_DIR}/virt.dtb" -cpu max -smp ${CPUS} -m ${MEM} -nographic || exit 1
+    dtc -@ -I dts -O dtb -o "${OUT_DIR}/pcd_vm.dtbo" vm/pcd_vm.dtso || exit 1
+    fdtoverlay -i "${OUT_DIR}/virt.dtb" -o "${OUT_DIR}/vm.dtb" "${OUT_DIR}/pcd_vm.dtbo" || exit 1
+    VNG_ARGS+=(--qemu-opts="-dtb ${OUT_DIR}/vm.dtb")
+    GUEST_ARGS="${GUEST_ARGS} --dt"
+fi
+
+# state the run parameters
+echo "Run With Parameters: "
+echo "  ARCH   : ${ARCH:-$(uname -m)}"
+echo "  IMAGE  : ${IMAGE:-$(uname -r)}"
+echo "  MODULES: ${ONLY}"
+echo "  OUTPUT : ${OUT_DIR}"
+echo "  DT     : ${IS_DT}"
+echo "  NUMA   : ${IS_NUMA}"
+
+vng "${VNG_ARGS[@]}" --exec "vm/GuestTests.sh ${GUEST_ARGS} --bench='${BENCH_ARGS}'"
+RET=$?
+
+cat "${OUT_DIR}/summary.txt" 2> /dev/null | tail -n 1
+exit ${RET}
@@ -0,0 +1 @@
+../BuildScript.sh
\ No newline at end of file
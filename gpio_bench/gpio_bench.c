@@ -0,0 +1,417 @@
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * user space benchmark of the 007 bone-gpios lines: how fast one process can toggle them
+ * through the sysfs value attribute and through the /dev/bone-gpioN char device
+ *
+ * every mode runs for a fixed time and prints one result row, CSV by default or JSON with -f json
+ *
+ * e.g. gpio_bench.elf -c /dev/bone-gpio0 -s /sys/class/bone-gpios/gpio1.0/value -l $(git describe)
+ *
+ * modes:
+ *  sysfs           open()/write()/close() of value per toggle, one line, what a shell loop does
+ *  sysfs-fd        pwrite() of value kept open, one line
+ *  chardev-write   write() of a bitmap, every line of the instance per toggle
+ *  chardev-ioctl   BONE_GPIO_SET_VALUES, every line of the instance per toggle
+ *  chardev-read    read() of a bitmap, samples every line, nothing toggles
+ *  chardev-events  flips the gpio-sim pull of an input line set to edge both and read()s the
+ *                  event back, ns_per_op is the round trip and latency_ns the pull write to
+ *                  event timestamp, e.g. -m chardev-events -p .../gpiochip0/sim_gpio0/pull
+ *                  with -b each edge bounces first, a debounced line still gives exactly one
+ *                  event per edge, a queued extra event counts as an error
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include "bone_gpio.h"
+
+/* max entries of a comma separated option */
+#define MAX_LIST (16)
+
+enum bench_mode {
+    MODE_SYSFS,
+    MODE_SYSFS_FD,
+    MODE_CHARDEV_WRITE,
+    MODE_CHARDEV_IOCTL,
+    MODE_CHARDEV_READ,
+    MODE_CHARDEV_EVENTS,
+    MODE_COUNT
+};
+
+static const char *const mode_names[MODE_COUNT] = {
+    [MODE_SYSFS] = "sysfs",
+    [MODE_SYSFS_FD] = "sysfs-fd",
+    [MODE_CHARDEV_WRITE] = "chardev-write",
+    [MODE_CHARDEV_IOCTL] = "chardev-ioctl",
+    [MODE_CHARDEV_READ] = "chardev-read",
+    [MODE_CHARDEV_EVENTS] = "chardev-events"
+};
+
+/* command line */
+struct bench_config
+{
+    int modes[MAX_LIST];
+    int nr_modes;
+    /* /dev/bone-gpioN */
+    const char *chardev;
+    /* value attribute of one of its lines */
+    const char *sysfs;
+    /* gpio-sim pull attribute of an edge both line, for chardev-events */
+    const char *pull;
+    /* glitches before each edge of chardev-events */
+    int bounces;
+    /* seconds per row */
+    double duration;
+    int json;
+    const char *label;
+    char kernel[128];
+};
+
+static void usage(const char *prog);
+static int parse_modes(char *arg, int *modes);
+static unsigned long long now_ns(void);
+static int toggle(const struct bench_config *cfg, int mode, int fd, unsigned int nlines, unsigned long long i);
+static int events_setup(const struct bench_config *cfg, int fd, unsigned int nlines, int *pull_fd);
+static int event_round_trip(const struct bench_config *cfg, int fd, int pull_fd, unsigned long long i, unsigned long long *latency);
+static int run_row(const struct bench_config *cfg, int mode, int *first);
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  -c chardev  /dev/bone-gpioN of the chardev modes\n");
+    fprintf(stderr, "  -s value    sysfs value attribute of the sysfs modes\n");
+    fprintf(stderr, "  -p pull     gpio-sim pull attribute of chardev-events, its line set to edge both\n");
+    fprintf(stderr, "  -b bounces  glitches before each edge of chardev-events, default 0\n");
+    fprintf(stderr, "  -m modes    comma separated, default every mode the paths allow\n");
+    fprintf(stderr, "              sysfs sysfs-fd chardev-write chardev-ioctl chardev-read chardev-events\n");
+    fprintf(stderr, "  -d seconds  duration of each row, default 2\n");
+    fprintf(stderr, "  -f format   csv or json, default csv\n");
+    fprintf(stderr, "  -l label    free text copied to every row, e.g. the driver revision\n");
+}
+
+static int parse_modes(char *arg, int *modes)
+{
+    char *tok;
+    int n = 0;
+    int i;
+
+    for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ","))
+    {
+        if (n == MAX_LIST)
+            return -1;
+        for (i = 0; i < MODE_COUNT; i++)
+        {
+            if (!strcmp(tok, mode_names[i]))
+                break;
+        }
+        if (i == MODE_COUNT)
+        {
+            fprintf(stderr, "unknown mode %s\n", tok);
+            return -1;
+        }
+        modes[n++] = i;
+    }
+    return n ? n : -1;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* toggle number i, odd ones drive the lines high. 0 or -1 */
+static int toggle(const struct bench_config *cfg, int mode, int fd, unsigned int nlines, unsigned long long i)
+{
+    /* little endian bitmap, line 0 is bit 0 of byte 0 */
+    uint8_t bitmap[BONE_GPIO_MAX_LINES / 8];
+    struct bone_gpio_values values;
+    const char *value = (i & 1) ? "1" : "0";
+    size_t len = (nlines + 7) / 8;
+    int ret;
+
+    switch (mode)
+    {
+        case MODE_SYSFS:
+            fd = open(cfg->sysfs, O_WRONLY);
+            if (fd < 0)
+                return -1;
+            ret = (write(fd, value, 1) == 1) ? 0 : -1;
+            close(fd);
+            return ret;
+        case MODE_SYSFS_FD:
+            return (pwrite(fd, value, 1, 0) == 1) ? 0 : -1;
+        case MODE_CHARDEV_WRITE:
+            memset(bitmap, (i & 1) ? 0xff : 0x00, sizeof(bitmap));
+            return (write(fd, bitmap, len) == (ssize_t)len) ? 0 : -1;
+        case MODE_CHARDEV_IOCTL:
+            values.mask = (nlines < 64) ? ((1ull << nlines) - 1) : ~0ull;
+            values.bits = (i & 1) ? values.mask : 0;
+            return ioctl(fd, BONE_GPIO_SET_VALUES, &values);
+        case MODE_CHARDEV_READ:
+            return (read(fd, bitmap, len) == (ssize_t)len) ? 0 : -1;
+        default:
+            return -1;
+    }
+}
+
+/* watches every line, starts from a low line and an empty queue. 0 or -1 */
+static int events_setup(const struct bench_config *cfg, int fd, unsigned int nlines, int *pull_fd)
+{
+    struct bone_gpio_event event;
+    uint64_t watch = (nlines < 64) ? ((1ull << nlines) - 1) : ~0ull;
+    int flags = fcntl(fd, F_GETFL);
+
+    *pull_fd = open(cfg->pull, O_WRONLY);
+    if (*pull_fd < 0)
+    {
+        fprintf(stderr, "%s: %s\n", cfg->pull, strerror(errno));
+        return -1;
+    }
+    if ((pwrite(*pull_fd, "pull-down", 9, 0) != 9) || ioctl(fd, BONE_GPIO_WATCH_EVENTS, &watch))
+    {
+        fprintf(stderr, "chardev-events: %s\n", strerror(errno));
+        return -1;
+    }
+    /* the falling edge of the pull-down, if there was one */
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    while (read(fd, &event, sizeof(event)) == sizeof(event))
+        ;
+    fcntl(fd, F_SETFL, flags);
+    return 0;
+}
+
+/* edge number i, even ones rise, after cfg->bounces glitches, and its event back. 0 or -1 */
+static int event_round_trip(const struct bench_config *cfg, int fd, int pull_fd, unsigned long long i, unsigned long long *latency)
+{
+    struct bone_gpio_event event;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    const char *pull = (i & 1) ? "pull-down" : "pull-up";
+    const char *back = (i & 1) ? "pull-up" : "pull-down";
+    unsigned long long start = now_ns();
+    int b;
+
+    for (b = 0; b < cfg->bounces; b++)
+    {
+        if ((pwrite(pull_fd, pull, strlen(pull), 0) != (ssize_t)strlen(pull)) ||
+            (pwrite(pull_fd, back, strlen(back), 0) != (ssize_t)strlen(back)))
+            return -1;
+    }
+    if (pwrite(pull_fd, pull, strlen(pull), 0) != (ssize_t)strlen(pull))
+        return -1;
+    if (read(fd, &event, sizeof(event)) != sizeof(event))
+        return -1;
+    /* the kernel stamps events with CLOCK_MONOTONIC like now_ns() */
+    *latency += event.timestamp_ns - start;
+    /* the glitches of an unfiltered line are queued by now, take them so the next edge starts clean */
+    if (poll(&pfd, 1, 0) > 0)
+    {
+        while (poll(&pfd, 1, 0) > 0)
+            read(fd, &event, sizeof(event));
+        return -1;
+    }
+    return (event.id == ((i & 1) ? BONE_GPIO_EVENT_FALLING : BONE_GPIO_EVENT_RISING)) ? 0 : -1;
+}
+
+static int run_row(const struct bench_config *cfg, int mode, int *first)
+{
+    struct bone_gpio_info info = {0};
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long ops = 0;
+    unsigned long long latency = 0;
+    unsigned long errors = 0;
+    unsigned int nlines = 1;
+    const char *path;
+    double secs;
+    int pull_fd = -1;
+    int fd = -1;
+    int i;
+
+    path = ((mode == MODE_SYSFS) || (mode == MODE_SYSFS_FD)) ? cfg->sysfs : cfg->chardev;
+    if (!path)
+    {
+        fprintf(stderr, "%s needs %s\n", mode_names[mode], (path == cfg->sysfs) ? "-s" : "-c");
+        return -1;
+    }
+    if (mode != MODE_SYSFS)
+    {
+        fd = open(path, ((mode == MODE_CHARDEV_READ) || (mode == MODE_CHARDEV_EVENTS)) ? O_RDONLY : O_WRONLY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    if (path == cfg->chardev)
+    {
+        if (ioctl(fd, BONE_GPIO_GET_INFO, &info))
+        {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        nlines = info.nlines;
+    }
+    if (mode == MODE_CHARDEV_EVENTS)
+    {
+        if (!cfg->pull)
+            fprintf(stderr, "%s needs -p\n", mode_names[mode]);
+        if (!cfg->pull || events_setup(cfg, fd, nlines, &pull_fd))
+        {
+            if (pull_fd >= 0)
+                close(pull_fd);
+            close(fd);
+            return -1;
+        }
+    }
+
+    /* the clock is only read every 64 toggles, a sysfs toggle is a few microseconds */
+    start = now_ns();
+    end = start + (unsigned long long)(cfg->duration * 1e9);
+    do
+    {
+        for (i = 0; i < 64; i++, ops++)
+        {
+            if ((mode == MODE_CHARDEV_EVENTS) ? event_round_trip(cfg, fd, pull_fd, ops, &latency) : toggle(cfg, mode, fd, nlines, ops))
+                errors++;
+        }
+    } while (now_ns() < end);
+    secs = (now_ns() - start) / 1e9;
+    if (fd >= 0)
+        close(fd);
+    if (pull_fd >= 0)
+        close(pull_fd);
+
+    if (cfg->json)
+    {
+        printf("%s\n  {\"label\": \"%s\", \"kernel\": \"%s\", \"device\": \"%s\", \"mode\": \"%s\", "
+               "\"lines\": %u, \"seconds\": %.3f, \"ops\": %llu, \"errors\": %lu, \"ops_per_s\": %.1f, "
+               "\"ns_per_op\": %.1f, \"latency_ns\": %.1f}",
+               *first ? "" : ",", cfg->label, cfg->kernel, path, mode_names[mode], nlines, secs,
+               ops, errors, ops / secs, secs * 1e9 / ops, (double)latency / ops);
+    }
+    else
+    {
+        printf("%s,%s,%s,%s,%u,%.3f,%llu,%lu,%.1f,%.1f,%.1f\n",
+               cfg->label, cfg->kernel, path, mode_names[mode], nlines, secs,
+               ops, errors, ops / secs, secs * 1e9 / ops, (double)latency / ops);
+    }
+    *first = 0;
+    fflush(stdout);
+    return errors ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .duration = 2.0,
+        .label = ""
+    };
+    struct utsname uts;
+    int first = 1;
+    int failed = 0;
+    int opt;
+    int m;
+
+    while ((opt = getopt(argc, argv, "c:s:p:b:m:d:f:l:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                cfg.chardev = optarg;
+                break;
+            case 's':
+                cfg.sysfs = optarg;
+                break;
+            case 'p':
+                cfg.pull = optarg;
+                break;
+            case 'b':
+                cfg.bounces = atoi(optarg);
+                if (cfg.bounces < 0)
+                    goto err_usage;
+                break;
+            case 'm':
+                cfg.nr_modes = parse_modes(optarg, cfg.modes);
+                if (cfg.nr_modes < 0)
+                    return 1;
+                break;
+            case 'd':
+                cfg.duration = strtod(optarg, NULL);
+                if (cfg.duration <= 0)
+                    goto err_usage;
+                break;
+            case 'f':
+                if (!strcmp(optarg, "json"))
+                    cfg.json = 1;
+                else if (strcmp(optarg, "csv"))
+                    goto err_usage;
+                break;
+            case 'l':
+                cfg.label = optarg;
+                break;
+            default:
+                goto err_usage;
+        }
+    }
+    if ((optind != argc) || (!cfg.chardev && !cfg.sysfs))
+        goto err_usage;
+
+    /* no -m, the modes of the paths given */
+    if (!cfg.nr_modes)
+    {
+        for (m = 0; m < MODE_COUNT; m++)
+        {
+            if (((m == MODE_SYSFS) || (m == MODE_SYSFS_FD)) ? !!cfg.sysfs : (m == MODE_CHARDEV_EVENTS) ? (cfg.chardev && cfg.pull) : !!cfg.chardev)
+                cfg.modes[cfg.nr_modes++] = m;
+        }
+    }
+
+    if (!uname(&uts))
+        snprintf(cfg.kernel, sizeof(cfg.kernel), "%s", uts.release);
+
+    if (cfg.json)
+        printf("[");
+    else
+        printf("label,kernel,device,mode,lines,seconds,ops,errors,ops_per_s,ns_per_op,latency_ns\n");
+
+    for (m = 0; m < cfg.nr_modes; m++)
+    {
+        if (run_row(&cfg, cfg.modes[m], &first))
+            failed++;
+    }
+
+    if (cfg.json)
+        printf("\n]\n");
+    return failed ? 2 : 0;
+
+err_usage:
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,171 @@
+#ifndef PCD_CORE_H
+#define PCD_CORE_H
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * shared by the pcd drivers 002-006, one implementation for every variant
+ * the bounds, lseek and permission helpers are inline, they only work on positions and sizes
+ * since the drivers size their devices differently (a constant, platform data, a resizable buffer)
+ */
+#include <linux/fs.h>
+#include <linux/minmax.h>
+#include <linux/uio.h>
+#include <linux/xarray.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+
+/* device access permission */
+#define RDONLY 0x01u
+#define WRONLY 0x10u
+#define RDWR 0x11u
+
+/* buffer node of a device whose folios are spread round robin over the online nodes */
+#define PCD_NODE_INTERLEAVE (-2)
+
+/*
+ * file position after an lseek on a device of size bytes, -EINVAL outside [0, size]
+ * a position left past the end by a shrink counts from the new end
+ */
+static inline loff_t pcd_core_lseek(loff_t pos, loff_t offset, int whence, loff_t size)
+{
+    loff_t base;
+
+    switch (whence)
+    {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = min(pos, size);
+            break;
+        case SEEK_END:
+            base = size;
+            break;
+        default:
+            return -EINVAL;
+    }
+    /* checked before the addition, any offset can be passed in */
+    if ((offset > size - base) || (offset < -base))
+        return -EINVAL;
+    return base + offset;
+}
+
+/* bytes of a count bytes transfer at pos that fit in size bytes, 0 at or past the end */
+static inline size_t pcd_core_clamp(loff_t pos, size_t count, loff_t size)
+{
+    if ((pos < 0) || (pos >= size))
+        return 0;
+    /* size - pos is positive here, a signed compare would turn a count above LLONG_MAX negative */
+    return min_t(u64, count, size - pos);
+}
+
+/* 0 if a file opened with mode may access a device with perm, -EPERM otherwise */
+static inline int pcd_core_check_permission(int perm, fmode_t mode)
+{
+    switch (perm)
+    {
+        case RDONLY:
+            if ((mode & FMODE_READ) && !(mode & FMODE_WRITE))
+                return 0;
+            break;
+        case WRONLY:
+            if (!(mode & FMODE_READ) && (mode & FMODE_WRITE))
+                return 0;
+            break;
+        case RDWR:
+            return 0;
+    }
+    return -EPERM;
+}
+
+/*
+ * everything below lives in the pcd_core module, build it first and pass its Module.symvers
+ * to the front ends through KBUILD_EXTRA_SYMBOLS
+ */
+
+/* sparse device buffer, replaced as a whole when max_size changes */
+struct pcd_buffer {
+    /* usable bytes */
+    int size;
+    /* folio order of new pages, 0 below huge_min_size */
+    unsigned int order;
+    /* NUMA node of new pages, NUMA_NO_NODE for the writer's node or PCD_NODE_INTERLEAVE */
+    int node;
+    /* page index -> struct folio, only the pages written to or mapped are there */
+    struct xarray pages;
+    /* number of pages in pages */
+    atomic_long_t nr_pages;
+};
+
+/* per cpu I/O counters of a device, summed up when read */
+struct pcd_stats {
+    u64_stats_t bytes_read;
+    u64_stats_t bytes_written;
+    u64_stats_t reads;
+    u64_stats_t writes;
+    /* calls that moved less than asked for */
+    u64_stats_t short_reads;
+    u64_stats_t short_writes;
+    u64_stats_t efaults;
+    u64_stats_t opens;
+    struct u64_stats_sync syncp;
+};
+
+/* sum of the per cpu counters */
+struct pcd_stats_snapshot {
+    u64 bytes_read;
+    u64 bytes_written;
+    u64 reads;
+    u64 writes;
+    u64 short_reads;
+    u64 short_writes;
+    u64 efaults;
+    u64 opens;
+};
+
+enum {
+    PCD_STATS_READ,
+    PCD_STATS_WRITE,
+    PCD_STATS_DIRS
+};
+
+/* flat I/O engine, a fixed size kernel buffer (002-005) */
+loff_t pcd_core_llseek(struct file *filp, loff_t offset, int whence, loff_t size);
+ssize_t pcd_core_read_iter(struct kiocb *iocb, struct iov_iter *to, const char *buffer, loff_t size);
+ssize_t pcd_core_write_iter(struct kiocb *iocb, struct iov_iter *from, char *buffer, loff_t size);
+int pcd_core_open(struct file *filp, int perm, void *private_data);
+void *pcd_alloc_flat_buffer(size_t size);
+void pcd_free_flat_buffer(void *buffer);
+
+/* sparse buffer (006) */
+struct pcd_buffer *pcd_alloc_buffer(int size, int node);
+void pcd_buffer_set_node(struct pcd_buffer *buffer, int node);
+struct pcd_buffer *pcd_resize_buffer(struct pcd_buffer *buffer, int size);
+struct page *pcd_buffer_page(struct pcd_buffer *buffer, pgoff_t index);
+ssize_t pcd_buffer_read(struct pcd_buffer *buffer, loff_t pos, size_t count, struct iov_iter *to);
+ssize_t pcd_buffer_write(struct pcd_buffer *buffer, loff_t pos, size_t count, struct iov_iter *from);
+ssize_t pcd_buffer_fill(struct pcd_buffer *buffer, loff_t pos, size_t count, int c);
+unsigned long pcd_buffer_resident(struct pcd_buffer *buffer);
+void pcd_free_buffer(struct pcd_buffer *buffer);
+
+/* statistics */
+void pcd_stats_account(struct pcd_stats __percpu *pcpu_stats, int dir, size_t count, ssize_t ret);
+void pcd_stats_opened(struct pcd_stats __percpu *pcpu_stats);
+void pcd_stats_snapshot(struct pcd_stats __percpu *pcpu_stats, struct pcd_stats_snapshot *snap);
+
+#endif /*PCD_CORE_H*/
@@ -0,0 +1,88 @@
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * events shared by the pcd drivers, each driver includes this from its own
+ * trace header after setting TRACE_SYSTEM, so there is no include guard:
+ * define_trace.h reads the file again with TRACE_HEADER_MULTI_READ set
+ */
+#include <linux/tracepoint.h>
+
+/* serial numbers longer than this are truncated in the trace */
+#ifndef PCD_TRACE_SERIAL_LEN
+#define PCD_TRACE_SERIAL_LEN 16
+#endif
+
+TRACE_EVENT(pcd_open,
+    TP_PROTO(const char *serial, int minor, fmode_t f_mode),
+    TP_ARGS(serial, minor, f_mode),
+    TP_STRUCT__entry(
+        __array(char, serial, PCD_TRACE_SERIAL_LEN)
+        __field(int, minor)
+        __field(unsigned int, f_mode)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->serial, serial, PCD_TRACE_SERIAL_LEN);
+        __entry->minor = minor;
+        __entry->f_mode = (unsigned int)f_mode;
+    ),
+    TP_printk("serial=%s minor=%d f_mode=0x%x", __entry->serial, __entry->minor, __entry->f_mode)
+);
+
+/* read and write carry the same information */
+DECLARE_EVENT_CLASS(pcd_rw,
+    TP_PROTO(const char *serial, size_t count, loff_t f_pos),
+    TP_ARGS(serial, count, f_pos),
+    TP_STRUCT__entry(
+        __array(char, serial, PCD_TRACE_SERIAL_LEN)
+        __field(size_t, count)
+        __field(loff_t, f_pos)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->serial, serial, PCD_TRACE_SERIAL_LEN);
+        __entry->count = count;
+        __entry->f_pos = f_pos;
+    ),
+    TP_printk("serial=%s count=%zu f_pos=%lld", __entry->serial, __entry->count, __entry->f_pos)
+);
+
+DEFINE_EVENT(pcd_rw, pcd_read,
+    TP_PROTO(const char *serial, size_t count, loff_t f_pos),
+    TP_ARGS(serial, count, f_pos)
+);
+
+DEFINE_EVENT(pcd_rw, pcd_write,
+    TP_PROTO(const char *serial, size_t count, loff_t f_pos),
+    TP_ARGS(serial, count, f_pos)
+);
+
+TRACE_EVENT(pcd_lseek,
+    TP_PROTO(const char *serial, loff_t offset, int whence, loff_t f_pos),
+    TP_ARGS(serial, offset, whence, f_pos),
+    TP_STRUCT__entry(
+        __array(char, serial, PCD_TRACE_SERIAL_LEN)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, f_pos)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->serial, serial, PCD_TRACE_SERIAL_LEN);
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->f_pos = f_pos;
+    ),
+    TP_printk("serial=%s offset=%lld whence=%d f_pos=%lld", __entry->serial, __entry->offset, __entry->whence, __entry->f_pos)
+);
@@ -0,0 +1,1098 @@
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * user space benchmark of the pcd devices: /dev/pcd, /dev/pcd-N and /dev/rgbpcdev-N
+ *
+ * every combination of device, mode, block size and thread count runs for a fixed time
+ * and prints one result row, CSV by default or JSON with -f json. rows carry a label (-l)
+ * and the kernel release so runs of different driver revisions can be compared side by side
+ *
+ * e.g. pcd_bench.elf -m read,readv,randwrite -b 16,128,512 -t 1,4 -l $(git describe) /dev/rgbpcdev-0
+ *
+ * modes:
+ *  read/write          sequential pread/pwrite of one block
+ *  randread/randwrite  the same at random block aligned offsets
+ *  readv/writev        one preadv/pwritev of the block split in -s segments
+ *  mmap                memcpy of the block from a shared mapping of the device
+ *  splice              device -> pipe -> /dev/null without a user copy
+ *  openclose           open()/close() of the device node
+ *  lseek               SEEK_SET to the next block, the bounds logic of pcd_core.h alone
+ *  poll                wakeup latency of a reader sleeping in poll() for a writer, 2 threads
+ *  uring-read          -q IORING_OP_READ per submission (URING=1 builds only)
+ *  uring-batch         -q reads in one PCD_URING_CMD_BATCH, rgbpcdev-N only (URING=1 builds only)
+ *
+ * -R a,b resizes rgbpcdev-N between a and b bytes through sysfs while the mode runs
+ * -N node runs every thread on the cpus of a NUMA node, against the buffer_node of rgbpcdev-N
+ * it gives the local and the remote memory bandwidth of a device
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#ifdef PCD_BENCH_URING
+#include <liburing.h>
+#include "pcd_uring.h"
+#endif
+
+/* bucket i counts the ops that took [2^i, 2^(i+1)) ns, same layout as the driver histograms */
+#define LAT_BUCKETS (64)
+/* max entries of a comma separated option */
+#define MAX_LIST (16)
+/* max segments of readv/writev */
+#define MAX_SEGS (64)
+/* max submissions in flight of the uring modes */
+#define MAX_DEPTH (256)
+
+enum bench_mode {
+    MODE_READ,
+    MODE_WRITE,
+    MODE_RANDREAD,
+    MODE_RANDWRITE,
+    MODE_READV,
+    MODE_WRITEV,
+    MODE_MMAP,
+    MODE_SPLICE,
+    MODE_OPENCLOSE,
+    MODE_LSEEK,
+    MODE_POLL,
+    MODE_URING_READ,
+    MODE_URING_BATCH,
+    MODE_COUNT
+};
+
+static const char *const mode_names[MODE_COUNT] = {
+    [MODE_READ] = "read",
+    [MODE_WRITE] = "write",
+    [MODE_RANDREAD] = "randread",
+    [MODE_RANDWRITE] = "randwrite",
+    [MODE_READV] = "readv",
+    [MODE_WRITEV] = "writev",
+    [MODE_MMAP] = "mmap",
+    [MODE_SPLICE] = "splice",
+    [MODE_OPENCLOSE] = "openclose",
+    [MODE_LSEEK] = "lseek",
+    [MODE_POLL] = "poll",
+    [MODE_URING_READ] = "uring-read",
+    [MODE_URING_BATCH] = "uring-batch"
+};
+
+/* command line */
+struct bench_config
+{
+    char **devices;
+    int nr_devices;
+    int modes[MAX_LIST];
+    int nr_modes;
+    long sizes[MAX_LIST];
+    int nr_sizes;
+    long threads[MAX_LIST];
+    int nr_threads;
+    /* seconds per row */
+    double duration;
+    /* readv/writev segments */
+    int segs;
+    /* uring submissions per batch */
+    int depth;
+    /* -R, sysfs resize bounds, 0 when off */
+    long resize[2];
+    /* -N, NUMA node the threads run on, -1 when off */
+    int node;
+    int json;
+    const char *label;
+    char kernel[128];
+};
+
+/* the device under test */
+struct bench_device
+{
+    const char *path;
+    /* open flags the device accepts, O_RDWR, O_RDONLY or O_WRONLY */
+    int access;
+    /* FIFO devices of pcd_n, no positional I/O */
+    int stream;
+    /* bytes addressable with pread/pwrite */
+    long size;
+    /* max_size attribute, empty if the device has none */
+    char sysfs[PATH_MAX];
+};
+
+/* state of one row */
+struct bench_run
+{
+    const struct bench_config *cfg;
+    struct bench_device *dev;
+    int mode;
+    long bs;
+    int nr_threads;
+    pthread_barrier_t barrier;
+    int stop;
+    /* poll mode handshake */
+    unsigned long produced;
+    unsigned long consumed;
+    /* resize thread result */
+    unsigned long resizes;
+    unsigned long resize_errors;
+};
+
+struct bench_thread
+{
+    struct bench_run *run;
+    pthread_t tid;
+    int id;
+    int fd;
+    char *buf;
+    char *map;
+    int pipe[2];
+    int devnull;
+    long offset;
+    unsigned int seed;
+    struct iovec iov[MAX_SEGS];
+    int nr_iov;
+#ifdef PCD_BENCH_URING
+    struct io_uring ring;
+    int ring_ready;
+    struct pcd_uring_op ops[MAX_DEPTH];
+#endif
+    /* results */
+    unsigned long ops_done;
+    unsigned long long bytes;
+    unsigned long errors;
+    unsigned long long lat[LAT_BUCKETS];
+    unsigned long long lat_max;
+};
+
+/* helper functions */
+static void usage(const char *prog);
+static int parse_list(char *arg, long *list, long min);
+static int parse_modes(char *arg, int *modes);
+static int mode_is_read(int mode);
+static unsigned long long now_ns(void);
+static void lat_record(struct bench_thread *t, unsigned long long ns);
+static unsigned long long lat_percentile(const unsigned long long *lat, unsigned long long total, unsigned int permille);
+static int sysfs_write_size(const char *path, long size);
+static int bind_node(int node);
+static int device_probe(struct bench_device *dev);
+static int device_prefill(struct bench_device *dev);
+static int thread_setup(struct bench_thread *t);
+static void thread_teardown(struct bench_thread *t);
+static long next_offset(struct bench_thread *t);
+static ssize_t bench_op(struct bench_thread *t);
+static void *bench_worker(void *arg);
+static void *poll_reader(void *arg);
+static void *poll_writer(void *arg);
+static void *resize_worker(void *arg);
+static int run_row(const struct bench_config *cfg, struct bench_device *dev, int mode, long bs, int nr_threads, int *first);
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] device...\n", prog);
+    fprintf(stderr, "  -m modes    comma separated, default read,write\n");
+    fprintf(stderr, "              read write randread randwrite readv writev mmap splice openclose lseek poll\n");
+    fprintf(stderr, "              uring-read uring-batch\n");
+    fprintf(stderr, "  -b sizes    block sizes in bytes, default 1,16,128,512\n");
+    fprintf(stderr, "  -t threads  thread counts, default 1\n");
+    fprintf(stderr, "  -d seconds  duration of each row, default 2\n");
+    fprintf(stderr, "  -s segs     readv/writev segments, default 8\n");
+    fprintf(stderr, "  -q depth    reads per uring submission, default 16\n");
+    fprintf(stderr, "  -R a,b      resize rgbpcdev-N between a and b bytes during the run\n");
+    fprintf(stderr, "  -N node     run on the cpus of a NUMA node\n");
+    fprintf(stderr, "  -f format   csv or json, default csv\n");
+    fprintf(stderr, "  -l label    free text copied to every row, e.g. the driver revision\n");
+}
+
+/* comma separated numbers, returns the count or -1 */
+static int parse_list(char *arg, long *list, long min)
+{
+    char *tok;
+    char *end;
+    int n = 0;
+
+    for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ","))
+    {
+        if (n == MAX_LIST)
+            return -1;
+        list[n] = strtol(tok, &end, 0);
+        if (*end || (list[n] < min))
+            return -1;
+        n++;
+    }
+    return n ? n : -1;
+}
+
+static int parse_modes(char *arg, int *modes)
+{
+    char *tok;
+    int n = 0;
+    int i;
+
+    for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ","))
+    {
+        if (n == MAX_LIST)
+            return -1;
+        for (i = 0; i < MODE_COUNT; i++)
+        {
+            if (!strcmp(tok, mode_names[i]))
+                break;
+        }
+        if (i == MODE_COUNT)
+        {
+            fprintf(stderr, "unknown mode %s\n", tok);
+            return -1;
+        }
+#ifndef PCD_BENCH_URING
+        if ((i == MODE_URING_READ) || (i == MODE_URING_BATCH))
+        {
+            fprintf(stderr, "%s needs a URING=1 build\n", tok);
+            return -1;
+        }
+#endif
+        modes[n++] = i;
+    }
+    return n ? n : -1;
+}
+
+/* modes that need data in the device before they start */
+static int mode_is_read(int mode)
+{
+    switch (mode)
+    {
+        case MODE_READ:
+        case MODE_RANDREAD:
+        case MODE_READV:
+        case MODE_MMAP:
+        case MODE_SPLICE:
+        case MODE_URING_READ:
+        case MODE_URING_BATCH:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void lat_record(struct bench_thread *t, unsigned long long ns)
+{
+    t->lat[63 - __builtin_clzll(ns | 1)]++;
+    if (ns > t->lat_max)
+        t->lat_max = ns;
+}
+
+/* upper bound in ns of the bucket holding the permille-th op, 0 without ops */
+static unsigned long long lat_percentile(const unsigned long long *lat, unsigned long long total, unsigned int permille)
+{
+    unsigned long long target = (total * permille + 999) / 1000;
+    unsigned long long seen = 0;
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+    {
+        seen += lat[i];
+        if (seen && (seen >= target))
+            return (i == LAT_BUCKETS - 1) ? ULLONG_MAX : (1ull << (i + 1));
+    }
+    return 0;
+}
+
+static int sysfs_write_size(const char *path, long size)
+{
+    char val[32];
+    int len = snprintf(val, sizeof(val), "%ld", size);
+    int fd = open(path, O_WRONLY);
+    int ret = 0;
+
+    if (fd < 0)
+        return -errno;
+    if (write(fd, val, len) != len)
+        ret = -errno;
+    close(fd);
+    return ret;
+}
+
+/* pins the calling thread, and the threads it creates later, to the cpus of node */
+static int bind_node(int node)
+{
+    char path[64];
+    char list[1024];
+    cpu_set_t set;
+    char *tok;
+    char *save;
+    int first;
+    int last;
+    int cpu;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!fgets(list, sizeof(list), f))
+        list[0] = '\0';
+    fclose(f);
+
+    /* e.g. 0-3,8-11 */
+    CPU_ZERO(&set);
+    for (tok = strtok_r(list, ",\n", &save); tok; tok = strtok_r(NULL, ",\n", &save))
+    {
+        if (sscanf(tok, "%d-%d", &first, &last) == 1)
+            last = first;
+        for (cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, &set);
+    }
+    if (!CPU_COUNT(&set))
+    {
+        fprintf(stderr, "node %d has no cpus\n", node);
+        return -1;
+    }
+    if (sched_setaffinity(0, sizeof(set), &set))
+    {
+        fprintf(stderr, "node %d: %s\n", node, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* access mode, seekability, size and sysfs node of a device */
+static int device_probe(struct bench_device *dev)
+{
+    struct stat st;
+    off_t end;
+    int fd;
+
+    dev->access = O_RDWR;
+    fd = open(dev->path, O_RDWR);
+    if (fd < 0)
+    {
+        dev->access = O_RDONLY;
+        fd = open(dev->path, O_RDONLY);
+    }
+    if (fd < 0)
+    {
+        dev->access = O_WRONLY;
+        fd = open(dev->path, O_WRONLY);
+    }
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: %s\n", dev->path, strerror(errno));
+        return -1;
+    }
+
+    /* pcd devices report their size as SEEK_END, FIFO devices are streams */
+    end = lseek(fd, 0, SEEK_END);
+    dev->stream = (end < 0);
+    dev->size = (end > 0) ? end : LONG_MAX;
+
+    dev->sysfs[0] = '\0';
+    if (!fstat(fd, &st))
+    {
+        snprintf(dev->sysfs, sizeof(dev->sysfs), "/sys/dev/char/%u:%u/max_size", major(st.st_rdev), minor(st.st_rdev));
+        if (access(dev->sysfs, W_OK))
+            dev->sysfs[0] = '\0';
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * readers of rgbpcdev-N wait for written data, fill the whole device once before a read mode.
+ * read only devices are left as they are, their reads run non blocking and count EAGAIN as errors
+ */
+static int device_prefill(struct bench_device *dev)
+{
+    char buf[4096];
+    long off = 0;
+    ssize_t n;
+    int fd;
+
+    if (dev->stream || (dev->access == O_RDONLY))
+        return 0;
+    fd = open(dev->path, O_WRONLY);
+    if (fd < 0)
+        return -1;
+    memset(buf, 0xa5, sizeof(buf));
+    while (off < dev->size)
+    {
+        n = pwrite(fd, buf, (dev->size - off < (long)sizeof(buf)) ? dev->size - off : (long)sizeof(buf), off);
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    close(fd);
+    return 0;
+}
+
+static int thread_setup(struct bench_thread *t)
+{
+    struct bench_run *run = t->run;
+    int flags = run->dev->access;
+    long seg;
+    long left;
+    int i;
+
+    t->fd = -1;
+    t->map = MAP_FAILED;
+    t->pipe[0] = t->pipe[1] = -1;
+    t->devnull = -1;
+    t->seed = 0x5eed + t->id;
+    /* threads start spread over the device so they don't all hit the same page */
+    t->offset = run->dev->stream ? 0 : ((run->dev->size / run->bs / run->nr_threads) * t->id * run->bs);
+
+    t->buf = aligned_alloc(64, (run->bs + 63) & ~63L);
+    if (!t->buf)
+        return -ENOMEM;
+    memset(t->buf, t->id, run->bs);
+
+    if (run->mode == MODE_OPENCLOSE)
+        return 0;
+    /* a reader never hangs on a device nobody filled, nor a writer on a FIFO nobody drains */
+    if ((mode_is_read(run->mode) || run->dev->stream) && (run->mode != MODE_POLL))
+        flags |= O_NONBLOCK;
+    t->fd = open(run->dev->path, flags);
+    if (t->fd < 0)
+        return -errno;
+
+    switch (run->mode)
+    {
+        case MODE_READV:
+        case MODE_WRITEV:
+            /* equal segments, the last one takes the rest */
+            t->nr_iov = (run->bs < run->cfg->segs) ? run->bs : run->cfg->segs;
+            seg = run->bs / t->nr_iov;
+            left = run->bs;
+            for (i = 0; i < t->nr_iov; i++)
+            {
+                t->iov[i].iov_base = t->buf + (run->bs - left);
+                t->iov[i].iov_len = (i == t->nr_iov - 1) ? left : seg;
+                left -= seg;
+            }
+            break;
+        case MODE_MMAP:
+            t->map = mmap(NULL, run->dev->size, PROT_READ, MAP_SHARED, t->fd, 0);
+            if (t->map == MAP_FAILED)
+                return -errno;
+            break;
+        case MODE_SPLICE:
+            if (pipe(t->pipe))
+                return -errno;
+            t->devnull = open("/dev/null", O_WRONLY);
+            if (t->devnull < 0)
+                return -errno;
+            break;
+#ifdef PCD_BENCH_URING
+        case MODE_URING_READ:
+        case MODE_URING_BATCH:
+            i = io_uring_queue_init(run->cfg->depth, &t->ring, 0);
+            if (i < 0)
+                return i;
+            t->ring_ready = 1;
+            break;
+#endif
+        default:
+            break;
+    }
+    return 0;
+}
+
+static void thread_teardown(struct bench_thread *t)
+{
+#ifdef PCD_BENCH_URING
+    if (t->ring_ready)
+        io_uring_queue_exit(&t->ring);
+#endif
+    if (t->map != MAP_FAILED)
+        munmap(t->map, t->run->dev->size);
+    if (t->pipe[0] >= 0)
+        close(t->pipe[0]);
+    if (t->pipe[1] >= 0)
+        close(t->pipe[1]);
+    if (t->devnull >= 0)
+        close(t->devnull);
+    if (t->fd >= 0)
+        close(t->fd);
+    free(t->buf);
+}
+
+/* block offset of the next op, sequential modes wrap at the end of the device */
+static long next_offset(struct bench_thread *t)
+{
+    struct bench_run *run = t->run;
+    long blocks = run->dev->size / run->bs;
+    long off;
+
+    if ((run->mode == MODE_RANDREAD) || (run->mode == MODE_RANDWRITE))
+        return (rand_r(&t->seed) % blocks) * run->bs;
+    if (t->offset + run->bs > run->dev->size)
+        t->offset = 0;
+    off = t->offset;
+    t->offset += run->bs;
+    return off;
+}
+
+#ifdef PCD_BENCH_URING
+/* -q reads of bs at consecutive offsets, IORING_OP_READ each or one driver batch */
+static ssize_t uring_op(struct bench_thread *t)
+{
+    struct bench_run *run = t->run;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct pcd_uring_cmd cmd;
+    ssize_t done = 0;
+    int nr = run->cfg->depth;
+    int ret;
+    int i;
+
+    if (run->mode == MODE_URING_READ)
+    {
+        for (i = 0; i < nr; i++)
+        {
+            sqe = io_uring_get_sqe(&t->ring);
+            io_uring_prep_read(sqe, t->fd, t->buf, run->bs, next_offset(t));
+        }
+    }
+    else
+    {
+        for (i = 0; i < nr; i++)
+        {
+            memset(&t->ops[i], 0, sizeof(t->ops[i]));
+            t->ops[i].addr = (uintptr_t)t->buf;
+            t->ops[i].offset = next_offset(t);
+            t->ops[i].len = run->bs;
+            t->ops[i].opcode = PCD_OP_READ;
+        }
+        cmd.ops = (uintptr_t)t->ops;
+        cmd.nr = nr;
+        cmd.flags = 0;
+        sqe = io_uring_get_sqe(&t->ring);
+        io_uring_prep_rw(IORING_OP_URING_CMD, sqe, t->fd, NULL, 0, 0);
+        sqe->cmd_op = PCD_URING_CMD_BATCH;
+        memcpy(sqe->cmd, &cmd, sizeof(cmd));
+        nr = 1;
+    }
+
+    ret = io_uring_submit_and_wait(&t->ring, nr);
+    if (ret < 0)
+        return ret;
+    for (i = 0; i < nr; i++)
+    {
+        ret = io_uring_wait_cqe(&t->ring, &cqe);
+        if (ret < 0)
+            return ret;
+        if (cqe->res < 0)
+            done = cqe->res;
+        else if (done >= 0)
+            done += (run->mode == MODE_URING_READ) ? cqe->res : 0;
+        io_uring_cqe_seen(&t->ring, cqe);
+    }
+    if ((run->mode == MODE_URING_BATCH) && (done >= 0))
+    {
+        for (i = 0; i < run->cfg->depth; i++)
+            done += (t->ops[i].res > 0) ? t->ops[i].res : 0;
+    }
+    return done;
+}
+#endif
+
+/* one op of the row's mode, bytes moved or -errno */
+static ssize_t bench_op(struct bench_thread *t)
+{
+    struct bench_run *run = t->run;
+    int stream = run->dev->stream;
+    ssize_t left;
+    ssize_t out;
+    ssize_t n;
+    long off;
+    int fd;
+
+    switch (run->mode)
+    {
+        case MODE_READ:
+        case MODE_RANDREAD:
+            off = next_offset(t);
+            n = stream ? read(t->fd, t->buf, run->bs) : pread(t->fd, t->buf, run->bs, off);
+            break;
+        case MODE_WRITE:
+        case MODE_RANDWRITE:
+            off = next_offset(t);
+            n = stream ? write(t->fd, t->buf, run->bs) : pwrite(t->fd, t->buf, run->bs, off);
+            break;
+        case MODE_READV:
+            off = next_offset(t);
+            n = stream ? readv(t->fd, t->iov, t->nr_iov) : preadv(t->fd, t->iov, t->nr_iov, off);
+            break;
+        case MODE_WRITEV:
+            off = next_offset(t);
+            n = stream ? writev(t->fd, t->iov, t->nr_iov) : pwritev(t->fd, t->iov, t->nr_iov, off);
+            break;
+        case MODE_MMAP:
+            off = next_offset(t);
+            memcpy(t->buf, t->map + off, run->bs);
+            /* keep the copy */
+            __asm__ __volatile__("" : : "r"(t->buf) : "memory");
+            n = run->bs;
+            break;
+        case MODE_SPLICE:
+            off = next_offset(t);
+            n = splice(t->fd, stream ? NULL : (loff_t *)&off, t->pipe[1], NULL, run->bs, SPLICE_F_MOVE);
+            /* drain the pipe so the next op has room */
+            for (left = n; left > 0; left -= out)
+            {
+                out = splice(t->pipe[0], NULL, t->devnull, NULL, left, SPLICE_F_MOVE);
+                if (out <= 0)
+                    return -errno;
+            }
+            break;
+        case MODE_OPENCLOSE:
+            fd = open(run->dev->path, run->dev->access);
+            if (fd < 0)
+                return -errno;
+            close(fd);
+            return 0;
+        case MODE_LSEEK:
+            return (lseek(t->fd, next_offset(t), SEEK_SET) < 0) ? -errno : 0;
+#ifdef PCD_BENCH_URING
+        case MODE_URING_READ:
+        case MODE_URING_BATCH:
+            return uring_op(t);
+#endif
+        default:
+            return -EINVAL;
+    }
+    return (n < 0) ? -errno : n;
+}
+
+static void *bench_worker(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct bench_run *run = t->run;
+    unsigned long long start;
+    ssize_t n;
+
+    pthread_barrier_wait(&run->barrier);
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+    {
+        start = now_ns();
+        n = bench_op(t);
+        lat_record(t, now_ns() - start);
+        if (n < 0)
+        {
+            t->errors++;
+            continue;
+        }
+        t->ops_done++;
+        t->bytes += n;
+    }
+    return NULL;
+}
+
+/*
+ * poll mode reader, sleeps in poll() at the first unwritten block and measures the time
+ * from the writer's timestamp in the block to its own return from read()
+ */
+static void *poll_reader(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct bench_run *run = t->run;
+    struct pollfd pfd = { .fd = t->fd, .events = POLLIN };
+    unsigned long long sent;
+    unsigned long long now;
+    long off = run->bs;
+    ssize_t n;
+
+    pthread_barrier_wait(&run->barrier);
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+    {
+        if (off + run->bs > run->dev->size)
+            off = run->bs;
+        /* pcd_poll looks at the file position */
+        lseek(t->fd, off, SEEK_SET);
+        n = poll(&pfd, 1, 100);
+        if (n <= 0)
+            continue;
+        n = read(t->fd, t->buf, run->bs);
+        now = now_ns();
+        if (n < (ssize_t)sizeof(sent))
+        {
+            t->errors++;
+            continue;
+        }
+        memcpy(&sent, t->buf, sizeof(sent));
+        lat_record(t, now - sent);
+        t->ops_done++;
+        t->bytes += n;
+        off += run->bs;
+        __atomic_store_n(&run->consumed, run->consumed + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * poll mode writer, one timestamped block at a time after the reader took the previous one.
+ * data_len of rgbpcdev-N only grows, so at the end of the device a shrink to one block
+ * followed by a grow back puts the reader to sleep again
+ */
+static void *poll_writer(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct bench_run *run = t->run;
+    unsigned long long now;
+    long off = run->bs;
+
+    pthread_barrier_wait(&run->barrier);
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+    {
+        if (__atomic_load_n(&run->consumed, __ATOMIC_ACQUIRE) != run->produced)
+        {
+            sched_yield();
+            continue;
+        }
+        if (off + run->bs > run->dev->size)
+        {
+            if (sysfs_write_size(run->dev->sysfs, run->bs) || sysfs_write_size(run->dev->sysfs, run->dev->size))
+                t->errors++;
+            off = run->bs;
+        }
+        now = now_ns();
+        memcpy(t->buf, &now, sizeof(now));
+        if (pwrite(t->fd, t->buf, run->bs, off) != run->bs)
+        {
+            t->errors++;
+            continue;
+        }
+        off += run->bs;
+        run->produced++;
+    }
+    return NULL;
+}
+
+/* -R, flips max_size as fast as sysfs takes it */
+static void *resize_worker(void *arg)
+{
+    struct bench_run *run = arg;
+    int i = 0;
+
+    pthread_barrier_wait(&run->barrier);
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+    {
+        if (sysfs_write_size(run->dev->sysfs, run->cfg->resize[i]))
+            run->resize_errors++;
+        else
+            run->resizes++;
+        i ^= 1;
+    }
+    return NULL;
+}
+
+/* runs one combination and prints its row, returns -1 if it couldn't start */
+static int run_row(const struct bench_config *cfg, struct bench_device *dev, int mode, long bs, int nr_threads, int *first)
+{
+    struct bench_thread *threads;
+    struct bench_run run;
+    struct timespec wait;
+    unsigned long long lat[LAT_BUCKETS] = { 0 };
+    unsigned long long lat_max = 0;
+    unsigned long long bytes = 0;
+    unsigned long long samples = 0;
+    unsigned long long start;
+    unsigned long ops = 0;
+    unsigned long errors = 0;
+    pthread_t resizer;
+    int resizing = cfg->resize[0] && dev->sysfs[0];
+    double secs;
+    int ret = 0;
+    int i;
+    int j;
+
+    if (mode == MODE_POLL)
+    {
+        /* one reader and one writer, the block has to carry the timestamp */
+        nr_threads = 2;
+        if (!dev->sysfs[0] || (dev->access != O_RDWR) || (bs < (long)sizeof(unsigned long long)) || (2 * bs > dev->size))
+        {
+            fprintf(stderr, "%s: poll needs a RDWR rgbpcdev-N and 8 <= bs <= size/2, skipped bs %ld\n", dev->path, bs);
+            return -1;
+        }
+        /* the reader starts asleep at the first block */
+        if (sysfs_write_size(dev->sysfs, bs) || sysfs_write_size(dev->sysfs, dev->size))
+            return -1;
+    }
+    if (bs > dev->size)
+    {
+        fprintf(stderr, "%s: bs %ld larger than the device, skipped\n", dev->path, bs);
+        return -1;
+    }
+    if (mode_is_read(mode))
+        device_prefill(dev);
+
+    memset(&run, 0, sizeof(run));
+    run.cfg = cfg;
+    run.dev = dev;
+    run.mode = mode;
+    run.bs = bs;
+    run.nr_threads = nr_threads;
+    threads = calloc(nr_threads, sizeof(*threads));
+    if (!threads)
+        return -1;
+    pthread_barrier_init(&run.barrier, NULL, nr_threads + 1 + resizing);
+
+    for (i = 0; i < nr_threads; i++)
+    {
+        threads[i].run = &run;
+        threads[i].id = i;
+        ret = thread_setup(&threads[i]);
+        if (ret)
+        {
+            fprintf(stderr, "%s %s: %s\n", dev->path, mode_names[mode], strerror(-ret));
+            goto out;
+        }
+    }
+    for (i = 0; i < nr_threads; i++)
+    {
+        if (mode == MODE_POLL)
+            pthread_create(&threads[i].tid, NULL, i ? poll_writer : poll_reader, &threads[i]);
+        else
+            pthread_create(&threads[i].tid, NULL, bench_worker, &threads[i]);
+    }
+    if (resizing)
+        pthread_create(&resizer, NULL, resize_worker, &run);
+
+    pthread_barrier_wait(&run.barrier);
+    start = now_ns();
+    wait.tv_sec = (time_t)cfg->duration;
+    wait.tv_nsec = (long)((cfg->duration - wait.tv_sec) * 1e9);
+    nanosleep(&wait, NULL);
+    __atomic_store_n(&run.stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i].tid, NULL);
+    if (resizing)
+    {
+        pthread_join(resizer, NULL);
+        /* leave the device at its original size */
+        sysfs_write_size(dev->sysfs, dev->size);
+    }
+    secs = (now_ns() - start) / 1e9;
+
+    for (i = 0; i < nr_threads; i++)
+    {
+        ops += threads[i].ops_done;
+        bytes += threads[i].bytes;
+        errors += threads[i].errors;
+        for (j = 0; j < LAT_BUCKETS; j++)
+            lat[j] += threads[i].lat[j];
+        if (threads[i].lat_max > lat_max)
+            lat_max = threads[i].lat_max;
+    }
+    for (j = 0; j < LAT_BUCKETS; j++)
+        samples += lat[j];
+
+    if (cfg->json)
+    {
+        printf("%s\n  {\"label\": \"%s\", \"kernel\": \"%s\", \"device\": \"%s\", \"mode\": \"%s\", "
+               "\"bs\": %ld, \"threads\": %d, \"seconds\": %.3f, \"ops\": %lu, \"bytes\": %llu, \"errors\": %lu, "
+               "\"ops_per_s\": %.1f, \"mib_per_s\": %.3f, \"lat_p50_ns\": %llu, \"lat_p99_ns\": %llu, "
+               "\"lat_p999_ns\": %llu, \"lat_max_ns\": %llu, \"resizes\": %lu, \"resize_errors\": %lu}",
+               *first ? "" : ",", cfg->label, cfg->kernel, dev->path, mode_names[mode], bs, nr_threads, secs,
+               ops, bytes, errors, ops / secs, bytes / secs / (1 << 20),
+               lat_percentile(lat, samples, 500), lat_percentile(lat, samples, 990),
+               lat_percentile(lat, samples, 999), lat_max, run.resizes, run.resize_errors);
+    }
+    else
+    {
+        printf("%s,%s,%s,%s,%ld,%d,%.3f,%lu,%llu,%lu,%.1f,%.3f,%llu,%llu,%llu,%llu,%lu,%lu\n",
+               cfg->label, cfg->kernel, dev->path, mode_names[mode], bs, nr_threads, secs,
+               ops, bytes, errors, ops / secs, bytes / secs / (1 << 20),
+               lat_percentile(lat, samples, 500), lat_percentile(lat, samples, 990),
+               lat_percentile(lat, samples, 999), lat_max, run.resizes, run.resize_errors);
+    }
+    *first = 0;
+    fflush(stdout);
+    ret = 0;
+
+out:
+    for (i = 0; i < nr_threads; i++)
+    {
+        if (threads[i].run)
+            thread_teardown(&threads[i]);
+    }
+    pthread_barrier_destroy(&run.barrier);
+    free(threads);
+    return ret ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .modes = { MODE_READ, MODE_WRITE },
+        .nr_modes = 2,
+        .sizes = { 1, 16, 128, 512 },
+        .nr_sizes = 4,
+        .threads = { 1 },
+        .nr_threads = 1,
+        .duration = 2.0,
+        .segs = 8,
+        .depth = 16,
+        .node = -1,
+        .label = ""
+    };
+    struct bench_device *devs;
+    struct utsname uts;
+    int first = 1;
+    int failed = 0;
+    int opt;
+    int d;
+    int m;
+    int b;
+    int t;
+
+    while ((opt = getopt(argc, argv, "m:b:t:d:s:q:R:N:f:l:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm':
+                cfg.nr_modes = parse_modes(optarg, cfg.modes);
+                if (cfg.nr_modes < 0)
+                    return 1;
+                break;
+            case 'b':
+                cfg.nr_sizes = parse_list(optarg, cfg.sizes, 1);
+                if (cfg.nr_sizes < 0)
+                    goto err_usage;
+                break;
+            case 't':
+                cfg.nr_threads = parse_list(optarg, cfg.threads, 1);
+                if (cfg.nr_threads < 0)
+                    goto err_usage;
+                break;
+            case 'd':
+                cfg.duration = strtod(optarg, NULL);
+                if (cfg.duration <= 0)
+                    goto err_usage;
+                break;
+            case 's':
+                cfg.segs = atoi(optarg);
+                if ((cfg.segs < 1) || (cfg.segs > MAX_SEGS))
+                    goto err_usage;
+                break;
+            case 'q':
+                cfg.depth = atoi(optarg);
+                if ((cfg.depth < 1) || (cfg.depth > MAX_DEPTH))
+                    goto err_usage;
+                break;
+            case 'R':
+                if (parse_list(optarg, cfg.resize, 1) != 2)
+                    goto err_usage;
+                break;
+            case 'N':
+                cfg.node = atoi(optarg);
+                if (cfg.node < 0)
+                    goto err_usage;
+                break;
+            case 'f':
+                if (!strcmp(optarg, "json"))
+                    cfg.json = 1;
+                else if (strcmp(optarg, "csv"))
+                    goto err_usage;
+                break;
+            case 'l':
+                cfg.label = optarg;
+                break;
+            default:
+                goto err_usage;
+        }
+    }
+    if (optind == argc)
+        goto err_usage;
+    cfg.devices = &argv[optind];
+    cfg.nr_devices = argc - optind;
+
+    if (!uname(&uts))
+        snprintf(cfg.kernel, sizeof(cfg.kernel), "%s", uts.release);
+    if ((cfg.node >= 0) && bind_node(cfg.node))
+        return 1;
+
+    devs = calloc(cfg.nr_devices, sizeof(*devs));
+    if (!devs)
+        return 1;
+    for (d = 0; d < cfg.nr_devices; d++)
+    {
+        devs[d].path = cfg.devices[d];
+        if (device_probe(&devs[d]))
+            return 1;
+        /* offsets stay inside the smaller size of the resize */
+        if (cfg.resize[0] && devs[d].sysfs[0])
+        {
+            if (cfg.resize[0] < devs[d].size)
+                devs[d].size = cfg.resize[0];
+            if (cfg.resize[1] < devs[d].size)
+                devs[d].size = cfg.resize[1];
+        }
+    }
+
+    if (cfg.json)
+        printf("[");
+    else
+        printf("label,kernel,device,mode,bs,threads,seconds,ops,bytes,errors,ops_per_s,mib_per_s,"
+               "lat_p50_ns,lat_p99_ns,lat_p999_ns,lat_max_ns,resizes,resize_errors\n");
+
+    for (d = 0; d < cfg.nr_devices; d++)
+        for (m = 0; m < cfg.nr_modes; m++)
+            for (b = 0; b < cfg.nr_sizes; b++)
+            {
+                for (t = 0; t < cfg.nr_threads; t++)
+                {
+                    if (run_row(&cfg, &devs[d], cfg.modes[m], cfg.sizes[b], cfg.threads[t], &first))
+                        failed++;
+                    /* one reader and one writer at most, the thread count has no effect */
+                    if ((cfg.modes[m] == MODE_POLL) || devs[d].stream)
+                        break;
+                }
+                /* open/close doesn't move data, the block size has no effect */
+                if (cfg.modes[m] == MODE_OPENCLOSE)
+                    break;
+            }
+
+    if (cfg.json)
+        printf("\n]\n");
+    free(devs);
+    return failed ? 2 : 0;
+
+err_usage:
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,453 @@
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sizes.h>
+#include <linux/nodemask.h>
+#include <linux/numa.h>
+#include <linux/version.h>
+#include "pcd_core.h"
+
+#define PCD_BUFFER_GFP (GFP_HIGHUSER | __GFP_ZERO)
+
+/* the largest buffer order, MAX_ORDER became inclusive in 6.4 and MAX_PAGE_ORDER in 6.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define PCD_MAX_ORDER MAX_PAGE_ORDER
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define PCD_MAX_ORDER MAX_ORDER
+#else
+#define PCD_MAX_ORDER (MAX_ORDER - 1)
+#endif
+
+#ifndef PMD_ORDER
+#define PMD_ORDER (PMD_SHIFT - PAGE_SHIFT)
+#endif
+
+/*
+ * folios and their allocators came in 5.16, before that the buffer holds single pages:
+ * the order is always 0 and a folio pointer is just the page
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+struct folio;
+
+static inline struct page *folio_page(struct folio *folio, unsigned long n)
+{
+    return (struct page *)folio + n;
+}
+
+static inline long folio_nr_pages(struct folio *folio)
+{
+    return 1;
+}
+
+static inline unsigned int folio_order(struct folio *folio)
+{
+    return 0;
+}
+
+static inline void folio_get(struct folio *folio)
+{
+    get_page((struct page *)folio);
+}
+
+static inline void folio_put(struct folio *folio)
+{
+    put_page((struct page *)folio);
+}
+
+static inline struct folio *folio_alloc(gfp_t gfp, unsigned int order)
+{
+    return (struct folio *)alloc_pages_node(NUMA_NO_NODE, gfp, 0);
+}
+
+static inline struct folio *__folio_alloc_node(gfp_t gfp, unsigned int order, int node)
+{
+    return (struct folio *)alloc_pages_node(node, gfp, 0);
+}
+#else
+#define PCD_BUFFER_FOLIOS
+#endif
+
+/* lifted from the arch/driver copies into highmem.h in 5.12 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+static inline void memcpy_page(struct page *dst_page, size_t dst_off, struct page *src_page, size_t src_off, size_t len)
+{
+    char *dst = kmap_atomic(dst_page);
+    char *src = kmap_atomic(src_page);
+
+    memcpy(dst + dst_off, src + src_off, len);
+    kunmap_atomic(src);
+    kunmap_atomic(dst);
+}
+
+static inline void memset_page(struct page *page, size_t offset, int val, size_t len)
+{
+    char *addr = kmap_atomic(page);
+
+    memset(addr + offset, val, len);
+    kunmap_atomic(addr);
+}
+#endif
+
+/*
+ * devices of at least huge_min_size bytes get their memory in PMD sized folios: fewer
+ * allocations and xarray entries, physically contiguous copies and less fragmentation
+ */
+static unsigned int huge_min_size = SZ_8M;
+module_param(huge_min_size, uint, 0644);
+MODULE_PARM_DESC(huge_min_size, "smallest sparse buffer backed by huge folios, 0 to disable");
+
+static unsigned int pcd_buffer_order(int size);
+static struct folio *pcd_buffer_alloc_folio(struct pcd_buffer *buffer, gfp_t gfp, unsigned int order, pgoff_t index);
+static struct page *pcd_buffer_lookup(struct pcd_buffer *buffer, pgoff_t index);
+static int pcd_buffer_store(struct pcd_buffer *buffer, pgoff_t start, struct folio *folio);
+static int pcd_buffer_copy_head(struct pcd_buffer *buffer, struct folio *folio, pgoff_t start, loff_t end);
+
+/*
+ * flat device buffer, the 004/005 devices
+ * kmalloc while the size is a cheap allocation, vmalloc above it, with huge mappings when
+ * the architecture supports them, so a large rgb,size doesn't need contiguous memory
+ */
+void *pcd_alloc_flat_buffer(size_t size)
+{
+    if (size <= (PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER))
+        return kzalloc(size, GFP_KERNEL);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    return vmalloc_huge(size, GFP_KERNEL | __GFP_ZERO);
+#else
+    /* no huge vmalloc mappings yet, kvfree releases either way */
+    return kvzalloc_node(size, GFP_KERNEL, NUMA_NO_NODE);
+#endif
+}
+EXPORT_SYMBOL_GPL(pcd_alloc_flat_buffer);
+
+void pcd_free_flat_buffer(void *buffer)
+{
+    kvfree(buffer);
+}
+EXPORT_SYMBOL_GPL(pcd_free_flat_buffer);
+
+/*
+ * sparse device buffer
+ * pages are allocated by the first write/mmap fault that touches them, holes read as zeros,
+ * so a large rgb,size only costs the memory that is actually used
+ * the xarray holds folios, one entry over all the indexes of a large one
+ */
+
+struct pcd_buffer *pcd_alloc_buffer(int size, int node)
+{
+    struct pcd_buffer *buffer = kmalloc(sizeof(*buffer), GFP_KERNEL);
+    if (!buffer)
+    {
+        return NULL;
+    }
+    buffer->size = size;
+    buffer->order = pcd_buffer_order(size);
+    buffer->node = node;
+    xa_init(&buffer->pages);
+    atomic_long_set(&buffer->nr_pages, 0);
+    return buffer;
+}
+EXPORT_SYMBOL_GPL(pcd_alloc_buffer);
+
+void pcd_free_buffer(struct pcd_buffer *buffer)
+{
+    struct folio *folio;
+    unsigned long index;
+
+    /* folios still mapped or shared with a resized buffer keep their other references */
+    xa_for_each(&buffer->pages, index, folio)
+        folio_put(folio);
+    xa_destroy(&buffer->pages);
+    kfree(buffer);
+}
+EXPORT_SYMBOL_GPL(pcd_free_buffer);
+
+/* pages allocated from now on come from node, the ones already there stay where they are */
+void pcd_buffer_set_node(struct pcd_buffer *buffer, int node)
+{
+    WRITE_ONCE(buffer->node, node);
+}
+EXPORT_SYMBOL_GPL(pcd_buffer_set_node);
+
+/* folio order of the device memory, a large order needs folios and multi-index xarray entries */
+static unsigned int pcd_buffer_order(int size)
+{
+#ifdef PCD_BUFFER_FOLIOS
+    if (!IS_ENABLED(CONFIG_XARRAY_MULTI) || !huge_min_size || ((unsigned int)size < huge_min_size))
+        return 0;
+    return min_t(unsigned int, PMD_ORDER, PCD_MAX_ORDER);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * folio for the range of index, from the node of the buffer
+ * an interleaved buffer takes the online nodes in turn, one folio each
+ */
+static struct folio *pcd_buffer_alloc_folio(struct pcd_buffer *buffer, gfp_t gfp, unsigned int order, pgoff_t index)
+{
+    int node = READ_ONCE(buffer->node);
+    unsigned int n;
+
+    if (node == PCD_NODE_INTERLEAVE)
+    {
+        n = (index >> order) % num_online_nodes();
+        node = first_online_node;
+        while (n-- && (node < MAX_NUMNODES))
+            node = next_online_node(node);
+        /* a node went offline under us */
+        if (node >= MAX_NUMNODES)
+            node = NUMA_NO_NODE;
+    }
+    /* no node follows the memory policy of the writer, local by default */
+    if (node == NUMA_NO_NODE)
+        return folio_alloc(gfp, order);
+    return __folio_alloc_node(gfp, order, node);
+}
+
+/* page at index, NULL for a hole */
+static struct page *pcd_buffer_lookup(struct pcd_buffer *buffer, pgoff_t index)
+{
+    struct folio *folio = xa_load(&buffer->pages, index);
+
+    return folio ? folio_page(folio, index & (folio_nr_pages(folio) - 1)) : NULL;
+}
+
+/*
+ * stores folio over the indexes starting at start, only if none of them has a page yet
+ * -EEXIST if one has, the folio isn't stored then
+ */
+static int pcd_buffer_store(struct pcd_buffer *buffer, pgoff_t start, struct folio *folio)
+{
+    XA_STATE_ORDER(xas, &buffer->pages, start, folio_order(folio));
+    void *old;
+
+    do
+    {
+        xas_lock(&xas);
+        old = xas_find_conflict(&xas);
+        if (!old)
+            xas_store(&xas, folio);
+        xas_unlock(&xas);
+    } while (xas_nomem(&xas, GFP_KERNEL));
+
+    if (old)
+        return -EEXIST;
+    if (xas_error(&xas))
+        return xas_error(&xas);
+    atomic_long_add(folio_nr_pages(folio), &buffer->nr_pages);
+    return 0;
+}
+
+/*
+ * copies the bytes of folio below end to single pages of buffer, the rest of them stays zero
+ * no large folio even if folio is one: it would reach past end, out of the device
+ */
+static int pcd_buffer_copy_head(struct pcd_buffer *buffer, struct folio *folio, pgoff_t start, loff_t end)
+{
+    size_t len = end - ((loff_t)start << PAGE_SHIFT);
+    struct folio *new_folio;
+    size_t chunk;
+    long i;
+    int ret;
+
+    for (i = 0; len; i++, len -= chunk)
+    {
+        chunk = min_t(size_t, len, PAGE_SIZE);
+        new_folio = pcd_buffer_alloc_folio(buffer, PCD_BUFFER_GFP, 0, start + i);
+        if (!new_folio)
+            return -ENOMEM;
+        memcpy_page(folio_page(new_folio, 0), 0, folio_page(folio, i), 0, chunk);
+        ret = pcd_buffer_store(buffer, start + i, new_folio);
+        if (ret)
+        {
+            folio_put(new_folio);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * copy of the buffer with a new size, used by a resize
+ * the pages inside both sizes are shared, not copied. the page holding the smaller end is copied
+ * up to it, so the bytes past it read as zeros when the device grows: after a shrink, and after
+ * mmap wrote past the old end of a grown device
+ */
+struct pcd_buffer *pcd_resize_buffer(struct pcd_buffer *buffer, int size)
+{
+    struct pcd_buffer *new_buffer = pcd_alloc_buffer(size, READ_ONCE(buffer->node));
+    pgoff_t last = DIV_ROUND_UP(size, PAGE_SIZE) - 1;
+    loff_t end = min(size, buffer->size);
+    struct folio *folio;
+    unsigned long index;
+    unsigned long nr;
+    pgoff_t start;
+
+    if (!new_buffer)
+        return NULL;
+
+    xa_for_each_range(&buffer->pages, index, folio, 0, last)
+    {
+        nr = folio_nr_pages(folio);
+        start = round_down(index, nr);
+        /* nothing past the smaller end is data */
+        if (((loff_t)start << PAGE_SHIFT) >= end)
+            continue;
+        if (((loff_t)(start + nr) << PAGE_SHIFT) > end)
+        {
+            if (pcd_buffer_copy_head(new_buffer, folio, start, end))
+                goto err_free;
+            continue;
+        }
+        folio_get(folio);
+        if (pcd_buffer_store(new_buffer, start, folio))
+        {
+            folio_put(folio);
+            goto err_free;
+        }
+    }
+    return new_buffer;
+err_free:
+    pcd_free_buffer(new_buffer);
+    return NULL;
+}
+EXPORT_SYMBOL_GPL(pcd_resize_buffer);
+
+/*
+ * page of the buffer at index, allocated if it isn't there yet
+ * no lock is needed, concurrent writers and mmap faults agree on one folio through
+ * pcd_buffer_store, a large folio only where all of it is inside the device
+ */
+struct page *pcd_buffer_page(struct pcd_buffer *buffer, pgoff_t index)
+{
+    unsigned int order = buffer->order;
+    struct folio *folio;
+    struct page *page;
+    int ret;
+
+    if (((loff_t)(round_down(index, 1UL << order) + (1UL << order)) << PAGE_SHIFT) > buffer->size)
+        order = 0;
+
+    for (;;)
+    {
+        page = pcd_buffer_lookup(buffer, index);
+        if (page)
+            return page;
+        /* no huge folio left is no error, the range gets single pages */
+        folio = order ? pcd_buffer_alloc_folio(buffer, PCD_BUFFER_GFP | __GFP_NORETRY | __GFP_NOWARN, order, index) : NULL;
+        if (!folio)
+        {
+            order = 0;
+            folio = pcd_buffer_alloc_folio(buffer, PCD_BUFFER_GFP, 0, index);
+            if (!folio)
+                return NULL;
+        }
+        ret = pcd_buffer_store(buffer, round_down(index, 1UL << order), folio);
+        if (!ret)
+            return folio_page(folio, index & ((1UL << order) - 1));
+        folio_put(folio);
+        if (ret != -EEXIST)
+            return NULL;
+        /* lost the race, or a page of the range is already there and the rest gets single pages */
+        order = 0;
+    }
+}
+EXPORT_SYMBOL_GPL(pcd_buffer_page);
+
+/* copies count bytes at pos to the iterator, nothing is allocated for holes */
+ssize_t pcd_buffer_read(struct pcd_buffer *buffer, loff_t pos, size_t count, struct iov_iter *to)
+{
+    struct page *page;
+    size_t offset;
+    size_t chunk;
+    size_t copied;
+    size_t done = 0;
+
+    while (done < count)
+    {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, count - done, PAGE_SIZE - offset);
+        page = pcd_buffer_lookup(buffer, (pos + done) >> PAGE_SHIFT);
+        copied = page ? copy_page_to_iter(page, offset, chunk, to) : iov_iter_zero(chunk, to);
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+    return done ? done : -EFAULT;
+}
+EXPORT_SYMBOL_GPL(pcd_buffer_read);
+
+/* copies count bytes from the iterator to pos, allocating the pages on the way */
+ssize_t pcd_buffer_write(struct pcd_buffer *buffer, loff_t pos, size_t count, struct iov_iter *from)
+{
+    struct page *page;
+    size_t offset;
+    size_t chunk;
+    size_t copied;
+    size_t done = 0;
+
+    while (done < count)
+    {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, count - done, PAGE_SIZE - offset);
+        page = pcd_buffer_page(buffer, (pos + done) >> PAGE_SHIFT);
+        if (!page)
+            return done ? done : -ENOMEM;
+        copied = copy_page_from_iter(page, offset, chunk, from);
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+    return done ? done : -EFAULT;
+}
+EXPORT_SYMBOL_GPL(pcd_buffer_write);
+
+/* sets count bytes at pos to c, filling with zeros doesn't allocate holes */
+ssize_t pcd_buffer_fill(struct pcd_buffer *buffer, loff_t pos, size_t count, int c)
+{
+    struct page *page;
+    size_t offset;
+    size_t chunk;
+    size_t done = 0;
+
+    while (done < count)
+    {
+        offset = offset_in_page(pos + done);
+        chunk = min_t(size_t, count - done, PAGE_SIZE - offset);
+        page = c ? pcd_buffer_page(buffer, (pos + done) >> PAGE_SHIFT) : pcd_buffer_lookup(buffer, (pos + done) >> PAGE_SHIFT);
+        if (page)
+            memset_page(page, offset, c, chunk);
+        else if (c)
+            return done ? done : -ENOMEM;
+        done += chunk;
+    }
+    return done;
+}
+EXPORT_SYMBOL_GPL(pcd_buffer_fill);
+
+/* bytes of memory the buffer holds */
+unsigned long pcd_buffer_resident(struct pcd_buffer *buffer)
+{
+    return atomic_long_read(&buffer->nr_pages) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(pcd_buffer_resident);
@@ -0,0 +1,305 @@
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/limits.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include "pcd_core.h"
+
+/*
+ * KUnit cases of the inline bounds, lseek and permission helpers of pcd_core.h and of the
+ * read/write engine built on them, every front end relies on them for its file positions.
+ * run with insmod pcd_core_kunit.ko after pcd_core.ko, or kunit.py run --kunitconfig on a tree
+ * that carries the modules
+ */
+
+#define PCD_TEST_SIZE 4096
+/* device of the engine cases, small enough to check every byte */
+#define PCD_TEST_ITER_SIZE 16
+/* bytes per transfer and iterations of the timed case */
+#define PCD_TEST_CHUNK 64
+#define PCD_TEST_LOOPS 100000
+
+/* the iov_iter directions got their names in 6.1 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,1,0)
+#define ITER_DEST READ
+#define ITER_SOURCE WRITE
+#endif
+
+/* KUNIT_CASE_SLOW came with 6.5, before it every case runs by default anyway */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+#define PCD_TEST_CASE_SLOW(test_name) KUNIT_CASE_SLOW(test_name)
+#else
+#define PCD_TEST_CASE_SLOW(test_name) KUNIT_CASE(test_name)
+#endif
+
+/* an offset that overflows base + offset must be refused before the addition */
+static void pcd_core_lseek_overflow(struct kunit *test)
+{
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, LLONG_MAX, SEEK_CUR, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(PCD_TEST_SIZE, LLONG_MAX, SEEK_CUR, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(LLONG_MAX, LLONG_MAX, SEEK_CUR, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, LLONG_MAX, SEEK_END, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, LLONG_MAX, SEEK_END, LLONG_MAX), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(PCD_TEST_SIZE, LLONG_MIN, SEEK_CUR, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, LLONG_MIN, SEEK_END, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, 1, SEEK_END, PCD_TEST_SIZE), -EINVAL);
+}
+
+/* a resulting position below 0 is refused, 0 itself is fine */
+static void pcd_core_lseek_negative(struct kunit *test)
+{
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, -1, SEEK_SET, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(10, -11, SEEK_CUR, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, -PCD_TEST_SIZE - 1, SEEK_END, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(10, -10, SEEK_CUR, PCD_TEST_SIZE), 0);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, -PCD_TEST_SIZE, SEEK_END, PCD_TEST_SIZE), 0);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, 0, SEEK_SET, PCD_TEST_SIZE), 0);
+}
+
+/* a position left past the end by a shrink counts from the new end, the end itself is valid */
+static void pcd_core_lseek_shrunk(struct kunit *test)
+{
+    loff_t pos = 2 * PCD_TEST_SIZE;
+
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(pos, 0, SEEK_CUR, PCD_TEST_SIZE), PCD_TEST_SIZE);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(pos, -1, SEEK_CUR, PCD_TEST_SIZE), PCD_TEST_SIZE - 1);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(pos, 1, SEEK_CUR, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(pos, PCD_TEST_SIZE, SEEK_SET, PCD_TEST_SIZE), PCD_TEST_SIZE);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(pos, PCD_TEST_SIZE + 1, SEEK_SET, PCD_TEST_SIZE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(pos, -PCD_TEST_SIZE, SEEK_CUR, PCD_TEST_SIZE), 0);
+    /* only SEEK_SET, SEEK_CUR and SEEK_END */
+    KUNIT_EXPECT_EQ(test, pcd_core_lseek(0, 0, SEEK_DATA, PCD_TEST_SIZE), -EINVAL);
+}
+
+/* a transfer is cut at the end, nothing is left at or past it */
+static void pcd_core_clamp_end(struct kunit *test)
+{
+    KUNIT_EXPECT_EQ(test, pcd_core_clamp(0, 10, PCD_TEST_SIZE), (size_t)10);
+    KUNIT_EXPECT_EQ(test, pcd_core_clamp(0, PCD_TEST_SIZE, PCD_TEST_SIZE), (size_t)PCD_TEST_SIZE);
+    KUNIT_EXPECT_EQ(test, pcd_core_clamp(PCD_TEST_SIZE - 5, 10, PCD_TEST_SIZE), (size_t)5);
+    KUNIT_EXPECT_EQ(test, pcd_core_clamp(0, SIZE_MAX, PCD_TEST_SIZE), (size_t)PCD_TEST_SIZE);
+    KUNIT_EXPECT_EQ(test, pcd_core_clamp(PCD_TEST_SIZE, 10, PCD_TEST_SIZE), (size_t)0);
+    KUNIT_EXPECT_EQ(test, pcd_core_clamp(PCD_TEST_SIZE + 1, 10, PCD_TEST_SIZE), (size_t)0);
+    KUNIT_EXPECT_EQ(test, pcd_core_clamp(LLONG_MAX, SIZE_MAX, PCD_TEST_SIZE), (size_t)0);
+    KUNIT_EXPECT_EQ(test, pcd_core_clamp(-1, 10, PCD_TEST_SIZE), (size_t)0);
+    KUNIT_EXPECT_EQ(test, pcd_core_clamp(0, 10, 0), (size_t)0);
+}
+
+/* every device permission against every access mode of an open */
+static void pcd_core_permission(struct kunit *test)
+{
+    static const fmode_t modes[] = {0, FMODE_READ, FMODE_WRITE, FMODE_READ | FMODE_WRITE};
+    static const struct {
+        int perm;
+        /* result per entry of modes */
+        int ret[ARRAY_SIZE(modes)];
+    } cases[] = {
+        {RDONLY, {-EPERM, 0, -EPERM, -EPERM}},
+        {WRONLY, {-EPERM, -EPERM, 0, -EPERM}},
+        {RDWR, {0, 0, 0, 0}},
+        /* anything else isn't a permission */
+        {0, {-EPERM, -EPERM, -EPERM, -EPERM}},
+        {0x100, {-EPERM, -EPERM, -EPERM, -EPERM}},
+    };
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++)
+    {
+        for (j = 0; j < ARRAY_SIZE(modes); j++)
+        {
+            KUNIT_EXPECT_EQ_MSG(test, pcd_core_check_permission(cases[i].perm, modes[j]), cases[i].ret[j],
+                    "perm 0x%x f_mode 0x%x", cases[i].perm, (unsigned int)modes[j]);
+        }
+    }
+}
+
+/* the engine only looks at ki_pos, no file behind the kiocb */
+static void pcd_core_test_kiocb(struct kiocb *iocb, loff_t pos)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->ki_pos = pos;
+}
+
+/* reads are cut at the end, 0 at or past it, the position moves by what was copied */
+static void pcd_core_read_iter_bounds(struct kunit *test)
+{
+    char buffer[PCD_TEST_ITER_SIZE];
+    char out[2 * PCD_TEST_ITER_SIZE];
+    struct kvec kvec[2] = {
+        { .iov_base = out, .iov_len = 3 },
+        { .iov_base = out + 3, .iov_len = sizeof(out) - 3 },
+    };
+    struct iov_iter to;
+    struct kiocb iocb;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(buffer); i++)
+        buffer[i] = i + 1;
+
+    /* every segment in one call */
+    memset(out, 0, sizeof(out));
+    pcd_core_test_kiocb(&iocb, 2);
+    iov_iter_kvec(&to, ITER_DEST, kvec, 2, 8);
+    KUNIT_EXPECT_EQ(test, pcd_core_read_iter(&iocb, &to, buffer, sizeof(buffer)), (ssize_t)8);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)10);
+    KUNIT_EXPECT_EQ(test, iov_iter_count(&to), (size_t)0);
+    KUNIT_EXPECT_EQ(test, memcmp(out, buffer + 2, 8), 0);
+
+    /* partial, only the bytes up to the end */
+    memset(out, 0, sizeof(out));
+    pcd_core_test_kiocb(&iocb, sizeof(buffer) - 5);
+    iov_iter_kvec(&to, ITER_DEST, kvec, 2, sizeof(out));
+    KUNIT_EXPECT_EQ(test, pcd_core_read_iter(&iocb, &to, buffer, sizeof(buffer)), (ssize_t)5);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)sizeof(buffer));
+    KUNIT_EXPECT_EQ(test, iov_iter_count(&to), sizeof(out) - 5);
+    KUNIT_EXPECT_EQ(test, memcmp(out, buffer + sizeof(buffer) - 5, 5), 0);
+    KUNIT_EXPECT_EQ(test, out[5], (char)0);
+
+    /* end of file at and past the end, the position stays */
+    pcd_core_test_kiocb(&iocb, sizeof(buffer));
+    iov_iter_kvec(&to, ITER_DEST, kvec, 2, sizeof(out));
+    KUNIT_EXPECT_EQ(test, pcd_core_read_iter(&iocb, &to, buffer, sizeof(buffer)), (ssize_t)0);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)sizeof(buffer));
+    pcd_core_test_kiocb(&iocb, 3 * sizeof(buffer));
+    iov_iter_kvec(&to, ITER_DEST, kvec, 2, sizeof(out));
+    KUNIT_EXPECT_EQ(test, pcd_core_read_iter(&iocb, &to, buffer, sizeof(buffer)), (ssize_t)0);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)(3 * sizeof(buffer)));
+    KUNIT_EXPECT_EQ(test, iov_iter_count(&to), sizeof(out));
+
+    /* nothing asked, nothing read */
+    pcd_core_test_kiocb(&iocb, 0);
+    iov_iter_kvec(&to, ITER_DEST, kvec, 2, 0);
+    KUNIT_EXPECT_EQ(test, pcd_core_read_iter(&iocb, &to, buffer, sizeof(buffer)), (ssize_t)0);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)0);
+}
+
+/* writes are cut at the end, -ENOSPC at or past it, the bytes around them are left alone */
+static void pcd_core_write_iter_bounds(struct kunit *test)
+{
+    char buffer[PCD_TEST_ITER_SIZE];
+    char in[2 * PCD_TEST_ITER_SIZE];
+    struct kvec kvec[2] = {
+        { .iov_base = in, .iov_len = 3 },
+        { .iov_base = in + 3, .iov_len = sizeof(in) - 3 },
+    };
+    struct iov_iter from;
+    struct kiocb iocb;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = i + 1;
+
+    /* every segment in one call */
+    memset(buffer, 0, sizeof(buffer));
+    pcd_core_test_kiocb(&iocb, 2);
+    iov_iter_kvec(&from, ITER_SOURCE, kvec, 2, 8);
+    KUNIT_EXPECT_EQ(test, pcd_core_write_iter(&iocb, &from, buffer, sizeof(buffer)), (ssize_t)8);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)10);
+    KUNIT_EXPECT_EQ(test, iov_iter_count(&from), (size_t)0);
+    KUNIT_EXPECT_EQ(test, memcmp(buffer + 2, in, 8), 0);
+    KUNIT_EXPECT_EQ(test, buffer[1], (char)0);
+    KUNIT_EXPECT_EQ(test, buffer[10], (char)0);
+
+    /* partial, only the bytes up to the end */
+    memset(buffer, 0, sizeof(buffer));
+    pcd_core_test_kiocb(&iocb, sizeof(buffer) - 5);
+    iov_iter_kvec(&from, ITER_SOURCE, kvec, 2, sizeof(in));
+    KUNIT_EXPECT_EQ(test, pcd_core_write_iter(&iocb, &from, buffer, sizeof(buffer)), (ssize_t)5);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)sizeof(buffer));
+    KUNIT_EXPECT_EQ(test, iov_iter_count(&from), sizeof(in) - 5);
+    KUNIT_EXPECT_EQ(test, memcmp(buffer + sizeof(buffer) - 5, in, 5), 0);
+    KUNIT_EXPECT_EQ(test, buffer[sizeof(buffer) - 6], (char)0);
+
+    /* no space at and past the end, the position stays */
+    pcd_core_test_kiocb(&iocb, sizeof(buffer));
+    iov_iter_kvec(&from, ITER_SOURCE, kvec, 2, sizeof(in));
+    KUNIT_EXPECT_EQ(test, pcd_core_write_iter(&iocb, &from, buffer, sizeof(buffer)), (ssize_t)-ENOSPC);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)sizeof(buffer));
+    pcd_core_test_kiocb(&iocb, 3 * sizeof(buffer));
+    iov_iter_kvec(&from, ITER_SOURCE, kvec, 2, sizeof(in));
+    KUNIT_EXPECT_EQ(test, pcd_core_write_iter(&iocb, &from, buffer, sizeof(buffer)), (ssize_t)-ENOSPC);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)(3 * sizeof(buffer)));
+    KUNIT_EXPECT_EQ(test, iov_iter_count(&from), sizeof(in));
+
+    /* an empty write succeeds even at the end */
+    pcd_core_test_kiocb(&iocb, sizeof(buffer));
+    iov_iter_kvec(&from, ITER_SOURCE, kvec, 2, 0);
+    KUNIT_EXPECT_EQ(test, pcd_core_write_iter(&iocb, &from, buffer, sizeof(buffer)), (ssize_t)0);
+    KUNIT_EXPECT_EQ(test, iocb.ki_pos, (loff_t)sizeof(buffer));
+}
+
+/* cost of a write and a read of one chunk through the engine, informational only */
+static void pcd_core_iter_timed(struct kunit *test)
+{
+    char chunk[PCD_TEST_CHUNK];
+    struct kvec kvec = { .iov_base = chunk, .iov_len = sizeof(chunk) };
+    struct iov_iter iter;
+    struct kiocb iocb;
+    ssize_t total = 0;
+    char *buffer;
+    u64 start;
+    u64 delta;
+    int i;
+
+    buffer = kunit_kzalloc(test, PCD_TEST_SIZE, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buffer);
+    memset(chunk, 0x5a, sizeof(chunk));
+
+    start = ktime_get_ns();
+    for (i = 0; i < PCD_TEST_LOOPS; i++)
+    {
+        /* every chunk of the device in turn */
+        pcd_core_test_kiocb(&iocb, (i * sizeof(chunk)) % PCD_TEST_SIZE);
+        iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, sizeof(chunk));
+        total += pcd_core_write_iter(&iocb, &iter, buffer, PCD_TEST_SIZE);
+        iocb.ki_pos -= sizeof(chunk);
+        iov_iter_kvec(&iter, ITER_DEST, &kvec, 1, sizeof(chunk));
+        total += pcd_core_read_iter(&iocb, &iter, buffer, PCD_TEST_SIZE);
+    }
+    delta = ktime_get_ns() - start;
+    KUNIT_EXPECT_EQ(test, total, (ssize_t)(2 * PCD_TEST_LOOPS * sizeof(chunk)));
+    kunit_info(test, "write_iter + read_iter of %d bytes: %llu ns/pair over %d pairs\n",
+            PCD_TEST_CHUNK, div_u64(delta, PCD_TEST_LOOPS), PCD_TEST_LOOPS);
+}
+
+static struct kunit_case pcd_core_test_cases[] = {
+    KUNIT_CASE(pcd_core_lseek_overflow),
+    KUNIT_CASE(pcd_core_lseek_negative),
+    KUNIT_CASE(pcd_core_lseek_shrunk),
+    KUNIT_CASE(pcd_core_clamp_end),
+    KUNIT_CASE(pcd_core_permission),
+    KUNIT_CASE(pcd_core_read_iter_bounds),
+    KUNIT_CASE(pcd_core_write_iter_bounds),
+    PCD_TEST_CASE_SLOW(pcd_core_iter_timed),
+    {}
+};
+
+static struct kunit_suite pcd_core_test_suite = {
+    .name = "pcd_core",
+    .test_cases = pcd_core_test_cases,
+};
+kunit_test_suite(pcd_core_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests of the pcd_core position and permission helpers and of its read/write engine");
+MODULE_AUTHOR("Ragab Hasssan");
@@ -0,0 +1,97 @@
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include "pcd_core.h"
+
+/*
+ * pcd_core, the I/O engine shared by the pcd front ends
+ * the front ends keep their device model, locking and tracepoints and call in here
+ * for the data path, so a fix or an optimization of it lands in every variant at once
+ */
+
+/* flat devices, one fixed size kernel buffer per device */
+loff_t pcd_core_llseek(struct file *filp, loff_t offset, int whence, loff_t size)
+{
+    loff_t pos = pcd_core_lseek(filp->f_pos, offset, whence, size);
+
+    if (pos < 0)
+        return pos;
+    filp->f_pos = pos;
+    return pos;
+}
+EXPORT_SYMBOL_GPL(pcd_core_llseek);
+
+ssize_t pcd_core_read_iter(struct kiocb *iocb, struct iov_iter *to, const char *buffer, loff_t size)
+{
+    size_t count = pcd_core_clamp(iocb->ki_pos, iov_iter_count(to), size);
+    size_t copied;
+
+    /* nothing to read at or past the end, pread() can pass any offset */
+    if (!count)
+        return 0;
+
+    /* every segment of the request in one call */
+    copied = copy_to_iter(buffer + iocb->ki_pos, count, to);
+    if (!copied)
+        return -EFAULT;
+
+    iocb->ki_pos += copied;
+    return copied;
+}
+EXPORT_SYMBOL_GPL(pcd_core_read_iter);
+
+ssize_t pcd_core_write_iter(struct kiocb *iocb, struct iov_iter *from, char *buffer, loff_t size)
+{
+    size_t count = iov_iter_count(from);
+    size_t copied;
+
+    if (!count)
+        return 0;
+
+    /* no space at or past the end, pwrite() can pass any offset */
+    count = pcd_core_clamp(iocb->ki_pos, count, size);
+    if (!count)
+        return -ENOSPC;
+
+    /* every segment of the request in one call */
+    copied = copy_from_iter(buffer + iocb->ki_pos, count, from);
+    if (!copied)
+        return -EFAULT;
+
+    iocb->ki_pos += copied;
+    return copied;
+}
+EXPORT_SYMBOL_GPL(pcd_core_write_iter);
+
+/* permission check of an open, private_data is stored in the file once it passes */
+int pcd_core_open(struct file *filp, int perm, void *private_data)
+{
+    int ret = pcd_core_check_permission(perm, filp->f_mode);
+
+    if (ret)
+        return ret;
+    filp->private_data = private_data;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(pcd_core_open);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("I/O engine, buffers and statistics shared by the pcd drivers");
+MODULE_AUTHOR("Ragab Hasssan");
@@ -0,0 +1,110 @@
+/*
+ * This file is part of Linux Device Drivers (LDD) project.
+ *
+ * Linux Device Drivers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Linux Device Drivers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include "pcd_core.h"
+
+/*
+ * per device I/O statistics
+ * every cpu updates its own counters, nothing is shared on the read/write paths,
+ * the readers of the statistics add them up
+ */
+
+/* accounts one read/write that asked for count bytes and returned ret */
+void pcd_stats_account(struct pcd_stats __percpu *pcpu_stats, int dir, size_t count, ssize_t ret)
+{
+    struct pcd_stats *stats;
+
+    /* blocked or interrupted calls didn't do anything */
+    if ((ret < 0) && (ret != -EFAULT))
+        return;
+
+    /* u64_stats writers must not be preempted by another writer of the same cpu */
+    stats = get_cpu_ptr(pcpu_stats);
+    u64_stats_update_begin(&stats->syncp);
+    if (ret == -EFAULT)
+    {
+        u64_stats_inc(&stats->efaults);
+    }
+    else if (dir == PCD_STATS_READ)
+    {
+        u64_stats_inc(&stats->reads);
+        u64_stats_add(&stats->bytes_read, ret);
+        if (ret < count)
+            u64_stats_inc(&stats->short_reads);
+    }
+    else
+    {
+        u64_stats_inc(&stats->writes);
+        u64_stats_add(&stats->bytes_written, ret);
+        if (ret < count)
+            u64_stats_inc(&stats->short_writes);
+    }
+    u64_stats_update_end(&stats->syncp);
+    put_cpu_ptr(pcpu_stats);
+}
+EXPORT_SYMBOL_GPL(pcd_stats_account);
+
+void pcd_stats_opened(struct pcd_stats __percpu *pcpu_stats)
+{
+    struct pcd_stats *stats = get_cpu_ptr(pcpu_stats);
+
+    u64_stats_update_begin(&stats->syncp);
+    u64_stats_inc(&stats->opens);
+    u64_stats_update_end(&stats->syncp);
+    put_cpu_ptr(pcpu_stats);
+}
+EXPORT_SYMBOL_GPL(pcd_stats_opened);
+
+/* sum of the counters of all cpus */
+void pcd_stats_snapshot(struct pcd_stats __percpu *pcpu_stats, struct pcd_stats_snapshot *snap)
+{
+    struct pcd_stats *stats;
+    unsigned int start;
+    u64 bytes_read, bytes_written, reads, writes, short_reads, short_writes, efaults, opens;
+    int cpu;
+
+    memset(snap, 0, sizeof(*snap));
+    for_each_possible_cpu(cpu)
+    {
+        stats = per_cpu_ptr(pcpu_stats, cpu);
+        /* the 64 bit counters can't be read in one go on 32 bit cpus */
+        do
+        {
+            start = u64_stats_fetch_begin(&stats->syncp);
+            bytes_read = u64_stats_read(&stats->bytes_read);
+            bytes_written = u64_stats_read(&stats->bytes_written);
+            reads = u64_stats_read(&stats->reads);
+            writes = u64_stats_read(&stats->writes);
+            short_reads = u64_stats_read(&stats->short_reads);
+            short_writes = u64_stats_read(&stats->short_writes);
+            efaults = u64_stats_read(&stats->efaults);
+            opens = u64_stats_read(&stats->opens);
+        } while (u64_stats_fetch_retry(&stats->syncp, start));
+
+        snap->bytes_read += bytes_read;
+        snap->bytes_written += bytes_written;
+        snap->reads += reads;
+        snap->writes += writes;
+        snap->short_reads += short_reads;
+        snap->short_writes += short_writes;
+        snap->efaults += efaults;
+        snap->opens += opens;
+    }
+}
+EXPORT_SYMBOL_GPL(pcd_stats_snapshot);
@@ -0,0 +1,366 @@
+#!/bin/bash
+
+#####################################################################################
+# This file is part of Linux Device Drivers (LDD) project.                          #
+#                                                                                   #
+# Linux Device Drivers is free software: you can redistribute it and/or modify      #
+# it under the terms of the GNU General Public License as published by              #
+# the Free Software Foundation, either version 3 of the License, or                 #
+# (at your option) any later version.                                               #
+#                                                                                   #
+# Linux Device Drivers is distributed in the hope that it will be useful,           #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of                    #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                      #
+# GNU General Public License for more details.                                      #
+#                                                                                   #
+# You should have received a copy of the GNU General Public License                 #
+# along with Linux Device Drivers. If not, see <https://www.gnu.org/licenses/>.     #
+#####################################################################################
+
+# runs inside the VM started by VmTest.sh, from the repository root
+# loads every selected module, runs its functional checks and benchmarks
+# and leaves summary.txt, guest.log, dmesg.txt and bench_*.csv in the output directory
+
+# results directory, shared read/write with the host
+OUT_DIR="vm_results"
+# module directories to test, by number
+ONLY="001 002 003 004 005 006 007 008"
+# extra pcd_bench.elf options
+BENCH_ARGS="-d 1"
+# the device tree carries pcd_vm.dtso, 005/006 probe from DT and 007/008 get their gpios
+IS_DT="NO"
+
+# 005/006 take their devices from pcd_device_setup.ko without a device tree
+SETUP="YES"
+
+PASS=0
+FAIL=0
+SKIP=0
+
+BENCH="./pcd_bench/pcd_bench.elf"
+GPIO_BENCH="./gpio_bench/gpio_bench.elf"
+# the toggle rate only needs a short run
+GPIO_BENCH_ARGS="-d 1"
+
+usage() {
+  echo "Usage: $0 [--out=DIR] [--only=LIST] [--bench=ARGS] [--dt]"
+  echo "  --out     results directory, default ${OUT_DIR}"
+  echo "  --only    comma separated module numbers, default all"
+  echo "  --bench   extra pcd_bench.elf options, default \"${BENCH_ARGS}\""
+  echo "  --dt      the guest booted with pcd_vm.dtso applied"
+}
+
+while [[ $# -gt 0 ]]; do
+    case $1 in
+        --out=*)
+            OUT_DIR="${1#*=}"
+            shift
+        ;;
+        --only=*)
+            ONLY="${1#*=}"
+            ONLY="${ONLY//,/ }"
+            shift
+        ;;
+        --bench=*)
+            BENCH_ARGS="${1#*=}"
+            shift
+        ;;
+        --dt)
+            IS_DT="YES"
+            SETUP="NO"
+            shift
+        ;;
+        *)
+            echo "Invalid option: $1"
+            usage
+            exit 1
+        ;;
+    esac
+done
+
+mkdir -p "${OUT_DIR}"
+: > "${OUT_DIR}/summary.txt"
+: > "${OUT_DIR}/guest.log"
+
+# the minimal VM root has none of these mounted
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+# record a result line
+result() {
+    echo "$1 $2" | tee -a "${OUT_DIR}/summary.txt"
+    case $1 in
+        PASS) PASS=$((PASS + 1)) ;;
+        FAIL) FAIL=$((FAIL + 1)) ;;
+        SKIP) SKIP=$((SKIP + 1)) ;;
+    esac
+}
+
+# check NAME COMMAND..., the command output goes to guest.log
+check() {
+    local name=$1
+    shift
+    echo "### ${name}: $*" >> "${OUT_DIR}/guest.log"
+    if "$@" >> "${OUT_DIR}/guest.log" 2>&1; then
+        result PASS "${name}"
+    else
+        result FAIL "${name}"
+    fi
+}
+
+# the device nodes show up once the (asynchronous) probes are done
+wait_nodes() {
+    local i
+    for i in $(seq 50); do
+        compgen -G "$1" > /dev/null && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# write 32 bytes, the smallest pcd device, and read them back
+roundtrip() {
+    local pattern="${OUT_DIR}/pattern"
+    head -c 32 /dev/urandom > "${pattern}"
+    cat "${pattern}" > "$1" && head -c 32 "$1" | cmp - "${pattern}"
+}
+
+# bench NAME DEVICE... [-- pcd_bench options]
+bench() {
+    local name=$1
+    shift
+    echo "### bench ${name}: $*" >> "${OUT_DIR}/guest.log"
+    if ${BENCH} ${BENCH_ARGS} -l "${name}" "$@" > "${OUT_DIR}/bench_${name}.csv" 2>> "${OUT_DIR}/guest.log"; then
+        result PASS "bench ${name}"
+    else
+        result FAIL "bench ${name}"
+    fi
+}
+
+test_001() {
+    check "001 insmod" insmod 001hello_world/main.ko
+    check "001 rmmod" rmmod main
+}
+
+test_002() {
+    check "002 insmod" insmod 002pseudo_char_driver/pcd.ko
+    check "002 node" wait_nodes /dev/pcd
+    check "002 roundtrip" roundtrip /dev/pcd
+    bench 002 -m read,write,randread,randwrite,readv,splice,openclose,lseek -b 1,16,128,512 -t 1,4 /dev/pcd
+    check "002 rmmod" rmmod pcd
+}
+
+test_003() {
+    local dev
+    check "003 insmod" insmod 003_psedudo_char_driver_multiple/pcd_n.ko
+    check "003 nodes" wait_nodes /dev/pcd-3
+    # pcd-0 is read only and pcd-1 write only
+    check "003 pcd-0 rejects writers" bash -c "! true 3> /dev/pcd-0"
+    check "003 pcd-1 rejects readers" bash -c "! true 3< /dev/pcd-1"
+    for dev in /dev/pcd-2 /dev/pcd-3; do
+        check "003 roundtrip ${dev}" roundtrip ${dev}
+    done
+    bench 003 -m read,write,randread,readv,openclose,lseek -b 1,16,128,512 -t 1,4 /dev/pcd-2 /dev/pcd-3
+    check "003 rmmod" rmmod pcd_n
+
+    # pcd-2/pcd-3 as FIFOs, a reader gets what the writer queued
+    check "003 insmod fifo" insmod 003_psedudo_char_driver_multiple/pcd_n.ko fifo_devices=0xc
+    check "003 fifo nodes" wait_nodes /dev/pcd-3
+    check "003 fifo roundtrip" roundtrip /dev/pcd-2
+    check "003 rmmod fifo" rmmod pcd_n
+}
+
+# platform drivers, the devices come from pcd_device_setup unless setup is NO (the DT has them)
+test_platform() {
+    local num=$1
+    local dir=$2
+    local drv=$3
+    local modes=$4
+    local setup=$5
+    local dev
+
+    check "${num} insmod" insmod ${dir}/${drv}.ko
+    if [[ "NO" != ${setup} ]]; then
+        check "${num} insmod setup" insmod ${dir}/pcd_device_setup.ko
+    fi
+    check "${num} nodes" wait_nodes "/dev/rgbpcdev-*"
+    for dev in /dev/rgbpcdev-*; do
+        check "${num} roundtrip ${dev}" roundtrip ${dev}
+    done
+    bench ${num} -m ${modes} -b 1,16,128,512 -t 1,2,4 /dev/rgbpcdev-*
+}
+
+test_004() {
+    # no DT support, always from pcd_device_setup
+    test_platform 004 004_pcd_platform_driver pcd_platform_driver read,write,randread,readv,openclose YES
+    check "004 rmmod" rmmod pcd_device_setup pcd_platform_driver
+}
+
+test_005() {
+    test_platform 005 005_pcd_platform_driver_dt pcd_platform_driver_dt read,write,randread,readv,openclose ${SETUP}
+    if [[ "NO" != ${SETUP} ]]; then
+        check "005 rmmod setup" rmmod pcd_device_setup
+    fi
+    check "005 rmmod" rmmod pcd_platform_driver_dt
+}
+
+test_006() {
+    local sysfs
+    local node
+    local dbg=/sys/kernel/debug/pcd_sysfs
+
+    test_platform 006 006_pcd_platform_sysfs pcd_sysfs read,write,randread,randwrite,readv,writev,mmap,splice,openclose,lseek ${SETUP}
+    sysfs=/sys/class/rgb_chrdev_class/rgbpcdev-0
+
+    check "006 sysfs attributes" test -r ${sysfs}/max_size -a -r ${sysfs}/serial_number -a -d ${sysfs}/stats
+    check "006 resize" bash -c "echo 256 > ${sysfs}/max_size && grep -qx 256 ${sysfs}/max_size"
+    check "006 stats count reads" bash -c "[[ \$(cat ${sysfs}/stats/reads) -gt 0 ]]"
+
+    # wakeup latency and concurrent resizes, the smallest device can't hold them
+    bench 006_poll -m poll -b 8,64 /dev/rgbpcdev-0 /dev/rgbpcdev-1
+    bench 006_resize -m read,write -b 16 -t 4 -R 256,512 /dev/rgbpcdev-0 /dev/rgbpcdev-1
+
+    # the same run with the latency histograms off and on gives their overhead
+    if [[ -w ${dbg}/latency_enable ]]; then
+        bench 006_latency_off -m read,write -b 16 -t 1,4 /dev/rgbpcdev-1
+        echo 1 > ${dbg}/latency_enable
+        bench 006_latency_on -m read,write -b 16 -t 1,4 /dev/rgbpcdev-1
+        echo 0 > ${dbg}/latency_enable
+        cp ${dbg}/latency "${OUT_DIR}/006_latency.txt"
+        cp ${dbg}/stats "${OUT_DIR}/006_stats.txt"
+    else
+        result SKIP "006 latency histograms, no debugfs"
+    fi
+
+    if [[ "NO" != ${SETUP} ]]; then
+        check "006 rmmod setup" rmmod pcd_device_setup
+        # asynchronous probe of many devices, pcd_device_setup logs how long it took
+        check "006 probe 1000 instances" insmod 006_pcd_platform_sysfs/pcd_device_setup.ko instances=1000
+        dmesg | grep "pcd_device_setup" | tail -n 2 >> "${OUT_DIR}/006_probe.txt"
+        check "006 rmmod 1000 instances" rmmod pcd_device_setup
+
+        # one 64MiB device read and written from node 0, its buffer on node 0 then on node 1
+        if [[ -d /sys/devices/system/node/node1 ]]; then
+            for node in 0 1; do
+                check "006 insmod numa ${node}" insmod 006_pcd_platform_sysfs/pcd_device_setup.ko instances=1
+                check "006 numa ${node} nodes" wait_nodes "/dev/rgbpcdev-0"
+                # before the first open, every page of the buffer comes from the node
+                check "006 buffer_node ${node}" bash -c "echo ${node} > ${sysfs}/buffer_node && echo 67108864 > ${sysfs}/max_size"
+                bench 006_numa_node${node} -m read,write -b 65536 -t 1,4 -N 0 /dev/rgbpcdev-0
+                check "006 rmmod numa ${node}" rmmod pcd_device_setup
+            done
+        else
+            result SKIP "006 numa placement, one node, see VmTest.sh --numa"
+        fi
+    fi
+    check "006 rmmod" rmmod pcd_sysfs
+}
+
+test_007() {
+    local gpio=/sys/class/bone-gpios
+    check "007 insmod" insmod 007_sysfs_gpio/gpio_sysfs_drv.ko
+    if [[ "YES" == ${IS_DT} ]]; then
+        check "007 gpio devices" wait_nodes "${gpio}/gpio1.0"
+        check "007 direction" bash -c "echo out > ${gpio}/gpio1.0/direction && grep -qx out ${gpio}/gpio1.0/direction"
+        check "007 debounce dt" grep -qx 5000 ${gpio}/gpio1.7/debounce
+        check "007 value" bash -c "echo 1 > ${gpio}/gpio1.0/value && grep -qx 1 ${gpio}/gpio1.0/value"
+        # every line of the instance in one syscall against one line per open/write/close
+        check "007 char device" wait_nodes "/dev/bone-gpio0"
+        check "007 char device write" bash -c "printf '\\x03' > /dev/bone-gpio0 && grep -qx 1 ${gpio}/gpio1.1/value"
+        # the whole port in one array set, then only its high nibble
+        check "007 values" bash -c "echo 0xa5 > ${gpio}/bone-gpio0/values && grep -qx 0xa5 ${gpio}/bone-gpio0/values"
+        check "007 values mask" bash -c "echo '0x30 0xf0' > ${gpio}/bone-gpio0/values && grep -qx 0x35 ${gpio}/bone-gpio0/values"
+        echo "### bench 007: toggle rate" >> "${OUT_DIR}/guest.log"
+        if ${GPIO_BENCH} ${GPIO_BENCH_ARGS} -l 007 -c /dev/bone-gpio0 -s ${gpio}/gpio1.0/value > "${OUT_DIR}/bench_007.csv" 2>> "${OUT_DIR}/guest.log"; then
+            result PASS "bench 007"
+        else
+            result FAIL "bench 007"
+        fi
+        # edge events of an input line, gpio-sim pulls it and fires the irq
+        local pull
+        pull=$(compgen -G "/sys/devices/platform/*gpio-sim*/gpiochip*/sim_gpio0/pull" | head -1)
+        if [[ -n ${pull} ]]; then
+            check "007 edge" bash -c "echo in > ${gpio}/gpio1.0/direction && echo both > ${gpio}/gpio1.0/edge && grep -qx both ${gpio}/gpio1.0/edge"
+            check "007 edge irq" bash -c "echo pull-up > ${pull} && grep -qx 1 ${gpio}/gpio1.0/value && grep -q gpio1.0 /proc/interrupts"
+            echo "### bench 007: edge event round trip" >> "${OUT_DIR}/guest.log"
+            if ${GPIO_BENCH} ${GPIO_BENCH_ARGS} -l 007 -c /dev/bone-gpio0 -p "${pull}" -m chardev-events > "${OUT_DIR}/bench_007_events.csv" 2>> "${OUT_DIR}/guest.log"; then
+                result PASS "bench 007 events"
+            else
+                result FAIL "bench 007 events"
+            fi
+            # 4 glitches before every edge, the software filter of gpio-sim lines leaves one event each
+            check "007 debounce" bash -c "echo 20000 > ${gpio}/gpio1.0/debounce && grep -qx 20000 ${gpio}/gpio1.0/debounce"
+            echo "### bench 007: debounced edges" >> "${OUT_DIR}/guest.log"
+            if ${GPIO_BENCH} ${GPIO_BENCH_ARGS} -l 007-debounce -c /dev/bone-gpio0 -p "${pull}" -b 4 -m chardev-events > "${OUT_DIR}/bench_007_debounce.csv" 2>> "${OUT_DIR}/guest.log"; then
+                result PASS "bench 007 debounce"
+            else
+                result FAIL "bench 007 debounce"
+            fi
+            check "007 debounce off" bash -c "echo 0 > ${gpio}/gpio1.0/debounce"
+            check "007 edge none" bash -c "echo none > ${gpio}/gpio1.0/edge && echo out > ${gpio}/gpio1.0/direction"
+        else
+            result SKIP "007 edge events, no gpio-sim pull attribute"
+        fi
+        # a 1kHz PWM and a 2 line pattern in step, the engine wake up lateness with every cpu busy
+        local wave=${gpio}/bone-gpio0
+        local load=()
+        local i
+        check "007 waveform" bash -c "echo 'pwm 1000000 250000' > ${gpio}/gpio1.2/waveform && echo 'pattern 500000 0x6 4' > ${gpio}/gpio1.4/waveform && echo 'pattern 500000 0x3 4' > ${gpio}/gpio1.5/waveform && grep -qx 'pwm 1000000 250000' ${gpio}/gpio1.2/waveform"
+        check "007 waveforms start" bash -c "echo start > ${wave}/waveforms && grep -qx running ${wave}/waveforms"
+        for i in $(seq "$(nproc)"); do
+            timeout 2 sh -c 'while :; do :; done' &
+            load+=($!)
+        done
+        wait "${load[@]}"
+        check "007 waveform jitter" test "$(cat ${wave}/jitter/samples)" -gt 0
+        for i in samples min_ns max_ns mean_ns p99_ns overruns; do
+            echo "${i},$(cat ${wave}/jitter/${i})"
+        done > "${OUT_DIR}/bench_007_wave.csv"
+        check "007 waveforms stop" bash -c "echo stop > ${wave}/waveforms && grep -qx stopped ${wave}/waveforms"
+        for i in 2 4 5; do
+            echo none > ${gpio}/gpio1.${i}/waveform
+        done
+    else
+        result SKIP "007 gpio devices, no device tree"
+    fi
+    check "007 rmmod" rmmod gpio_sysfs_drv
+}
+
+# the lcd driver is a skeleton without a char device yet, only loading is checked
+test_008() {
+    check "008 insmod" insmod 008_16x2_char_lcd_ioctl/lcd_16x2.ko
+    check "008 rmmod" rmmod lcd_16x2
+}
+
+# 002-006 take their I/O engine, buffers and statistics from pcd_core, built by their Makefiles
+if [[ -f pcd_core/pcd_core.ko ]]; then
+    check "pcd_core insmod" insmod pcd_core/pcd_core.ko
+fi
+
+# the KUnit suite of pcd_core runs at insmod, after pcd_core.ko, the guest kernel needs KUnit for it
+kunit_pcd_core() {
+    local results=/sys/kernel/debug/kunit/pcd_core/results
+    insmod pcd_core/pcd_core_kunit.ko || return 1
+    cat "${results}"
+    grep -q "^ok [0-9]* pcd_core" "${results}"
+}
+if [[ -f pcd_core/pcd_core_kunit.ko ]]; then
+    check "pcd_core kunit" kunit_pcd_core
+    rmmod pcd_core_kunit 2> /dev/null
+fi
+
+for num in ${ONLY}; do
+    if [[ $(type -t test_${num}) != "function" ]]; then
+        result SKIP "${num} unknown module"
+        continue
+    fi
+    test_${num}
+done
+
+if lsmod | grep -q "^pcd_core "; then
+    check "pcd_core rmmod" rmmod pcd_core
+fi
+
+dmesg > "${OUT_DIR}/dmesg.txt"
+echo "passed ${PASS} failed ${FAIL} skipped ${SKIP}" | tee -a "${OUT_DIR}/summary.txt"
+[[ ${FAIL} -eq 0 ]]